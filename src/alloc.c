@@ -0,0 +1,182 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <uwsc/log.h>
+
+#include "alloc.h"
+
+#ifdef RTTY_ALLOC_STATS
+
+struct alloc_hdr {
+    size_t size;
+    int tag;
+} __attribute__((aligned(16)));
+
+struct alloc_stats alloc_stats[RTTY_MEM_MAX];
+
+static const char *tag_names[RTTY_MEM_MAX] = {
+    [RTTY_MEM_SESSION] = "session",
+    [RTTY_MEM_TASK] = "task",
+    [RTTY_MEM_REPLY] = "reply",
+    [RTTY_MEM_JSON] = "json",
+    [RTTY_MEM_RECORD] = "record",
+    [RTTY_MEM_HISTORY] = "history"
+};
+
+static uint64_t messages;
+static int hot_assert = -1;
+
+static void account(int tag, int64_t size)
+{
+    struct alloc_stats *st = &alloc_stats[tag];
+    int64_t live = __sync_add_and_fetch(&st->live, size);
+
+    if (size > 0) {
+        __sync_fetch_and_add(&st->allocs, 1);
+
+        /* A lost race only makes the peak slightly low */
+        if (live > st->peak)
+            st->peak = live;
+    } else {
+        __sync_fetch_and_add(&st->frees, 1);
+    }
+}
+
+void *rtty_malloc(int tag, size_t size)
+{
+    struct alloc_hdr *h = malloc(sizeof(struct alloc_hdr) + size);
+
+    if (!h)
+        return NULL;
+
+    h->size = size;
+    h->tag = tag;
+    account(tag, size);
+
+    return h + 1;
+}
+
+void *rtty_calloc(int tag, size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (size && nmemb > SIZE_MAX / size)
+        return NULL;
+
+    p = rtty_malloc(tag, nmemb * size);
+    if (p)
+        memset(p, 0, nmemb * size);
+
+    return p;
+}
+
+void *rtty_realloc(int tag, void *ptr, size_t size)
+{
+    struct alloc_hdr *h;
+
+    if (!ptr)
+        return rtty_malloc(tag, size);
+
+    h = (struct alloc_hdr *)ptr - 1;
+    account(h->tag, -(int64_t)h->size);
+
+    h = realloc(h, sizeof(struct alloc_hdr) + size);
+    if (!h) {
+        /* The old block is still valid */
+        h = (struct alloc_hdr *)ptr - 1;
+        account(h->tag, h->size);
+        return NULL;
+    }
+
+    h->size = size;
+    account(h->tag, size);
+
+    return h + 1;
+}
+
+void rtty_free(void *ptr)
+{
+    struct alloc_hdr *h;
+
+    if (!ptr)
+        return;
+
+    h = (struct alloc_hdr *)ptr - 1;
+    account(h->tag, -(int64_t)h->size);
+    free(h);
+}
+
+void alloc_count_message()
+{
+    messages++;
+}
+
+uint64_t alloc_total()
+{
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < RTTY_MEM_MAX; i++)
+        total += alloc_stats[i].allocs;
+
+    return total;
+}
+
+void alloc_hot_check(uint64_t start, const char *name)
+{
+    uint64_t n;
+
+    if (hot_assert < 0)
+        hot_assert = !!getenv("RTTY_ALLOC_ASSERT");
+
+    if (!hot_assert)
+        return;
+
+    n = alloc_total() - start;
+    if (n) {
+        uwsc_log_err("%s allocated %llu times\n", name, (unsigned long long)n);
+        abort();
+    }
+}
+
+void alloc_stats_put(struct buffer *b)
+{
+    int i;
+
+    buffer_put_printf(b, "\"alloc\":{\"messages\":%llu,\"per_message\":%.2f",
+        (unsigned long long)messages, messages ? alloc_total() * 1.0 / messages : 0);
+
+    for (i = 0; i < RTTY_MEM_MAX; i++) {
+        struct alloc_stats *st = &alloc_stats[i];
+
+        buffer_put_printf(b, ",\"%s\":{\"live\":%lld,\"peak\":%lld,\"allocs\":%llu,\"frees\":%llu}",
+            tag_names[i], (long long)st->live, (long long)st->peak,
+            (unsigned long long)st->allocs, (unsigned long long)st->frees);
+    }
+
+    buffer_put_printf(b, "}");
+}
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _ALLOC_H
+#define _ALLOC_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "config.h"
+
+enum {
+    RTTY_MEM_SESSION,   /* tty_session and observers */
+    RTTY_MEM_TASK,      /* Commands */
+    RTTY_MEM_REPLY,     /* Command results */
+    RTTY_MEM_JSON,      /* Parsed messages */
+    RTTY_MEM_RECORD,    /* Session recording */
+    RTTY_MEM_HISTORY,   /* Session history */
+    RTTY_MEM_MAX
+};
+
+#ifdef RTTY_ALLOC_STATS
+
+#include <uwsc/buffer.h>
+
+struct alloc_stats {
+    int64_t live;
+    int64_t peak;
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+extern struct alloc_stats alloc_stats[RTTY_MEM_MAX];
+
+/*
+ * Every block carries a small header with its size and tag, so rtty_free()
+ * needs no tag. Counters are updated atomically because the recorder
+ * frees chunks in its own thread.
+ */
+void *rtty_malloc(int tag, size_t size);
+void *rtty_calloc(int tag, size_t nmemb, size_t size);
+void *rtty_realloc(int tag, void *ptr, size_t size);
+void rtty_free(void *ptr);
+
+/* Called for every message received from the server */
+void alloc_count_message();
+
+/* Append "alloc":{...} to a stats reply */
+void alloc_stats_put(struct buffer *b);
+
+uint64_t alloc_total();
+
+/*
+ * With RTTY_ALLOC_ASSERT set in the environment, abort if the code between
+ * ALLOC_HOT_BEGIN and ALLOC_HOT_END allocated. Used to prove that the data
+ * paths stay allocation free under benchmarks.
+ */
+void alloc_hot_check(uint64_t start, const char *name);
+
+#define ALLOC_HOT_BEGIN()       uint64_t __hot_allocs = alloc_total()
+#define ALLOC_HOT_END(name)     alloc_hot_check(__hot_allocs, name)
+
+#else
+
+#define rtty_malloc(tag, size)          malloc(size)
+#define rtty_calloc(tag, nmemb, size)   calloc(nmemb, size)
+#define rtty_realloc(tag, ptr, size)    realloc(ptr, size)
+#define rtty_free(ptr)                  free(ptr)
+
+#define alloc_count_message()   do {} while (0)
+#define ALLOC_HOT_BEGIN()       do {} while (0)
+#define ALLOC_HOT_END(name)     do {} while (0)
+
+#endif
+
+#endif
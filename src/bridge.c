@@ -0,0 +1,384 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <uwsc/log.h>
+
+#include "list.h"
+#include "proto.h"
+#include "bridge.h"
+
+#define BRIDGE_HDR_LEN  7
+
+struct bridge_channel {
+    struct list_head list;
+    int id;
+    double tokens;          /* Token bucket of the quota */
+    ev_tstamp last;
+};
+
+struct bridge_client {
+    struct list_head list;
+    struct ev_io ior;
+    struct ev_io iow;
+    struct buffer rb;
+    struct buffer wb;
+    int subs[RTTY_BRIDGE_MAX_SUBS];
+    int nsubs;
+};
+
+static struct ev_loop *bridge_loop;
+static struct uwsc_client *uplink;
+static struct ev_io accept_watcher;
+static struct ev_timer resume_timer;
+static LIST_HEAD(clients);
+static LIST_HEAD(channels);
+static int nclients;
+static bool paused;
+
+static void client_free(struct bridge_client *c)
+{
+    ev_io_stop(bridge_loop, &c->ior);
+    ev_io_stop(bridge_loop, &c->iow);
+    close(c->ior.fd);
+
+    buffer_free(&c->rb);
+    buffer_free(&c->wb);
+
+    list_del(&c->list);
+    free(c);
+
+    nclients--;
+}
+
+static void client_send(struct bridge_client *c, int op, int channel, const void *data, int len)
+{
+    uint8_t hdr[BRIDGE_HDR_LEN];
+    uint32_t n = htonl(len);
+
+    /* Drop messages for an agent that does not read them */
+    if (buffer_length(&c->wb) > RTTY_BRIDGE_MAX_BACKLOG)
+        return;
+
+    hdr[0] = op;
+    hdr[1] = channel >> 8;
+    hdr[2] = channel & 0xff;
+    memcpy(hdr + 3, &n, 4);
+
+    buffer_put_data(&c->wb, hdr, BRIDGE_HDR_LEN);
+    buffer_put_data(&c->wb, data, len);
+    ev_io_start(bridge_loop, &c->iow);
+}
+
+static void client_err(struct bridge_client *c, int channel, const char *msg)
+{
+    client_send(c, BRIDGE_OP_ERR, channel, msg, strlen(msg));
+}
+
+static struct bridge_channel *find_channel(int id)
+{
+    struct bridge_channel *ch;
+
+    list_for_each_entry(ch, &channels, list) {
+        if (ch->id == id)
+            return ch;
+    }
+
+    ch = calloc(1, sizeof(struct bridge_channel));
+    if (!ch)
+        return NULL;
+
+    ch->id = id;
+    ch->tokens = RTTY_BRIDGE_BURST;
+    ch->last = ev_now(bridge_loop);
+    list_add_tail(&ch->list, &channels);
+
+    return ch;
+}
+
+static bool channel_consume(struct bridge_channel *ch, int len)
+{
+    ev_tstamp now = ev_now(bridge_loop);
+
+    ch->tokens += (now - ch->last) * RTTY_BRIDGE_RATE;
+    if (ch->tokens > RTTY_BRIDGE_BURST)
+        ch->tokens = RTTY_BRIDGE_BURST;
+    ch->last = now;
+
+    if (ch->tokens < len)
+        return false;
+
+    ch->tokens -= len;
+    return true;
+}
+
+static void bridge_publish(struct bridge_client *c, int channel, uint8_t *data, int len)
+{
+    static uint8_t buf[RTTY_FRAME_MAX_HDRLEN + RTTY_BRIDGE_MAX_MSG];
+    struct bridge_channel *ch;
+    int hdrlen;
+
+    if (!uplink || !proto_has(RTTY_FEAT_FRAME_V2 | RTTY_FEAT_CHANNEL)) {
+        client_err(c, channel, "not connected");
+        return;
+    }
+
+    ch = find_channel(channel);
+    if (!ch || !channel_consume(ch, len)) {
+        client_err(c, channel, "quota exceeded");
+        return;
+    }
+
+    memcpy(buf + RTTY_FRAME_MAX_HDRLEN, data, len);
+    hdrlen = proto_frame_header(buf + RTTY_FRAME_MAX_HDRLEN, RTTY_FRAME_CHANNEL, channel, 0, 0);
+    uplink->send(uplink, buf + RTTY_FRAME_MAX_HDRLEN - hdrlen, len + hdrlen, UWSC_OP_BINARY);
+}
+
+static void client_subscribe(struct bridge_client *c, int channel, bool sub)
+{
+    int i;
+
+    for (i = 0; i < c->nsubs; i++) {
+        if (c->subs[i] == channel)
+            break;
+    }
+
+    if (sub) {
+        if (i < c->nsubs)
+            return;
+        if (c->nsubs == RTTY_BRIDGE_MAX_SUBS) {
+            client_err(c, channel, "too many subscriptions");
+            return;
+        }
+        c->subs[c->nsubs++] = channel;
+    } else if (i < c->nsubs) {
+        c->subs[i] = c->subs[--c->nsubs];
+    }
+}
+
+/* Returns false if the client has to be dropped */
+static bool client_parse(struct bridge_client *c)
+{
+    struct buffer *b = &c->rb;
+    uint8_t *hdr;
+    uint32_t len;
+    int op, channel;
+
+    while (buffer_length(b) >= BRIDGE_HDR_LEN) {
+        hdr = buffer_data(b);
+        op = hdr[0];
+        channel = (hdr[1] << 8) | hdr[2];
+        memcpy(&len, hdr + 3, 4);
+        len = ntohl(len);
+
+        if (len > RTTY_BRIDGE_MAX_MSG)
+            return false;
+
+        if (buffer_length(b) < BRIDGE_HDR_LEN + len)
+            break;
+
+        switch (op) {
+        case BRIDGE_OP_SUB:
+        case BRIDGE_OP_UNSUB:
+            client_subscribe(c, channel, op == BRIDGE_OP_SUB);
+            break;
+        case BRIDGE_OP_PUB:
+            bridge_publish(c, channel, hdr + BRIDGE_HDR_LEN, len);
+            break;
+        default:
+            return false;
+        }
+
+        buffer_pull(b, NULL, BRIDGE_HDR_LEN + len);
+    }
+
+    return true;
+}
+
+static bool uplink_congested()
+{
+    return uplink && buffer_length(&uplink->wb) > RTTY_BRIDGE_MAX_BACKLOG;
+}
+
+static void set_paused(bool pause)
+{
+    struct bridge_client *c;
+
+    if (paused == pause)
+        return;
+
+    paused = pause;
+
+    list_for_each_entry(c, &clients, list) {
+        if (pause)
+            ev_io_stop(bridge_loop, &c->ior);
+        else
+            ev_io_start(bridge_loop, &c->ior);
+    }
+
+    if (pause)
+        ev_timer_again(bridge_loop, &resume_timer);
+    else
+        ev_timer_stop(bridge_loop, &resume_timer);
+}
+
+static void resume_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+    if (!uplink_congested())
+        set_paused(false);
+}
+
+/*
+ * Every readable client gets at most one quantum per loop iteration, so a
+ * chatty agent can't starve the others.
+ */
+static void client_read_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    struct bridge_client *c = container_of(w, struct bridge_client, ior);
+    bool eof = false;
+    int ret;
+
+    ret = buffer_put_fd(&c->rb, w->fd, RTTY_BRIDGE_QUANTUM, &eof, NULL, NULL);
+    if (ret < 0 || !client_parse(c) || eof) {
+        client_free(c);
+        return;
+    }
+
+    if (uplink_congested())
+        set_paused(true);
+}
+
+static void client_write_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    struct bridge_client *c = container_of(w, struct bridge_client, iow);
+
+    if (buffer_pull_to_fd(&c->wb, w->fd, buffer_length(&c->wb), NULL, NULL) < 0) {
+        client_free(c);
+        return;
+    }
+
+    if (buffer_length(&c->wb) < 1)
+        ev_io_stop(loop, w);
+}
+
+static void accept_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    struct bridge_client *c;
+    int fd;
+
+    fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    if (nclients == RTTY_BRIDGE_MAX_CLIENTS) {
+        uwsc_log_err("Too many bridge clients\n");
+        close(fd);
+        return;
+    }
+
+    c = calloc(1, sizeof(struct bridge_client));
+    if (!c) {
+        close(fd);
+        return;
+    }
+
+    ev_io_init(&c->ior, client_read_cb, fd, EV_READ);
+    ev_io_init(&c->iow, client_write_cb, fd, EV_WRITE);
+
+    if (!paused)
+        ev_io_start(loop, &c->ior);
+
+    list_add_tail(&c->list, &clients);
+    nclients++;
+}
+
+int bridge_init(struct ev_loop *loop, const char *path)
+{
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX
+    };
+    int sock;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        uwsc_log_err("Bridge socket path too long\n");
+        return -1;
+    }
+
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        uwsc_log_err("socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    unlink(path);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 8) < 0) {
+        uwsc_log_err("Bind bridge socket '%s' failed: %s\n", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    bridge_loop = loop;
+
+    ev_io_init(&accept_watcher, accept_cb, sock, EV_READ);
+    ev_io_start(loop, &accept_watcher);
+
+    ev_init(&resume_timer, resume_timer_cb);
+    resume_timer.repeat = 0.05;
+
+    return 0;
+}
+
+void bridge_set_client(struct uwsc_client *cl)
+{
+    uplink = cl;
+
+    if (!cl && bridge_loop)
+        set_paused(false);
+}
+
+void bridge_deliver(int channel, const void *data, int len)
+{
+    struct bridge_client *c;
+    int i;
+
+    list_for_each_entry(c, &clients, list) {
+        for (i = 0; i < c->nsubs; i++) {
+            if (c->subs[i] == channel) {
+                client_send(c, BRIDGE_OP_MSG, channel, data, len);
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _BRIDGE_H
+#define _BRIDGE_H
+
+#include <uwsc/uwsc.h>
+
+#define RTTY_BRIDGE_MAX_CLIENTS     16
+#define RTTY_BRIDGE_MAX_SUBS        16          /* Channels one client may subscribe */
+#define RTTY_BRIDGE_MAX_MSG         (64 * 1024)
+#define RTTY_BRIDGE_QUANTUM         8192        /* Bytes read from one client per loop iteration */
+#define RTTY_BRIDGE_RATE            (32 * 1024) /* Bytes per second per channel */
+#define RTTY_BRIDGE_BURST           (128 * 1024)
+#define RTTY_BRIDGE_MAX_BACKLOG     (256 * 1024) /* Pause agents while this much is unsent */
+
+/*
+ * Messages on the local socket: op(1) channel(2) length(4) payload,
+ * integers in network byte order.
+ */
+enum {
+    BRIDGE_OP_SUB = 1,      /* Receive messages the server sends to channel */
+    BRIDGE_OP_UNSUB,
+    BRIDGE_OP_PUB,          /* Send payload to the server on channel */
+    BRIDGE_OP_MSG,          /* Message from the server */
+    BRIDGE_OP_ERR           /* Payload is an error string */
+};
+
+/*
+ * Lets local agents share rtty's connection. Published messages are sent
+ * as RTTY_FRAME_CHANNEL frames, so frame v2 must be negotiated.
+ */
+int bridge_init(struct ev_loop *loop, const char *path);
+
+void bridge_set_client(struct uwsc_client *cl);
+
+/* A channel frame from the server */
+void bridge_deliver(int channel, const void *data, int len);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <uwsc/log.h>
+
+#include "bulk.h"
+#include "proto.h"
+#include "wsframe.h"
+
+enum {
+    BULK_IDLE,
+    BULK_CONNECTING,
+    BULK_OPEN
+};
+
+static char bulk_url[600];
+static const char *bulk_header;
+static int bulk_keepalive;
+static int state;
+static struct uwsc_client *bulk;
+static struct uwsc_client *primary;
+static struct ev_timer idle_timer;
+
+/* Messages sent while connecting: op(1) len(4) data */
+static struct buffer pending;
+
+static void flush_pending(struct uwsc_client *cl)
+{
+    struct buffer *b = &pending;
+    uint32_t len;
+    uint8_t op;
+
+    while (buffer_length(b) > 0) {
+        op = buffer_pull_u8(b);
+        len = buffer_pull_u32(b);
+
+        if (cl)
+            cl->send(cl, buffer_data(b), len, op);
+        buffer_pull(b, NULL, len);
+    }
+
+    buffer_free(b);
+}
+
+static void bulk_onopen(struct uwsc_client *cl)
+{
+    uwsc_log_info("Bulk connection established\n");
+
+    state = BULK_OPEN;
+    flush_pending(cl);
+    ev_timer_again(cl->loop, &idle_timer);
+}
+
+static void bulk_gone(struct uwsc_client *cl)
+{
+    ev_timer_stop(cl->loop, &idle_timer);
+
+    /* Whatever could not be sent goes over the primary connection */
+    flush_pending(primary);
+
+    ws_detach(cl);
+    free(cl);
+    bulk = NULL;
+    state = BULK_IDLE;
+}
+
+static void bulk_onerror(struct uwsc_client *cl, int err, const char *msg)
+{
+    uwsc_log_err("Bulk connection error:%d: %s\n", err, msg);
+    bulk_gone(cl);
+}
+
+static void bulk_onclose(struct uwsc_client *cl, int code, const char *reason)
+{
+    uwsc_log_info("Bulk connection closed:%d: %s\n", code, reason);
+    bulk_gone(cl);
+}
+
+static void bulk_onmessage(struct uwsc_client *cl, void *data, size_t len, bool binary)
+{
+    uwsc_log_err("Unexpected message on bulk connection\n");
+}
+
+static void idle_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+    if (state == BULK_OPEN)
+        bulk->send_close(bulk, UWSC_CLOSE_STATUS_NORMAL, "idle");
+}
+
+static bool bulk_connect(struct ev_loop *loop)
+{
+    bulk = uwsc_new(loop, bulk_url, bulk_keepalive, bulk_header);
+    if (!bulk)
+        return false;
+
+    bulk->onopen = bulk_onopen;
+    bulk->onmessage = bulk_onmessage;
+    bulk->onerror = bulk_onerror;
+    bulk->onclose = bulk_onclose;
+    bulk->send = ws_send;
+
+    state = BULK_CONNECTING;
+
+    return true;
+}
+
+void bulk_init(const char *url, int keepalive, const char *extra_header)
+{
+    snprintf(bulk_url, sizeof(bulk_url), "%s&bulk=1", url);
+    bulk_keepalive = keepalive;
+    bulk_header = extra_header;
+
+    ev_init(&idle_timer, idle_timer_cb);
+    idle_timer.repeat = RTTY_BULK_IDLE_TIMEOUT;
+}
+
+int bulk_send(struct uwsc_client *cl, const void *data, size_t len, int op)
+{
+    if (!bulk_url[0] || !proto_has(RTTY_FEAT_BULK))
+        return cl->send(cl, data, len, op);
+
+    primary = cl;
+
+    switch (state) {
+    case BULK_IDLE:
+        if (!bulk_connect(cl->loop))
+            return cl->send(cl, data, len, op);
+        /* fall through */
+    case BULK_CONNECTING:
+        buffer_put_u8(&pending, op);
+        buffer_put_u32(&pending, len);
+        buffer_put_data(&pending, data, len);
+        return 0;
+    default:
+        ev_timer_again(cl->loop, &idle_timer);
+        return bulk->send(bulk, data, len, op);
+    }
+}
+
+void bulk_close()
+{
+    primary = NULL;
+
+    if (state == BULK_OPEN) {
+        bulk->send_close(bulk, UWSC_CLOSE_STATUS_NORMAL, "primary closed");
+    } else if (state == BULK_CONNECTING) {
+        /* Replies to the closed connection, nobody to deliver them to */
+        flush_pending(NULL);
+
+        /* The pending connect or handshake fails, and bulk_onerror() frees it */
+        shutdown(bulk->sock, SHUT_RDWR);
+    }
+}
+
+void bulk_set_url(const char *url)
+{
+    if (bulk_url[0])
+        snprintf(bulk_url, sizeof(bulk_url), "%s&bulk=1", url);
+}
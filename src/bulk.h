@@ -0,0 +1,48 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _BULK_H
+#define _BULK_H
+
+#include <uwsc/uwsc.h>
+
+#define RTTY_BULK_IDLE_TIMEOUT  30      /* second */
+
+/*
+ * Optional secondary connection for bulk traffic (command results etc).
+ * It is opened on demand and closed when idle, so large replies don't sit
+ * in front of keystroke echo on the primary connection.
+ */
+void bulk_init(const char *url, int keepalive, const char *extra_header);
+
+/* Falls back to the primary connection when bulk is disabled or unavailable */
+int bulk_send(struct uwsc_client *primary, const void *data, size_t len, int op);
+
+/* Called when the primary connection goes away */
+void bulk_close();
+
+/* The primary connection moved to url, later bulk connections follow it */
+void bulk_set_url(const char *url);
+
+#endif
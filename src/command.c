@@ -30,6 +30,8 @@
 #include <errno.h>
 #include <limits.h>
 #include <shadow.h>
+#include <pty.h>
+#include <termios.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <uwsc/log.h>
@@ -39,6 +41,9 @@
 #include "list.h"
 #include "utils.h"
 #include "command.h"
+#include "bulk.h"
+#include "wsframe.h"
+#include "alloc.h"
 
 static int nrunning;
 static LIST_HEAD(task_pending);
@@ -46,7 +51,7 @@ static LIST_HEAD(task_pending);
 static void run_task(struct task *t);
 
 /* For execute command */
-static bool login_test(const char *username, const char *password)
+bool login_test(const char *username, const char *password)
 {
     struct spwd *sp;
 
@@ -63,7 +68,7 @@ static bool login_test(const char *username, const char *password)
     return !strcmp(crypt(password, sp->sp_pwdp), sp->sp_pwdp);
 }
 
-static const char *cmd_lookup(const char *cmd)
+const char *cmd_lookup(const char *cmd)
 {
     struct stat s;
     int plen = 0, clen = strlen(cmd) + 1;
@@ -101,7 +106,7 @@ static const char *cmd_lookup(const char *cmd)
     return NULL;
 }
 
-static const char *cmderr2str(int err)
+const char *cmderr2str(int err)
 {
     switch (err) {
     case RTTY_CMD_ERR_PERMIT:
@@ -114,6 +119,12 @@ static const char *cmderr2str(int err)
         return "sys error";
     case RTTY_CMD_ERR_RESP_TOOBIG:
         return "stdout+stderr is too big";
+    case RTTY_CMD_ERR_TIMEOUT:
+        return "timeout";
+    case RTTY_CMD_ERR_INVALID:
+        return "invalid format";
+    case RTTY_CMD_ERR_NOT_SUPPORTED:
+        return "not supported";
     default:
         return "";
     }
@@ -141,7 +152,8 @@ static void task_free(struct task *t)
 
     json_value_free((json_value *)t->msg);
 
-    free(t);
+    ws_put(t->ws);
+    rtty_free(t);
 }
 
 static void cmd_err_reply(struct uwsc_client *ws, const char *token, int err)
@@ -161,7 +173,7 @@ static void cmd_reply(struct task *t, int code)
 
     len = ceil(len * 4.0 / 3) + 200;
 
-    str = calloc(1, len);
+    str = rtty_calloc(RTTY_MEM_REPLY, 1, len);
     if (!str) {
         cmd_err_reply(t->ws, t->token, RTTY_CMD_ERR_NOMEM);
         return;
@@ -191,14 +203,26 @@ static void cmd_reply(struct task *t, int code)
     len -= ret;
     pos += ret;
 
-    t->ws->send(t->ws, str, pos - str, UWSC_OP_TEXT);
-    free(str);
+    bulk_send(t->ws, str, pos - str, UWSC_OP_TEXT);
+    rtty_free(str);
+}
+
+/* Read what is left in the pipe or pty before the reply is built */
+static void task_drain(struct ev_io *w, struct buffer *b)
+{
+    bool eof;
+
+    if (w->fd > 0)
+        buffer_put_fd(b, w->fd, -1, &eof, NULL, NULL);
 }
 
 static void ev_child_exit(struct ev_loop *loop, struct ev_child *w, int revents)
 {
     struct task *t = container_of(w, struct task, cw);
 
+    task_drain(&t->ioo, &t->ob);
+    task_drain(&t->ioe, &t->eb);
+
     cmd_reply(t, WEXITSTATUS(w->rstatus));
     task_free(t);
 
@@ -224,37 +248,111 @@ static void ev_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
     uwsc_log_err("exec '%s' timeout\n", t->cmd);
 }
 
+static void task_read(struct ev_loop *loop, struct ev_io *w, struct buffer *b)
+{
+    bool eof = false;
+
+    /* A pty master returns EIO once the slave side is closed */
+    if (buffer_put_fd(b, w->fd, -1, &eof, NULL, NULL) < 0 || eof)
+        ev_io_stop(loop, w);
+}
+
 static void ev_io_stdout_cb(struct ev_loop *loop, struct ev_io *w, int revents)
 {
     struct task *t = container_of(w, struct task, ioo);
-    bool eof;
 
-    buffer_put_fd(&t->ob, w->fd, -1, &eof, NULL, NULL);
+    task_read(loop, w, &t->ob);
 }
 
 static void ev_io_stderr_cb(struct ev_loop *loop, struct ev_io *w, int revents)
 {
     struct task *t = container_of(w, struct task, ioe);
-    bool eof;
 
-    buffer_put_fd(&t->eb, w->fd, -1, &eof, NULL, NULL);
+    task_read(loop, w, &t->eb);
 }
 
-static void run_task(struct task *t)
+/*
+ * Run the command under a pseudo-terminal so that stdio in the child
+ * stays line buffered. The slave is put in raw mode, so the output is
+ * byte-for-byte what the command wrote, with stdout and stderr merged
+ * in the order they were produced.
+ */
+static pid_t task_forkpty(struct task *t, int *master)
 {
+    struct winsize size = {
+        .ws_col = json_get_int(t->attrs, "cols"),
+        .ws_row = json_get_int(t->attrs, "rows")
+    };
+    struct termios tio = {};
+    pid_t pid;
+
+    if (!size.ws_col)
+        size.ws_col = RTTY_CMD_PTY_COLS;
+    if (!size.ws_row)
+        size.ws_row = RTTY_CMD_PTY_ROWS;
+
+    cfmakeraw(&tio);
+
+    pid = forkpty(master, NULL, &tio, &size);
+    if (pid > 0)
+        fcntl(*master, F_SETFD, FD_CLOEXEC);
+    return pid;
+}
+
+static pid_t task_fork(struct task *t, int *ofd, int *efd)
+{
+    bool merge = json_get_bool(t->attrs, "merge");
     int opipe[2];
-    int epipe[2];
+    int epipe[2] = {-1, -1};
     pid_t pid;
-    int err;
 
-    if (pipe2(opipe, O_CLOEXEC | O_NONBLOCK) < 0 ||
-        pipe2(epipe, O_CLOEXEC | O_NONBLOCK) < 0) {
-        uwsc_log_err("pipe2 failed: %s\n", strerror(errno));
-        err = RTTY_CMD_ERR_SYSERR;
-        goto ERR;
+    if (json_get_bool(t->attrs, "pty")) {
+        *efd = -1;
+        return task_forkpty(t, ofd);
+    }
+
+    if (pipe2(opipe, O_CLOEXEC | O_NONBLOCK) < 0)
+        return -1;
+
+    if (!merge && pipe2(epipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        close(opipe[0]);
+        close(opipe[1]);
+        return -1;
     }
 
     pid = fork();
+    if (pid == 0) {
+        /* Redirect */
+        dup2(opipe[1], STDOUT_FILENO);
+        dup2(merge ? opipe[1] : epipe[1], STDERR_FILENO);
+        return 0;
+    }
+
+    /* Close unused write end */
+    close(opipe[1]);
+    if (!merge)
+        close(epipe[1]);
+
+    if (pid < 0) {
+        close(opipe[0]);
+        if (!merge)
+            close(epipe[0]);
+        return -1;
+    }
+
+    *ofd = opipe[0];
+    *efd = epipe[0];
+
+    return pid;
+}
+
+static void run_task(struct task *t)
+{
+    int ofd, efd;
+    pid_t pid;
+    int err;
+
+    pid = task_fork(t, &ofd, &efd);
     switch (pid) {
     case -1:
         uwsc_log_err("fork: %s\n", strerror(errno));
@@ -267,16 +365,6 @@ static void run_task(struct task *t)
         int i, arglen;
         char **args;
 
-        /* Close unused read end */
-        close(opipe[0]);
-        close(epipe[0]);
-
-        /* Redirect */
-        dup2(opipe[1], STDOUT_FILENO);
-        dup2(epipe[1], STDERR_FILENO);
-        close(opipe[1]);
-        close(epipe[1]);
-
         arglen = 2;
         if (params)
             arglen += params->u.array.length;
@@ -303,21 +391,23 @@ static void run_task(struct task *t)
         }
 
         execv(t->cmd, args);
+        exit(127);
     }
     default:
-        /* Close unused write end */
-        close(opipe[1]);
-        close(epipe[1]);
+        fcntl(ofd, F_SETFL, fcntl(ofd, F_GETFL, 0) | O_NONBLOCK);
 
         /* Watch child's status */
         ev_child_init(&t->cw, ev_child_exit, pid, 0);
         ev_child_start(t->ws->loop, &t->cw);
 
-        ev_io_init(&t->ioo, ev_io_stdout_cb, opipe[0], EV_READ);
+        ev_io_init(&t->ioo, ev_io_stdout_cb, ofd, EV_READ);
         ev_io_start(t->ws->loop, &t->ioo);
 
-        ev_io_init(&t->ioe, ev_io_stderr_cb, epipe[0], EV_READ);
-        ev_io_start(t->ws->loop, &t->ioe);
+        /* stderr is merged into stdout */
+        if (efd > 0) {
+            ev_io_init(&t->ioe, ev_io_stderr_cb, efd, EV_READ);
+            ev_io_start(t->ws->loop, &t->ioe);
+        }
 
         ev_timer_init(&t->timer, ev_timer_cb, RTTY_CMD_EXEC_TIMEOUT, 0);
         ev_timer_start(t->ws->loop, &t->timer);
@@ -336,7 +426,7 @@ static void add_task(struct uwsc_client *ws, const char *token, const char *cmd,
 {
     struct task *t;
 
-    t = calloc(1, sizeof(struct task) + strlen(cmd) + 1);
+    t = rtty_calloc(RTTY_MEM_TASK, 1, sizeof(struct task) + strlen(cmd) + 1);
     if (!t) {
         cmd_err_reply(ws, token, RTTY_CMD_ERR_NOMEM);
         return;
@@ -344,6 +434,7 @@ static void add_task(struct uwsc_client *ws, const char *token, const char *cmd,
 
     t->ws = ws;
     t->msg = msg;
+    ws_hold(ws);
     t->attrs = attrs;
 
     strcpy(t->cmd, cmd);
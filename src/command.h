@@ -27,17 +27,23 @@
 
 #include <uwsc/uwsc.h>
 
+#include "list.h"
 #include "json.h"
 
 #define RTTY_CMD_MAX_RUNNING     5
 #define RTTY_CMD_EXEC_TIMEOUT    30
+#define RTTY_CMD_PTY_COLS        80     /* Default winsize of "pty" commands */
+#define RTTY_CMD_PTY_ROWS        24
 
 enum {
 	RTTY_CMD_ERR_PERMIT = 1,
 	RTTY_CMD_ERR_NOT_FOUND,
 	RTTY_CMD_ERR_NOMEM,
 	RTTY_CMD_ERR_SYSERR,
-	RTTY_CMD_ERR_RESP_TOOBIG
+	RTTY_CMD_ERR_RESP_TOOBIG,
+	RTTY_CMD_ERR_TIMEOUT,
+	RTTY_CMD_ERR_INVALID,
+	RTTY_CMD_ERR_NOT_SUPPORTED
 };
 
 struct task {
@@ -57,4 +63,10 @@ struct task {
 
 void run_command(struct uwsc_client *ws, const json_value *msg);
 
+bool login_test(const char *username, const char *password);
+
+const char *cmd_lookup(const char *cmd);
+
+const char *cmderr2str(int err);
+
 #endif
@@ -0,0 +1,467 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <uwsc/log.h>
+#include <uwsc/utils.h>
+
+#include "expect.h"
+#include "command.h"
+#include "bulk.h"
+#include "wsframe.h"
+
+static int nrunning;
+
+static void expect_next(struct expect_job *j);
+
+static void expect_err_reply(struct uwsc_client *ws, const char *token, int err)
+{
+    char str[256] = "";
+
+    snprintf(str, sizeof(str) - 1, "{\"type\":\"expect\",\"token\":\"%s\","
+            "\"attrs\":{\"err\":%d,\"msg\":\"%s\"}}", token, err, cmderr2str(err));
+    ws->send(ws, str, strlen(str), UWSC_OP_TEXT);
+}
+
+static void expect_free(struct expect_job *j)
+{
+    int i;
+
+    ev_io_stop(j->ws->loop, &j->ior);
+    ev_io_stop(j->ws->loop, &j->iow);
+    ev_child_stop(j->ws->loop, &j->cw);
+    ev_timer_stop(j->ws->loop, &j->step_timer);
+    ev_timer_stop(j->ws->loop, &j->timer);
+
+    if (j->pty > 0)
+        close(j->pty);
+
+    if (j->pid > 0 && !j->exited) {
+        kill(j->pid, SIGKILL);
+        waitpid(j->pid, NULL, 0);
+    }
+
+    for (i = 0; i < j->nsteps; i++) {
+        if (!j->steps[i].send)
+            regfree(&j->steps[i].re);
+    }
+
+    json_value_free((json_value *)j->msg);
+    free(j->steps);
+    free(j->out);
+    ws_put(j->ws);
+    free(j);
+
+    nrunning--;
+}
+
+/*
+ * Reply with the exit code (-1 if the program was still running), the
+ * number of steps completed and the base64 encoded transcript.
+ */
+static void expect_finish(struct expect_job *j, int err)
+{
+    size_t len = j->len * 4 / 3 + 300;
+    char *str, *pos;
+    int ret;
+
+    ev_io_stop(j->ws->loop, &j->ior);
+    ev_io_stop(j->ws->loop, &j->iow);
+
+    str = calloc(1, len);
+    if (!str) {
+        expect_err_reply(j->ws, j->token, RTTY_CMD_ERR_NOMEM);
+        expect_free(j);
+        return;
+    }
+
+    pos = str;
+
+    ret = snprintf(pos, len, "{\"type\":\"expect\",\"token\":\"%s\",\"attrs\":{", j->token);
+    pos += ret;
+    len -= ret;
+
+    if (err) {
+        ret = snprintf(pos, len, "\"err\":%d,\"msg\":\"%s\",", err, cmderr2str(err));
+        pos += ret;
+        len -= ret;
+    }
+
+    ret = snprintf(pos, len, "\"code\":%d,\"steps\":%d,\"transcript\":\"",
+        j->exited ? WEXITSTATUS(j->status) : -1, j->cur);
+    pos += ret;
+    len -= ret;
+
+    ret = b64_encode(j->out, j->len, pos, len);
+    pos += ret;
+    len -= ret;
+
+    ret = snprintf(pos, len, "\"}}");
+    pos += ret;
+
+    bulk_send(j->ws, str, pos - str, UWSC_OP_TEXT);
+
+    free(str);
+    expect_free(j);
+}
+
+/* Try the current expect step against the output not matched yet */
+static bool expect_match(struct expect_job *j)
+{
+    struct expect_step *s = &j->steps[j->cur];
+    regmatch_t m;
+
+    if (regexec(&s->re, j->out + j->match, 1, &m, 0))
+        return false;
+
+    j->match += m.rm_eo;
+    return true;
+}
+
+/*
+ * Write what is left of a send step. Returns false if the pty is full,
+ * in which case the write watcher resumes the steps once it drains.
+ */
+static bool expect_send(struct expect_job *j, struct expect_step *s)
+{
+    int ret;
+
+    while (j->sent < s->len) {
+        ret = write(j->pty, s->send + j->sent, s->len - j->sent);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                ev_io_start(j->ws->loop, &j->iow);
+                return false;
+            }
+            uwsc_log_err("Write to pty failed: %s\n", strerror(errno));
+            break;
+        }
+        j->sent += ret;
+    }
+
+    ev_io_stop(j->ws->loop, &j->iow);
+    j->sent = 0;
+    return true;
+}
+
+/* Run steps until one has to wait for output or for the pty to drain */
+static void expect_next(struct expect_job *j)
+{
+    struct expect_step *s;
+
+    ev_timer_stop(j->ws->loop, &j->step_timer);
+
+    while (j->cur < j->nsteps) {
+        s = &j->steps[j->cur];
+
+        if (s->send) {
+            if (!expect_send(j, s))
+                return;
+        } else if (!expect_match(j)) {
+            ev_timer_set(&j->step_timer, s->timeout, 0);
+            ev_timer_start(j->ws->loop, &j->step_timer);
+            return;
+        }
+
+        j->cur++;
+    }
+}
+
+/* Returns the number of bytes read, 0 if there is nothing more or -err */
+static int expect_fill(struct expect_job *j)
+{
+    char *out;
+    int len;
+
+    if (j->cap - j->len < 4097) {
+        if (j->cap >= RTTY_EXPECT_MAX_OUTPUT)
+            return -RTTY_CMD_ERR_RESP_TOOBIG;
+
+        out = realloc(j->out, j->cap * 2);
+        if (!out)
+            return -RTTY_CMD_ERR_NOMEM;
+        j->out = out;
+        j->cap *= 2;
+    }
+
+    do {
+        len = read(j->pty, j->out + j->len, 4096);
+    } while (len < 0 && errno == EINTR);
+
+    /* EIO: the program has closed the pty */
+    if (len <= 0)
+        return 0;
+
+    j->len += len;
+    j->out[j->len] = '\0';
+
+    return len;
+}
+
+static void expect_read_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    struct expect_job *j = container_of(w, struct expect_job, ior);
+    int ret;
+
+    ret = expect_fill(j);
+    if (ret < 0) {
+        expect_finish(j, -ret);
+        return;
+    }
+
+    if (ret == 0) {
+        if (errno != EAGAIN)
+            ev_io_stop(loop, w);
+        return;
+    }
+
+    expect_next(j);
+}
+
+static void expect_write_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    struct expect_job *j = container_of(w, struct expect_job, iow);
+
+    expect_next(j);
+}
+
+/* The reply is sent when the program exits, or on timeout */
+static void expect_exit_cb(struct ev_loop *loop, struct ev_child *w, int revents)
+{
+    struct expect_job *j = container_of(w, struct expect_job, cw);
+    int ret;
+
+    ev_child_stop(loop, w);
+
+    j->exited = true;
+    j->status = w->rstatus;
+
+    /* Pick up what the program wrote last */
+    while ((ret = expect_fill(j)) > 0)
+        ;
+
+    if (ret < 0) {
+        expect_finish(j, -ret);
+        return;
+    }
+
+    /* Nothing can be sent any more, but the output may still match */
+    while (j->cur < j->nsteps && !j->steps[j->cur].send && expect_match(j))
+        j->cur++;
+
+    expect_finish(j, j->cur < j->nsteps ? RTTY_CMD_ERR_NOT_FOUND : 0);
+}
+
+static void expect_step_timeout(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+    struct expect_job *j = container_of(w, struct expect_job, step_timer);
+
+    expect_finish(j, RTTY_CMD_ERR_TIMEOUT);
+}
+
+static void expect_timeout(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+    struct expect_job *j = container_of(w, struct expect_job, timer);
+
+    expect_finish(j, RTTY_CMD_ERR_TIMEOUT);
+}
+
+static int expect_parse_steps(struct expect_job *j, const json_value *steps)
+{
+    int i;
+
+    if (!steps || steps->type != json_array || steps->u.array.length > RTTY_EXPECT_MAX_STEPS)
+        return -1;
+
+    j->steps = calloc(steps->u.array.length, sizeof(struct expect_step));
+    if (!j->steps)
+        return -1;
+
+    for (i = 0; i < steps->u.array.length; i++) {
+        const json_value *step = steps->u.array.values[i];
+        const json_value *send = json_get_value(step, "send");
+        struct expect_step *s = &j->steps[i];
+
+        if (send && send->type == json_string) {
+            s->send = send->u.string.ptr;
+            s->len = send->u.string.length;
+        } else {
+            if (regcomp(&s->re, json_get_string(step, "expect"), REG_EXTENDED | REG_NEWLINE))
+                return -1;
+
+            s->timeout = json_get_int(step, "timeout");
+            if (s->timeout <= 0)
+                s->timeout = RTTY_EXPECT_STEP_TIMEOUT;
+        }
+
+        j->nsteps++;
+    }
+
+    return 0;
+}
+
+static int expect_spawn(struct expect_job *j, const char *cmd, const json_value *attrs)
+{
+    const json_value *params = json_get_value(attrs, "params");
+    struct winsize size = {
+        .ws_col = json_get_int(attrs, "cols"),
+        .ws_row = json_get_int(attrs, "rows")
+    };
+    int i, arglen;
+    char **args;
+
+    if (!size.ws_col)
+        size.ws_col = RTTY_CMD_PTY_COLS;
+    if (!size.ws_row)
+        size.ws_row = RTTY_CMD_PTY_ROWS;
+
+    /* The pty is set up the same way as the one of a tty session */
+    j->pid = forkpty(&j->pty, NULL, NULL, &size);
+    if (j->pid < 0)
+        return -1;
+
+    if (j->pid == 0) {
+        arglen = 2;
+        if (params && params->type == json_array)
+            arglen += params->u.array.length;
+
+        args = calloc(1, sizeof(char *) * arglen);
+        if (!args)
+            exit(1);
+
+        args[0] = (char *)cmd;
+
+        if (params && params->type == json_array) {
+            for (i = 0; i < params->u.array.length; i++)
+                args[i + 1] = (char *)json_get_array_string(params, i);
+        }
+
+        execv(cmd, args);
+        exit(127);
+    }
+
+    fcntl(j->pty, F_SETFL, fcntl(j->pty, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(j->pty, F_SETFD, FD_CLOEXEC);
+
+    return 0;
+}
+
+void run_expect(struct uwsc_client *ws, const json_value *msg)
+{
+    const json_value *attrs = json_get_value(msg, "attrs");
+    const char *username = json_get_string(attrs, "username");
+    const char *password = json_get_string(attrs, "password");
+    const char *token = json_get_string(msg, "token");
+    struct expect_job *j = NULL;
+    double timeout;
+    const char *cmd;
+    int err;
+
+    if (!username[0] || !login_test(username, password)) {
+        err = RTTY_CMD_ERR_PERMIT;
+        goto ERR;
+    }
+
+    cmd = cmd_lookup(json_get_string(attrs, "cmd"));
+    if (!cmd) {
+        err = RTTY_CMD_ERR_NOT_FOUND;
+        goto ERR;
+    }
+
+    if (nrunning >= RTTY_EXPECT_MAX_RUNNING) {
+        err = RTTY_CMD_ERR_SYSERR;
+        goto ERR;
+    }
+
+    j = calloc(1, sizeof(struct expect_job));
+    if (!j) {
+        err = RTTY_CMD_ERR_NOMEM;
+        goto ERR;
+    }
+
+    nrunning++;
+
+    j->ws = ws;
+    j->msg = msg;
+    ws_hold(ws);
+    j->cap = 4096 * 2;
+    strncpy(j->token, token, sizeof(j->token) - 1);
+
+    ev_init(&j->iow, expect_write_cb);
+    ev_init(&j->step_timer, expect_step_timeout);
+    ev_init(&j->timer, expect_timeout);
+
+    j->out = calloc(1, j->cap);
+    if (!j->out) {
+        err = RTTY_CMD_ERR_NOMEM;
+        goto ERR;
+    }
+
+    if (expect_parse_steps(j, json_get_value(attrs, "steps")) < 0) {
+        err = RTTY_CMD_ERR_INVALID;
+        goto ERR;
+    }
+
+    if (expect_spawn(j, cmd, attrs) < 0) {
+        uwsc_log_err("forkpty: %s\n", strerror(errno));
+        err = RTTY_CMD_ERR_SYSERR;
+        goto ERR;
+    }
+
+    ev_io_init(&j->ior, expect_read_cb, j->pty, EV_READ);
+    ev_io_start(ws->loop, &j->ior);
+
+    ev_io_set(&j->iow, j->pty, EV_WRITE);
+
+    ev_child_init(&j->cw, expect_exit_cb, j->pid, 0);
+    ev_child_start(ws->loop, &j->cw);
+
+    timeout = json_get_int(attrs, "timeout");
+    if (timeout <= 0)
+        timeout = RTTY_EXPECT_TIMEOUT;
+
+    ev_timer_set(&j->timer, timeout, 0);
+    ev_timer_start(ws->loop, &j->timer);
+
+    expect_next(j);
+    return;
+
+ERR:
+    expect_err_reply(ws, token, err);
+
+    if (j)
+        expect_free(j);
+    else
+        json_value_free((json_value *)msg);
+}
@@ -0,0 +1,77 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _EXPECT_H
+#define _EXPECT_H
+
+#include <regex.h>
+#include <uwsc/uwsc.h>
+
+#include "list.h"
+#include "json.h"
+
+#define RTTY_EXPECT_MAX_RUNNING     5
+#define RTTY_EXPECT_MAX_STEPS       128
+#define RTTY_EXPECT_MAX_OUTPUT      (1024 * 1024)
+#define RTTY_EXPECT_STEP_TIMEOUT    10      /* second, default for an expect step */
+#define RTTY_EXPECT_TIMEOUT         60      /* second, default for the whole job */
+
+struct expect_step {
+    const char *send;       /* NULL for an expect step */
+    int len;
+    regex_t re;
+    double timeout;
+};
+
+struct expect_job {
+    struct list_head list;
+    struct uwsc_client *ws;
+    pid_t pid;
+    int pty;
+    int status;
+    bool exited;
+    struct ev_io ior;
+    struct ev_io iow;
+    struct ev_child cw;
+    struct ev_timer step_timer;
+    struct ev_timer timer;
+    char *out;              /* Transcript, always null terminated */
+    size_t len;
+    size_t cap;
+    size_t match;           /* Where the next expect step starts matching */
+    int nsteps;
+    int cur;
+    int sent;               /* Bytes of the current send step written */
+    struct expect_step *steps;
+    const json_value *msg;  /* message from server */
+    char token[33];
+};
+
+/*
+ * Run a script of expect/send steps against a program in a local pty and
+ * reply with the transcript once it finishes.
+ */
+void run_expect(struct uwsc_client *ws, const json_value *msg);
+
+#endif
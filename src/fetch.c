@@ -0,0 +1,717 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <uwsc/log.h>
+
+#include "list.h"
+#include "fetch.h"
+#include "sha256.h"
+#include "command.h"
+#include "wsframe.h"
+#include "profiler.h"
+
+struct fetch_job;
+
+struct fetch_conn {
+    struct fetch_job *job;
+    struct ev_io io;
+    bool connected;
+    bool body;
+    char hdr[4096];
+    int hdrlen;
+    int64_t pos;            /* Next byte of the file expected */
+    int64_t end;            /* Last byte wanted, -1 until known */
+};
+
+struct fetch_job {
+    struct list_head list;
+    struct fetch_job *next;     /* On the list of jobs back from a worker */
+    void (*worked)(struct fetch_job *j);    /* Called on the loop after the worker */
+    struct uwsc_client *ws;
+    struct ev_timer timer;
+    char token[33];
+    char hash[SHA256_DIGEST_LENGTH * 2 + 1];
+    char host[256];
+    char port[8];
+    char uri[1024];
+    char path[512];
+    char tmp[520];
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int fd;
+    int redirects;
+    int nconns;             /* Connections wanted */
+    int active;             /* Connections not finished */
+    struct fetch_conn conns[RTTY_FETCH_MAX_CONNS];
+    int64_t size;           /* -1 while unknown */
+    int64_t received;
+    int64_t last_received;
+    ev_tstamp start;
+    ev_tstamp last_data;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    int hash_err;
+    int resolve_err;
+};
+
+static LIST_HEAD(jobs);
+
+static struct fetch_job *worked_jobs;
+static pthread_mutex_t worked_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ev_async worked_watcher;
+static bool worked_watcher_ready;
+
+static void fetch_reply(struct fetch_job *j, int err)
+{
+    char str[256] = "";
+
+    if (err)
+        snprintf(str, sizeof(str) - 1, "{\"type\":\"fetch\",\"token\":\"%s\","
+            "\"attrs\":{\"err\":%d,\"msg\":\"%s\"}}", j->token, err, cmderr2str(err));
+    else
+        snprintf(str, sizeof(str) - 1, "{\"type\":\"fetch\",\"token\":\"%s\","
+            "\"attrs\":{\"code\":0,\"size\":%lld,\"elapsed\":%.3f,\"connections\":%d}}", j->token,
+            (long long)j->size, ev_now(j->ws->loop) - j->start, j->nconns);
+
+    j->ws->send(j->ws, str, strlen(str), UWSC_OP_TEXT);
+}
+
+static void conn_close(struct fetch_job *j, struct fetch_conn *c)
+{
+    if (c->io.fd > 0) {
+        ev_io_stop(j->ws->loop, &c->io);
+        close(c->io.fd);
+        c->io.fd = -1;
+    }
+}
+
+static void fetch_free(struct fetch_job *j)
+{
+    int i;
+
+    ev_timer_stop(j->ws->loop, &j->timer);
+
+    for (i = 0; i < RTTY_FETCH_MAX_CONNS; i++)
+        conn_close(j, &j->conns[i]);
+
+    if (j->fd > 0) {
+        close(j->fd);
+        unlink(j->tmp);
+    }
+
+    list_del(&j->list);
+    ws_put(j->ws);
+    free(j);
+}
+
+static void fetch_fail(struct fetch_job *j, int err)
+{
+    fetch_reply(j, err);
+    fetch_free(j);
+}
+
+/* Called last by a worker, hands the job back to the loop */
+static void work_done(struct fetch_job *j)
+{
+    pthread_mutex_lock(&worked_lock);
+    j->next = worked_jobs;
+    worked_jobs = j;
+    pthread_mutex_unlock(&worked_lock);
+
+    ev_async_send(j->ws->loop, &worked_watcher);
+}
+
+static void worked_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+    struct fetch_job *j, *next;
+
+    pthread_mutex_lock(&worked_lock);
+    j = worked_jobs;
+    worked_jobs = NULL;
+    pthread_mutex_unlock(&worked_lock);
+
+    for (; j; j = next) {
+        next = j->next;
+        j->worked(j);
+    }
+}
+
+/* Run fn on a thread, then worked on the loop. Nothing else may touch the job in between */
+static int fetch_work(struct fetch_job *j, void *(*fn)(void *), void (*worked)(struct fetch_job *j))
+{
+    pthread_t tid;
+
+    if (!worked_watcher_ready) {
+        ev_async_init(&worked_watcher, worked_cb);
+        ev_async_start(j->ws->loop, &worked_watcher);
+        worked_watcher_ready = true;
+    }
+
+    j->worked = worked;
+
+    if (pthread_create(&tid, NULL, fn, j))
+        return -1;
+    pthread_detach(tid);
+
+    return 0;
+}
+
+/* Ranges arrive out of order, so the file is hashed at the end, off the loop */
+static void *hash_thread(void *arg)
+{
+    struct fetch_job *j = arg;
+
+    profiler_thread_init();
+
+    /* On disk before it's renamed into place, so a crash can't leave a truncated file at path */
+    j->hash_err = fsync(j->fd) < 0 || sha256_file(j->tmp, j->digest) < 0;
+
+    work_done(j);
+
+    return NULL;
+}
+
+static void fetch_verify(struct fetch_job *j)
+{
+    char hash[SHA256_DIGEST_LENGTH * 2 + 1];
+
+    close(j->fd);
+    j->fd = -1;
+
+    if (j->hash_err) {
+        unlink(j->tmp);
+        fetch_fail(j, RTTY_CMD_ERR_SYSERR);
+        return;
+    }
+
+    sha256_hex(j->digest, hash);
+
+    /* sha256_hex() gives lower case, the server may send either */
+    if (strcasecmp(hash, j->hash)) {
+        uwsc_log_err("Fetched file does not match %s\n", j->hash);
+        unlink(j->tmp);
+        fetch_fail(j, RTTY_CMD_ERR_INVALID);
+        return;
+    }
+
+    if (rename(j->tmp, j->path) < 0) {
+        uwsc_log_err("rename '%s' failed: %s\n", j->path, strerror(errno));
+        unlink(j->tmp);
+        fetch_fail(j, RTTY_CMD_ERR_SYSERR);
+        return;
+    }
+
+    fetch_reply(j, 0);
+    fetch_free(j);
+}
+
+static void fetch_done(struct fetch_job *j)
+{
+    /* Neither progress nor a timeout while it's being hashed */
+    ev_timer_stop(j->ws->loop, &j->timer);
+
+    if (fetch_work(j, hash_thread, fetch_verify) < 0)
+        fetch_fail(j, RTTY_CMD_ERR_SYSERR);
+}
+
+/* http://host[:port]/path */
+static int parse_url(struct fetch_job *j, const char *url)
+{
+    const char *host, *slash, *colon;
+    int len;
+
+    if (strncmp(url, "http://", 7))
+        return strncmp(url, "https://", 8) ? RTTY_CMD_ERR_INVALID : RTTY_CMD_ERR_NOT_SUPPORTED;
+
+    host = url + 7;
+    slash = strchr(host, '/');
+    if (!slash)
+        slash = host + strlen(host);
+
+    colon = memchr(host, ':', slash - host);
+    len = (colon ? colon : slash) - host;
+
+    if (len == 0 || len >= sizeof(j->host) || strlen(slash) >= sizeof(j->uri))
+        return RTTY_CMD_ERR_INVALID;
+
+    memcpy(j->host, host, len);
+    j->host[len] = '\0';
+
+    if (colon)
+        snprintf(j->port, sizeof(j->port), "%.*s", (int)(slash - colon - 1), colon + 1);
+    else
+        strcpy(j->port, "80");
+
+    strcpy(j->uri, slash[0] ? slash : "/");
+
+    return 0;
+}
+
+/* A slow DNS server would stall the loop for the whole resolver timeout */
+static void *resolve_thread(void *arg)
+{
+    struct fetch_job *j = arg;
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    };
+    struct addrinfo *res;
+
+    profiler_thread_init();
+
+    j->resolve_err = getaddrinfo(j->host, j->port, &hints, &res);
+    if (!j->resolve_err) {
+        memcpy(&j->addr, res->ai_addr, res->ai_addrlen);
+        j->addrlen = res->ai_addrlen;
+        freeaddrinfo(res);
+    }
+
+    work_done(j);
+
+    return NULL;
+}
+
+static void conn_io_cb(struct ev_loop *loop, struct ev_io *w, int revents);
+
+static int conn_start(struct fetch_job *j, struct fetch_conn *c, int64_t start, int64_t end)
+{
+    int sock;
+
+    memset(c, 0, sizeof(*c));
+    c->job = j;
+    c->pos = start;
+    c->end = end;
+
+    sock = socket(j->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+
+    if (connect(sock, (struct sockaddr *)&j->addr, j->addrlen) < 0 && errno != EINPROGRESS) {
+        close(sock);
+        return -1;
+    }
+
+    ev_io_init(&c->io, conn_io_cb, sock, EV_WRITE);
+    ev_io_start(j->ws->loop, &c->io);
+
+    j->active++;
+
+    return 0;
+}
+
+/* The first connection asks for everything, from the start */
+static void resolved(struct fetch_job *j)
+{
+    if (j->resolve_err) {
+        uwsc_log_err("Resolve '%s' failed: %s\n", j->host, gai_strerror(j->resolve_err));
+        fetch_fail(j, RTTY_CMD_ERR_NOT_FOUND);
+        return;
+    }
+
+    j->last_data = ev_now(j->ws->loop);
+    ev_timer_start(j->ws->loop, &j->timer);
+
+    if (conn_start(j, &j->conns[0], 0, -1) < 0)
+        fetch_fail(j, RTTY_CMD_ERR_SYSERR);
+}
+
+/* Resolve j->host off the loop, then connect */
+static void fetch_resolve(struct fetch_job *j)
+{
+    ev_timer_stop(j->ws->loop, &j->timer);
+
+    if (fetch_work(j, resolve_thread, resolved) < 0)
+        fetch_fail(j, RTTY_CMD_ERR_SYSERR);
+}
+
+static const char *find_header(char *hdr, const char *name)
+{
+    int len = strlen(name);
+    char *p = hdr;
+
+    while ((p = strstr(p, "\r\n"))) {
+        p += 2;
+        if (!strncasecmp(p, name, len) && p[len] == ':') {
+            p += len + 1;
+            while (*p == ' ')
+                p++;
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+/* The first connection asks for everything and learns the size from the reply */
+static int split_ranges(struct fetch_job *j)
+{
+    int64_t slice = (j->size + j->nconns - 1) / j->nconns;
+    int i;
+
+    /* Not worth several connections */
+    if (slice < 256 * 1024) {
+        j->nconns = 1;
+        j->conns[0].end = j->size - 1;
+        return 0;
+    }
+
+    j->conns[0].end = slice - 1;
+
+    for (i = 1; i < j->nconns && i * slice < j->size; i++) {
+        int64_t end = (i + 1) * slice - 1;
+
+        if (conn_start(j, &j->conns[i], i * slice, end < j->size ? end : j->size - 1) < 0)
+            return -1;
+    }
+
+    j->nconns = i;
+
+    return 0;
+}
+
+static void fetch_restart(struct fetch_job *j);
+
+/* Returns 1 if the connection was replaced(redirect), -1 on error */
+static int parse_response(struct fetch_job *j, struct fetch_conn *c)
+{
+    bool first = c == &j->conns[0] && j->size < 0;
+    const char *val;
+    int status;
+
+    if (sscanf(c->hdr, "HTTP/%*d.%*d %d", &status) != 1)
+        return -RTTY_CMD_ERR_INVALID;
+
+    if (first && status >= 301 && status <= 308 && status != 304 && status != 305 &&
+        (val = find_header(c->hdr, "Location"))) {
+        char url[1280];
+        int err;
+
+        if (++j->redirects > RTTY_FETCH_MAX_REDIRECT)
+            return -RTTY_CMD_ERR_NOT_FOUND;
+
+        snprintf(url, sizeof(url), "%.*s", (int)strcspn(val, "\r\n"), val);
+
+        /* Relative to the same host */
+        if (url[0] == '/') {
+            if (strlen(url) >= sizeof(j->uri))
+                return -RTTY_CMD_ERR_INVALID;
+            strcpy(j->uri, url);
+        } else if ((err = parse_url(j, url))) {
+            return -err;
+        } else {
+            /* Another host, the first connection starts over once it's resolved */
+            conn_close(j, c);
+            j->active--;
+            fetch_resolve(j);
+            return 1;
+        }
+
+        fetch_restart(j);
+        return 1;
+    }
+
+    val = find_header(c->hdr, "Transfer-Encoding");
+    if (val && !strncasecmp(val, "chunked", 7))
+        return -RTTY_CMD_ERR_NOT_SUPPORTED;
+
+    if (status == 206) {
+        long long start, end, total;
+
+        val = find_header(c->hdr, "Content-Range");
+        if (!val || sscanf(val, "bytes %lld-%lld/%lld", &start, &end, &total) != 3 || start != c->pos)
+            return -RTTY_CMD_ERR_INVALID;
+
+        if (first) {
+            j->size = total;
+            if (posix_fallocate(j->fd, 0, total) && ftruncate(j->fd, total) < 0)
+                return -RTTY_CMD_ERR_SYSERR;
+            if (split_ranges(j) < 0)
+                return -RTTY_CMD_ERR_SYSERR;
+        }
+
+        return 0;
+    }
+
+    if (status == 200 && first) {
+        /* No range support: one connection, until Content-Length or EOF */
+        j->nconns = 1;
+
+        val = find_header(c->hdr, "Content-Length");
+        if (val) {
+            j->size = strtoll(val, NULL, 10);
+            c->end = j->size - 1;
+            if (posix_fallocate(j->fd, 0, j->size) && ftruncate(j->fd, j->size) < 0)
+                return -RTTY_CMD_ERR_SYSERR;
+        }
+
+        return 0;
+    }
+
+    uwsc_log_err("Fetch %s%s: HTTP %d\n", j->host, j->uri, status);
+
+    return status == 404 ? -RTTY_CMD_ERR_NOT_FOUND : -RTTY_CMD_ERR_SYSERR;
+}
+
+static int conn_write(struct fetch_job *j, struct fetch_conn *c, const char *data, int len)
+{
+    if (c->end >= 0 && c->pos + len > c->end + 1)
+        len = c->end + 1 - c->pos;
+
+    if (len > 0 && pwrite(j->fd, data, len, c->pos) != len)
+        return -1;
+
+    c->pos += len;
+    j->received += len;
+    j->last_data = ev_now(j->ws->loop);
+
+    return 0;
+}
+
+/* The connection delivered all it had to: the job may be complete */
+static void conn_finish(struct fetch_job *j, struct fetch_conn *c, bool eof)
+{
+    conn_close(j, c);
+
+    if (--j->active > 0)
+        return;
+
+    /* Servers without Content-Length end the body by closing */
+    if (j->size < 0 && eof)
+        j->size = j->received;
+
+    if (j->received != j->size) {
+        fetch_fail(j, RTTY_CMD_ERR_SYSERR);
+        return;
+    }
+
+    fetch_done(j);
+}
+
+static void conn_io_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    struct fetch_conn *c = container_of(w, struct fetch_conn, io);
+    struct fetch_job *j = c->job;
+    char buf[16384];
+    char *eoh;
+    int len, ret;
+
+    if (!c->connected) {
+        int err = 0;
+        socklen_t elen = sizeof(err);
+
+        getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &elen);
+        if (err) {
+            fetch_fail(j, RTTY_CMD_ERR_NOT_FOUND);
+            return;
+        }
+
+        c->connected = true;
+
+        if (c->end < 0)
+            len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%lld-\r\n"
+                "Connection: close\r\n\r\n", j->uri, j->host, (long long)c->pos);
+        else
+            len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%lld-%lld\r\n"
+                "Connection: close\r\n\r\n", j->uri, j->host, (long long)c->pos, (long long)c->end);
+
+        if (write(w->fd, buf, len) != len) {
+            fetch_fail(j, RTTY_CMD_ERR_SYSERR);
+            return;
+        }
+
+        ev_io_stop(loop, w);
+        ev_io_set(w, w->fd, EV_READ);
+        ev_io_start(loop, w);
+        return;
+    }
+
+    len = read(w->fd, buf, sizeof(buf));
+    if (len < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return;
+        fetch_fail(j, RTTY_CMD_ERR_SYSERR);
+        return;
+    }
+
+    if (len == 0) {
+        if (!c->body) {
+            fetch_fail(j, RTTY_CMD_ERR_SYSERR);
+            return;
+        }
+        conn_finish(j, c, true);
+        return;
+    }
+
+    if (!c->body) {
+        int n = len < sizeof(c->hdr) - 1 - c->hdrlen ? len : sizeof(c->hdr) - 1 - c->hdrlen;
+
+        memcpy(c->hdr + c->hdrlen, buf, n);
+        c->hdrlen += n;
+        c->hdr[c->hdrlen] = '\0';
+
+        eoh = strstr(c->hdr, "\r\n\r\n");
+        if (!eoh) {
+            if (c->hdrlen == sizeof(c->hdr) - 1)
+                fetch_fail(j, RTTY_CMD_ERR_RESP_TOOBIG);
+            return;
+        }
+
+        *eoh = '\0';
+        c->body = true;
+
+        ret = parse_response(j, c);
+        if (ret < 0) {
+            fetch_fail(j, -ret);
+            return;
+        }
+
+        if (ret > 0)
+            return;
+
+        /* What came after the header is file data */
+        n = eoh + 4 - c->hdr - (c->hdrlen - n);
+        memmove(buf, buf + n, len - n);
+        len -= n;
+    }
+
+    if (conn_write(j, c, buf, len) < 0) {
+        fetch_fail(j, RTTY_CMD_ERR_SYSERR);
+        return;
+    }
+
+    if (c->end >= 0 && c->pos > c->end)
+        conn_finish(j, c, false);
+}
+
+/* Start over with the first connection, after a redirect */
+static void fetch_restart(struct fetch_job *j)
+{
+    struct fetch_conn *c = &j->conns[0];
+
+    conn_close(j, c);
+    j->active--;
+
+    if (conn_start(j, c, 0, -1) < 0)
+        fetch_fail(j, RTTY_CMD_ERR_SYSERR);
+}
+
+static void fetch_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+    struct fetch_job *j = container_of(w, struct fetch_job, timer);
+    char str[256] = "";
+
+    if (ev_now(loop) - j->last_data > RTTY_FETCH_TIMEOUT) {
+        fetch_fail(j, RTTY_CMD_ERR_TIMEOUT);
+        return;
+    }
+
+    if (j->received == j->last_received)
+        return;
+
+    j->last_received = j->received;
+
+    snprintf(str, sizeof(str) - 1, "{\"type\":\"fetch\",\"token\":\"%s\",\"progress\":"
+        "{\"received\":%lld,\"size\":%lld}}", j->token, (long long)j->received, (long long)j->size);
+    j->ws->send(j->ws, str, strlen(str), UWSC_OP_TEXT);
+}
+
+void run_fetch(struct uwsc_client *ws, const json_value *msg)
+{
+    const json_value *attrs = json_get_value(msg, "attrs");
+    const char *username = json_get_string(attrs, "username");
+    const char *password = json_get_string(attrs, "password");
+    const char *hash = json_get_string(attrs, "sha256");
+    const char *path = json_get_string(attrs, "path");
+    int conns = json_get_int(attrs, "connections");
+    struct fetch_job *j;
+    int err = 0;
+
+    j = calloc(1, sizeof(struct fetch_job));
+    if (!j) {
+        json_value_free((json_value *)msg);
+        return;
+    }
+
+    INIT_LIST_HEAD(&j->list);
+    j->ws = ws;
+    j->size = -1;
+    j->fd = -1;
+    j->nconns = conns > 0 && conns <= RTTY_FETCH_MAX_CONNS ? conns : RTTY_FETCH_CONNS;
+    strncpy(j->token, json_get_string(msg, "token"), sizeof(j->token) - 1);
+
+    if (!username[0] || !login_test(username, password)) {
+        err = RTTY_CMD_ERR_PERMIT;
+        goto ERR;
+    }
+
+    if (strlen(hash) != SHA256_DIGEST_LENGTH * 2 || !path[0] || strlen(path) >= sizeof(j->path)) {
+        err = RTTY_CMD_ERR_INVALID;
+        goto ERR;
+    }
+
+    err = parse_url(j, json_get_string(attrs, "url"));
+    if (err)
+        goto ERR;
+
+    strcpy(j->hash, hash);
+    strcpy(j->path, path);
+    snprintf(j->tmp, sizeof(j->tmp), "%s.fetch", path);
+
+    j->fd = open(j->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (j->fd < 0) {
+        err = RTTY_CMD_ERR_SYSERR;
+        goto ERR;
+    }
+
+    json_value_free((json_value *)msg);
+
+    list_add_tail(&j->list, &jobs);
+    ws_hold(ws);
+
+    j->start = j->last_data = ev_now(ws->loop);
+
+    ev_timer_init(&j->timer, fetch_timer_cb, 1.0, 1.0);
+
+    fetch_resolve(j);
+
+    return;
+
+ERR:
+    fetch_reply(j, err);
+    json_value_free((json_value *)msg);
+    if (j->fd > 0) {
+        close(j->fd);
+        unlink(j->tmp);
+    }
+    free(j);
+}
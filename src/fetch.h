@@ -0,0 +1,45 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _FETCH_H
+#define _FETCH_H
+
+#include <uwsc/uwsc.h>
+
+#include "json.h"
+
+#define RTTY_FETCH_MAX_CONNS    8
+#define RTTY_FETCH_CONNS        4       /* Default number of parallel ranges */
+#define RTTY_FETCH_TIMEOUT      30      /* Second without any data */
+#define RTTY_FETCH_MAX_REDIRECT 5
+
+/*
+ * Download attrs.url(plain http, typically a mirror next to the device)
+ * to attrs.path with parallel range requests, verify it against
+ * attrs.sha256 and report progress every second. The file data never
+ * passes through the rtty server.
+ */
+void run_fetch(struct uwsc_client *ws, const json_value *msg);
+
+#endif
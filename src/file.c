@@ -27,6 +27,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
 #include <string.h>
 #include <termios.h>
 #include <stdbool.h>
@@ -34,6 +35,9 @@
 #include <uwsc/log.h>
 
 #include "file.h"
+#include "peer.h"
+#include "tune.h"
+#include "pipeline.h"
 
 static void set_stdin(bool raw)
 {
@@ -68,11 +72,28 @@ static void set_stdin(bool raw)
     }
 }
 
-static void rf_write(int fd, void *buf, int len)
+static void rf_write(int fd, const void *buf, int len)
 {
-    if (write(fd, buf, len) < 0) {
-        uwsc_log_err("Write failed: %s\n", strerror(errno));
-        exit(0);
+    /* The terminal shares the non-blocking file description of stdin */
+    while (len > 0) {
+        int n = write(fd, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN) {
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+
+            uwsc_log_err("Write failed: %s\n", strerror(errno));
+            exit(0);
+        }
+
+        buf += n;
+        len -= n;
     }
 }
 
@@ -131,8 +152,11 @@ static bool parse_file_data(struct transfer_context *tc)
         unit = 'M';
     }
 
-    printf("  %d%%   %.3f %cB    %.3fs\r",
-        (int)(tc->offset * 1.0 / tc->size * 100), offset, unit, n - tc->ts);
+    if (tc->size == RF_SIZE_UNKNOWN)
+        printf("  %.3f %cB    %.3fs\r", offset, unit, n - tc->ts);
+    else
+        printf("  %d%%   %.3f %cB    %.3fs\r",
+            (int)(tc->offset * 1.0 / tc->size * 100), offset, unit, n - tc->ts);
     fflush(stdout);
 
     return true;
@@ -171,12 +195,13 @@ static int parse_file(struct transfer_context *tc)
                 return false;
             break;
         case 0x03:  /* file eof */
-            if (tc->fd > 0) {
+            /* When sending, it's a cancel and the pipeline may still be reading tc->fd */
+            if (tc->fd > 0 && tc->mode == RF_RECV) {
                 close(tc->fd);
                 tc->fd = -1;
 
-                if (tc->mode == RF_RECV)
-                    printf("\r\n");
+                printf("\r\n");
+                peer_cache_add(tc->name);
             }
             return true;
         default:
@@ -195,48 +220,99 @@ static void stdin_read_cb(struct ev_loop *loop, struct ev_io *w, int revents)
 
     buffer_put_fd(&tc->b, w->fd, -1, &eof, NULL, NULL);
 
-    if (parse_file(tc))
+    if (parse_file(tc)) {
         ev_io_stop(loop, w);
+
+        /* Canceled by user */
+        if (tc->mode == RF_SEND) {
+            uint8_t eof_rec = 0x03;
+
+            rf_write(STDOUT_FILENO, &eof_rec, 1);
+            ev_break(loop, EVBREAK_ALL);
+        }
+    }
 }
 
-static void timer_cb(struct ev_loop *loop, ev_timer *w, int revents)
+/* Runs on the pipeline's workers */
+static uint8_t *frame_block(uint8_t *data, int *len, void *arg)
 {
-    struct transfer_context *tc = w->data;
-    static uint8_t buf[RF_BLK_SIZE + 3];
-    int len;
+    data -= 3;
+    data[0] = 0x02;
+    *(uint16_t *)&data[1] = htons(*len);
 
-    /* Canceled by user */
-    if (tc->fd < 0) {
-        buf[0] = 0x03;
-        rf_write(STDOUT_FILENO, buf, 1);
-        ev_break(loop, EVBREAK_ALL);
-        return;
-    }
+    *len += 3;
+
+    return data;
+}
+
+static void emit_block(const uint8_t *data, int len, void *arg)
+{
+    rf_write(STDOUT_FILENO, data, len);
+}
+
+static void send_done(const uint8_t *digest, const uint8_t *list, int blk_size, bool err, void *arg)
+{
+    struct transfer_context *tc = arg;
+    uint8_t eof_rec = 0x03;
+    char hex[65];
 
-    len = read(tc->fd, buf + 3, RF_BLK_SIZE);
-    if (len == 0) {
-        buf[0] = 0x03;
-        rf_write(STDOUT_FILENO, buf, 1);
-        ev_break(loop, EVBREAK_ALL);
-        return;
+    rf_write(STDOUT_FILENO, &eof_rec, 1);
+
+    if (!err) {
+        sha256_hex(digest, hex);
+        printf("sha256 %s\r\n", hex);
+
+        if (list) {
+            sha256_hex(list, hex);
+            printf("sha256 list of %d byte blocks %s\r\n", blk_size, hex);
+        }
     }
 
-    buf[0] = 0x02;
-    *(uint16_t *)&buf[1] = htons(len);
-    
-    rf_write(STDOUT_FILENO, buf, len + 3);
+    ev_break(tc->loop, EVBREAK_ALL);
 }
 
+static const struct pipeline_ops send_ops = {
+    .process = frame_block,
+    .emit = emit_block,
+    .done = send_done
+};
+
 void transfer_file(const char *name)
 {
     struct ev_loop *loop = EV_DEFAULT;
     char magic[3] = {0xB6, 0xBC};
     struct transfer_context tc = {};
     const char *bname = "";
-    struct ev_timer t;
+    bool seekable = false;
     struct ev_io w;
 
-    if (name) {
+    tune_load();
+
+    if (name && !strcmp(name, "-")) {
+        int tty;
+
+        /* "cmd | rtty -S -": the data comes from stdin, the terminal is still needed for replies */
+        if (isatty(STDIN_FILENO)) {
+            printf("stdin is a terminal, pipe the data into 'rtty -S -'\r\n");
+            exit(0);
+        }
+
+        tty = open("/dev/tty", O_RDWR);
+        if (tty < 0) {
+            printf("Open '/dev/tty' failed: %s\r\n", strerror(errno));
+            exit(0);
+        }
+
+        tc.fd = dup(STDIN_FILENO);
+        dup2(tty, STDIN_FILENO);
+        close(tty);
+
+        bname = "stdin";
+        tc.size = RF_SIZE_UNKNOWN;
+        magic[2] = tc.mode = RF_SEND;
+
+        printf("Transferring stdin...Press Ctrl+C to cancel\r\n");
+    } else if (name) {
         struct stat st;
 
         bname = basename(name);
@@ -244,6 +320,7 @@ void transfer_file(const char *name)
 
         printf("Transferring '%s'...Press Ctrl+C to cancel\r\n", bname);
 
+        /* Blocks until a named pipe has a writer */
         tc.fd = open(name, O_RDONLY);
         if (tc.fd < 0) {
             if (errno == ENOENT) {
@@ -256,10 +333,15 @@ void transfer_file(const char *name)
         }
 
         fstat(tc.fd, &st);
-        tc.size = st.st_size;
 
-        if (!(st.st_mode & S_IFREG)) {
-            printf("'%s' is not a regular file\r\n", name);
+        if (S_ISREG(st.st_mode)) {
+            /* The size field is 32 bits, and all ones already means unknown */
+            tc.size = st.st_size < RF_SIZE_UNKNOWN ? st.st_size : RF_SIZE_UNKNOWN;
+            seekable = true;
+        } else if (S_ISFIFO(st.st_mode)) {
+            tc.size = RF_SIZE_UNKNOWN;
+        } else {
+            printf("'%s' is not a regular file or a pipe\r\n", name);
             exit(0);
         }
     } else {
@@ -279,15 +361,18 @@ void transfer_file(const char *name)
     if (tc.mode == RF_SEND) {
         uint8_t info[512] = {0x01};
 
-        ev_timer_init(&t, timer_cb, 0.01, 0.01);
-	    ev_timer_start(loop, &t);
-        t.data = &tc;
-
         info[1] = strlen(bname);
         memcpy(info + 2, bname, strlen(bname));
         *(uint32_t *)&info[2 + strlen(bname)] = htonl(tc.size);
 
         rf_write(STDOUT_FILENO, info, 6 + strlen(bname));
+
+        /* Reading, hashing and framing run on worker threads, the frames are written here in order */
+        tc.loop = loop;
+        if (!pipeline_start(loop, tc.fd, seekable, tuning.blk_size, &send_ops, &tc)) {
+            printf("Start transfer failed\r\n");
+            exit(0);
+        }
     }
 
     ev_run(loop, 0);
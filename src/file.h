@@ -28,7 +28,9 @@
 #include <uwsc/buffer.h>
 #include <ev.h>
 
-#define RF_BLK_SIZE 8912         /* 8KB */
+#define RF_BLK_SIZE 8912         /* 8KB, default */
+#define RF_MAX_BLK_SIZE 32768    /* The length field of a data record is 16 bits */
+#define RF_SIZE_UNKNOWN 0xFFFFFFFF  /* Size of a pipe or a file of 4GB+ in the file info record; data ends at the eof record */
 
 enum {
     RF_SEND = 's',
@@ -36,12 +38,13 @@ enum {
 };
 
 struct transfer_context {
-    int size;
-    int offset;
+    uint32_t size;
+    uint64_t offset;
     int mode;
     int fd;
     char name[512];
     ev_tstamp ts;
+    struct ev_loop *loop;
     struct buffer b;
 };
 
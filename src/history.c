@@ -0,0 +1,531 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <uwsc/log.h>
+
+#include "list.h"
+#include "alloc.h"
+#include "utils.h"
+#include "config.h"
+#include "command.h"
+#include "history.h"
+#include "bulk.h"
+#include "wsframe.h"
+#include "profiler.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+struct history_block {
+    struct list_head list;
+    uint64_t offset;        /* Of the first byte in the session's output */
+    int len;                /* Uncompressed */
+    int clen;
+    uint8_t data[0];
+};
+
+struct history {
+    struct list_head list;
+    struct list_head blocks;
+    int sid;
+    size_t size;            /* Compressed bytes held */
+    uint64_t total;         /* Bytes of output seen */
+    uint8_t *cur;           /* Block being filled */
+    int curlen;
+};
+
+struct history_search {
+    regex_t re;
+    struct buffer *b;
+    int max;
+    int matches;
+    struct buffer line;     /* Partial line carried over from the previous block */
+    uint64_t line_offset;
+};
+
+/* A search runs on its own thread over a copy of the history */
+struct history_job {
+    struct history_job *next;
+    struct uwsc_client *ws;
+    const json_value *msg;
+    struct history *h;
+    struct buffer reply;
+    int err;
+};
+
+static int history_quota;
+static LIST_HEAD(histories);
+
+static struct history_job *done_jobs;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ev_async done_watcher;
+static bool done_watcher_ready;
+
+void history_init(int quota)
+{
+    history_quota = quota;
+}
+
+struct history *history_open(int sid)
+{
+    struct history *h;
+
+    if (!history_quota)
+        return NULL;
+
+    h = rtty_calloc(RTTY_MEM_HISTORY, 1, sizeof(struct history));
+    if (!h)
+        return NULL;
+
+    h->cur = rtty_malloc(RTTY_MEM_HISTORY, RTTY_HISTORY_BLOCK);
+    if (!h->cur) {
+        rtty_free(h);
+        return NULL;
+    }
+
+    h->sid = sid;
+    INIT_LIST_HEAD(&h->blocks);
+    list_add_tail(&h->list, &histories);
+
+    return h;
+}
+
+static void drop_block(struct history *h, struct history_block *blk)
+{
+    list_del(&blk->list);
+    h->size -= blk->clen;
+    rtty_free(blk);
+}
+
+static void seal_block(struct history *h)
+{
+    struct history_block *blk;
+    int len = h->curlen, clen = len;
+
+    /* The buffer is reused either way, output that can't be kept is lost */
+    h->curlen = 0;
+
+#ifdef HAVE_ZLIB
+    uLongf zlen = compressBound(len);
+
+    blk = rtty_malloc(RTTY_MEM_HISTORY, sizeof(struct history_block) + zlen);
+    if (!blk)
+        return;
+
+    if (compress2(blk->data, &zlen, h->cur, len, 1) != Z_OK) {
+        rtty_free(blk);
+        return;
+    }
+
+    clen = zlen;
+    blk = rtty_realloc(RTTY_MEM_HISTORY, blk, sizeof(struct history_block) + clen) ? : blk;
+#else
+    blk = rtty_malloc(RTTY_MEM_HISTORY, sizeof(struct history_block) + clen);
+    if (!blk)
+        return;
+
+    memcpy(blk->data, h->cur, clen);
+#endif
+
+    blk->offset = h->total - len;
+    blk->len = len;
+    blk->clen = clen;
+
+    list_add_tail(&blk->list, &h->blocks);
+    h->size += clen;
+
+    while (h->size > history_quota && !list_empty(&h->blocks))
+        drop_block(h, list_first_entry(&h->blocks, struct history_block, list));
+}
+
+void history_append(struct history *h, const void *data, int len)
+{
+    const uint8_t *p = data;
+
+    while (len > 0) {
+        int n = RTTY_HISTORY_BLOCK - h->curlen;
+
+        if (n > len)
+            n = len;
+
+        memcpy(h->cur + h->curlen, p, n);
+        h->curlen += n;
+        h->total += n;
+        p += n;
+        len -= n;
+
+        if (h->curlen == RTTY_HISTORY_BLOCK)
+            seal_block(h);
+    }
+}
+
+void history_close(struct history *h)
+{
+    struct history_block *blk, *tmp;
+
+    list_for_each_entry_safe(blk, tmp, &h->blocks, list)
+        drop_block(h, blk);
+
+    list_del(&h->list);
+    rtty_free(h->cur);
+    rtty_free(h);
+}
+
+/* Drop escape sequences and carriage returns so regexes see the text */
+static int strip_line(const char *in, int len, char *out)
+{
+    int i, n = 0;
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = in[i];
+
+        if (c == 0x1b && i + 1 < len) {
+            if (in[i + 1] == '[') {
+                /* CSI: parameters up to a final byte 0x40-0x7e */
+                for (i += 2; i < len && ((unsigned char)in[i] < 0x40 || (unsigned char)in[i] > 0x7e); i++)
+                    ;
+            } else if (in[i + 1] == ']') {
+                /* OSC: up to BEL or ST */
+                for (i += 2; i < len && in[i] != 0x07 && !(in[i] == 0x1b && i + 1 < len && in[i + 1] == '\\'); i++)
+                    ;
+                if (i < len && in[i] == 0x1b)
+                    i++;
+            } else {
+                i++;
+            }
+            continue;
+        }
+
+        if (c == '\r' || c == 0x07 || c == '\0')
+            continue;
+
+        out[n++] = c;
+    }
+
+    out[n] = '\0';
+
+    return n;
+}
+
+static void search_line(struct history_search *s, const char *line, int len, uint64_t offset)
+{
+    char *text;
+    int n;
+
+    if (s->matches > s->max)
+        return;
+
+    text = malloc(len + 1);
+    if (!text)
+        return;
+
+    n = strip_line(line, len, text);
+
+    if (!regexec(&s->re, text, 0, NULL, 0)) {
+        /* One more than max tells the caller there are more */
+        if (++s->matches <= s->max) {
+            buffer_put_printf(s->b, "%s{\"offset\":%llu,\"line\":", s->matches > 1 ? "," : "",
+                (unsigned long long)offset);
+            buffer_put_json_string(s->b, text, n < RTTY_HISTORY_MAX_LINE ? n : RTTY_HISTORY_MAX_LINE);
+            buffer_put_printf(s->b, "}");
+        }
+    }
+
+    free(text);
+}
+
+static void search_data(struct history_search *s, const uint8_t *data, int len, uint64_t offset, bool last)
+{
+    const uint8_t *p = data, *nl;
+
+    while ((nl = memchr(p, '\n', len - (p - data)))) {
+        if (buffer_length(&s->line) > 0) {
+            buffer_put_data(&s->line, p, nl - p);
+            search_line(s, buffer_data(&s->line), buffer_length(&s->line), s->line_offset);
+            buffer_free(&s->line);
+        } else {
+            search_line(s, (const char *)p, nl - p, offset + (p - data));
+        }
+
+        p = nl + 1;
+    }
+
+    if (p < data + len) {
+        if (buffer_length(&s->line) == 0)
+            s->line_offset = offset + (p - data);
+        buffer_put_data(&s->line, p, data + len - p);
+    }
+
+    if (last && buffer_length(&s->line) > 0) {
+        search_line(s, buffer_data(&s->line), buffer_length(&s->line), s->line_offset);
+        buffer_free(&s->line);
+    }
+}
+
+static int search_block(struct history_search *s, struct history_block *blk)
+{
+#ifdef HAVE_ZLIB
+    uLongf len = blk->len;
+    uint8_t *data = malloc(len);
+
+    if (!data)
+        return -1;
+
+    if (uncompress(data, &len, blk->data, blk->clen) != Z_OK) {
+        free(data);
+        return -1;
+    }
+
+    search_data(s, data, len, blk->offset, false);
+    free(data);
+#else
+    search_data(s, blk->data, blk->len, blk->offset, false);
+#endif
+
+    return 0;
+}
+
+static struct history *find_history(int sid)
+{
+    struct history *h;
+
+    list_for_each_entry(h, &histories, list) {
+        if (h->sid == sid)
+            return h;
+    }
+
+    return NULL;
+}
+
+static int history_search(struct history *h, const json_value *attrs, struct buffer *b)
+{
+    struct history_search s = {
+        .b = b,
+        .max = json_get_int(attrs, "max")
+    };
+    struct history_block *blk;
+    uint64_t from = h->total - h->curlen;
+
+    if (s.max <= 0 || s.max > RTTY_HISTORY_MAX_MATCHES)
+        s.max = RTTY_HISTORY_MAX_MATCHES;
+
+    if (regcomp(&s.re, json_get_string(attrs, "regex"),
+        REG_EXTENDED | REG_NOSUB | (json_get_bool(attrs, "icase") ? REG_ICASE : 0)))
+        return RTTY_CMD_ERR_INVALID;
+
+    if (!list_empty(&h->blocks))
+        from = list_first_entry(&h->blocks, struct history_block, list)->offset;
+
+    buffer_put_printf(b, "\"from\":%llu,\"to\":%llu,\"matches\":[", (unsigned long long)from,
+        (unsigned long long)h->total);
+
+    list_for_each_entry(blk, &h->blocks, list) {
+        if (search_block(&s, blk) < 0)
+            break;
+    }
+
+    search_data(&s, h->cur, h->curlen, h->total - h->curlen, true);
+
+    buffer_put_printf(b, "],\"more\":%s", s.matches > s.max ? "true" : "false");
+
+    buffer_free(&s.line);
+    regfree(&s.re);
+
+    return 0;
+}
+
+/* A copy of h that a search thread reads while the session goes on */
+static struct history *history_snapshot(struct history *h)
+{
+    struct history_block *blk, *copy;
+    struct history *snap;
+
+    snap = rtty_calloc(RTTY_MEM_HISTORY, 1, sizeof(struct history));
+    if (!snap)
+        return NULL;
+
+    INIT_LIST_HEAD(&snap->list);
+    INIT_LIST_HEAD(&snap->blocks);
+
+    snap->sid = h->sid;
+    snap->total = h->total;
+    snap->curlen = h->curlen;
+
+    snap->cur = rtty_malloc(RTTY_MEM_HISTORY, h->curlen + 1);
+    if (!snap->cur)
+        goto err;
+    memcpy(snap->cur, h->cur, h->curlen);
+
+    list_for_each_entry(blk, &h->blocks, list) {
+        copy = rtty_malloc(RTTY_MEM_HISTORY, sizeof(struct history_block) + blk->clen);
+        if (!copy)
+            goto err;
+
+        memcpy(copy, blk, sizeof(struct history_block) + blk->clen);
+        list_add_tail(&copy->list, &snap->blocks);
+        snap->size += blk->clen;
+    }
+
+    return snap;
+
+err:
+    history_close(snap);
+    return NULL;
+}
+
+static void free_job(struct history_job *job)
+{
+    if (job->h)
+        history_close(job->h);
+
+    buffer_free(&job->reply);
+    json_value_free((json_value *)job->msg);
+    ws_put(job->ws);
+    free(job);
+}
+
+static void *search_thread(void *arg)
+{
+    struct history_job *job = arg;
+    const char *token = json_get_string(job->msg, "token");
+
+    profiler_thread_init();
+
+    buffer_put_printf(&job->reply, "{\"type\":\"history\",\"token\":");
+    buffer_put_json_string(&job->reply, token, strlen(token));
+    buffer_put_printf(&job->reply, ",\"attrs\":{");
+
+    job->err = history_search(job->h, json_get_value(job->msg, "attrs"), &job->reply);
+    if (!job->err)
+        buffer_put_printf(&job->reply, "}}");
+
+    pthread_mutex_lock(&done_lock);
+    job->next = done_jobs;
+    done_jobs = job;
+    pthread_mutex_unlock(&done_lock);
+
+    ev_async_send(job->ws->loop, &done_watcher);
+
+    return NULL;
+}
+
+static void history_err_reply(struct uwsc_client *ws, const char *token, int err)
+{
+    struct buffer b = {};
+
+    buffer_put_printf(&b, "{\"type\":\"history\",\"token\":");
+    buffer_put_json_string(&b, token, strlen(token));
+    buffer_put_printf(&b, ",\"attrs\":{\"err\":%d,\"msg\":\"%s\"}}", err, cmderr2str(err));
+
+    bulk_send(ws, buffer_data(&b), buffer_length(&b), UWSC_OP_TEXT);
+    buffer_free(&b);
+}
+
+static void done_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+    struct history_job *job, *next;
+
+    pthread_mutex_lock(&done_lock);
+    job = done_jobs;
+    done_jobs = NULL;
+    pthread_mutex_unlock(&done_lock);
+
+    for (; job; job = next) {
+        next = job->next;
+
+        if (job->err)
+            history_err_reply(job->ws, json_get_string(job->msg, "token"), job->err);
+        else
+            bulk_send(job->ws, buffer_data(&job->reply), buffer_length(&job->reply), UWSC_OP_TEXT);
+
+        free_job(job);
+    }
+}
+
+void run_history(struct uwsc_client *ws, const json_value *msg)
+{
+    const json_value *attrs = json_get_value(msg, "attrs");
+    const char *username = json_get_string(attrs, "username");
+    const char *password = json_get_string(attrs, "password");
+    const char *token = json_get_string(msg, "token");
+    struct history_job *job = NULL;
+    struct history *h;
+    pthread_t tid;
+    int err;
+
+    if (!username[0] || !login_test(username, password)) {
+        err = RTTY_CMD_ERR_PERMIT;
+        goto err;
+    }
+
+    h = find_history(json_get_int(attrs, "sid"));
+    if (!h) {
+        err = RTTY_CMD_ERR_NOT_FOUND;
+        goto err;
+    }
+
+    job = calloc(1, sizeof(struct history_job));
+    if (!job) {
+        err = RTTY_CMD_ERR_NOMEM;
+        goto err;
+    }
+
+    job->h = history_snapshot(h);
+    if (!job->h) {
+        err = RTTY_CMD_ERR_NOMEM;
+        goto err;
+    }
+
+    job->ws = ws;
+    job->msg = msg;
+
+    if (!done_watcher_ready) {
+        ev_async_init(&done_watcher, done_cb);
+        ev_async_start(ws->loop, &done_watcher);
+        done_watcher_ready = true;
+    }
+
+    if (pthread_create(&tid, NULL, search_thread, job)) {
+        err = RTTY_CMD_ERR_SYSERR;
+        goto err;
+    }
+
+    pthread_detach(tid);
+    ws_hold(ws);
+    return;
+
+err:
+    history_err_reply(ws, token, err);
+
+    if (job && job->h)
+        history_close(job->h);
+    free(job);
+    json_value_free((json_value *)msg);
+}
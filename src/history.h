@@ -0,0 +1,57 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <uwsc/uwsc.h>
+
+#include "json.h"
+
+#define RTTY_HISTORY_BLOCK          (64 * 1024)     /* Output collected before it's compressed */
+#define RTTY_HISTORY_MAX_MATCHES    1000
+#define RTTY_HISTORY_MAX_LINE       512             /* Longer matching lines are cut */
+
+struct history;
+
+/*
+ * Per session output history kept in memory as compressed blocks(zlib
+ * when available), the oldest dropped beyond quota bytes per session.
+ * The server searches it with a "history" message and gets back only the
+ * matching lines. A search runs on its own thread over a copy of the
+ * blocks, so it doesn't hold up the loop.
+ */
+void history_init(int quota);
+
+/* Returns NULL if history is disabled */
+struct history *history_open(int sid);
+
+void history_append(struct history *h, const void *data, int len);
+
+/* h must not be used after this */
+void history_close(struct history *h);
+
+void run_history(struct uwsc_client *ws, const json_value *msg);
+
+#endif
@@ -28,6 +28,7 @@
  */
 
 #include "json.h"
+#include "alloc.h"
 
 #ifdef _MSC_VER
    #ifndef _CRT_SECURE_NO_WARNINGS
@@ -77,12 +78,12 @@ typedef struct
 
 static void * default_alloc (size_t size, int zero, void * user_data)
 {
-   return zero ? calloc (1, size) : malloc (size);
+   return zero ? rtty_calloc (RTTY_MEM_JSON, 1, size) : rtty_malloc (RTTY_MEM_JSON, size);
 }
 
 static void default_free (void * ptr, void * user_data)
 {
-   free (ptr);
+   rtty_free (ptr);
 }
 
 static void * json_alloc (json_state * state, unsigned long size, int zero)
@@ -24,14 +24,17 @@
 
 #include <pty.h>
 #include <fcntl.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <termios.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <arpa/inet.h>
 #include <uwsc/uwsc.h>
 
 #include "list.h"
@@ -40,15 +43,44 @@
 #include "config.h"
 #include "utils.h"
 #include "command.h"
+#include "record.h"
+#include "bulk.h"
+#include "proto.h"
+#include "expect.h"
+#include "bridge.h"
+#include "peer.h"
+#include "proc.h"
+#include "profiler.h"
+#include "tune.h"
+#include "manifest.h"
+#include "wsframe.h"
+#include "fetch.h"
+#include "alloc.h"
+#include "history.h"
+#include "plugin.h"
+#include "openwrt.h"
 
 #define RTTY_RECONNECT_INTERVAL  5
 #define RTTY_MAX_SESSIONS        5
 #define RTTY_BUFFER_PERSISTENT_SIZE 4096
+#define RTTY_OBSERVER_WINDOW     (64 * 1024)  /* Unacknowledged bytes per observer */
+#define RTTY_MAX_PROGRAMS        8
+#define RTTY_SEQ_PENDING         32           /* Input frames tracked until written to the pty */
+
+/* A read-only sid attached to another session's pty */
+struct tty_observer {
+    struct list_head list;
+    struct tty_session *tty;
+    int sid;
+    size_t inflight;    /* Bytes sent but not acknowledged by the server */
+    size_t dropped;     /* Bytes skipped since the window was full */
+};
 
 struct tty_session {
     pid_t pid;
     int pty;
     int sid;
+    struct list_head observers;
 
     struct ev_loop *loop;
     struct ev_timer timer;
@@ -57,19 +89,87 @@ struct tty_session {
     struct ev_io iow;
     struct ev_child cw;
     struct buffer wb;
+    struct record *rec;
+    struct history *hist;
+
+    /*
+     * Input sequence numbering, enabled by "seq" in the login message.
+     * Input frames carry a seq and output frames carry the last seq whose
+     * bytes have been written to the pty, which lets the client predict echo.
+     */
+    bool seq;
+    uint32_t acked;
+    uint64_t queued;        /* Input bytes put into wb */
+    uint64_t written;       /* Input bytes written to the pty */
+    struct {
+        uint32_t seq;
+        uint64_t end;       /* Value of queued after this frame */
+    } pending[RTTY_SEQ_PENDING];
+    int npending;
+    tcflag_t lflag;         /* Terminal mode last reported to the client */
 };
 
 static char login[128];       /* /bin/login */
 static char server_url[512];
+static char url_path[400];      /* server_url without scheme, host and port */
 static char extra_header[128];  /* authorization token */
 static char *username = NULL;
 static bool auto_reconnect;
 static int keepalive = 5;       /* second */
 static struct ev_timer reconnect_timer;
+static struct uwsc_client *current;     /* The primary connection */
+static struct uwsc_client *migrating;   /* Its replacement, until it's open */
+static char migrating_url[512];         /* Becomes server_url once it's open */
+static char resume_token[64];
 static struct tty_session *sessions[RTTY_MAX_SESSIONS + 1];
+static struct tty_observer *observers[RTTY_MAX_SESSIONS + 1];
+
+/* Programs a "login" may run instead of login(1), allowed with -l name=command */
+static struct {
+    const char *name;
+    const char *cmd;
+} programs[RTTY_MAX_PROGRAMS];
+static int nprograms;
+
+static void send_logout(struct uwsc_client *cl, int sid)
+{
+    char str[128] = "";
+
+    snprintf(str, sizeof(str) - 1, "{\"type\":\"logout\",\"sid\":%d}", sid);
+    cl->send(cl, str, strlen(str), UWSC_OP_TEXT);
+}
+
+static void del_observer(struct tty_observer *o)
+{
+    list_del(&o->list);
+    observers[o->sid] = NULL;
+
+    uwsc_log_info("Del observer: %d\n", o->sid);
+
+    rtty_free(o);
+}
+
+static inline struct tty_observer *find_observer(int sid)
+{
+    if (sid < 0 || sid > RTTY_MAX_SESSIONS)
+        return NULL;
+
+    return observers[sid];
+}
+
+/* The owner is going away: tell the server its observers are gone as well */
+static void logout_observers(struct tty_session *tty)
+{
+    struct tty_observer *o;
+
+    list_for_each_entry(o, &tty->observers, list)
+        send_logout(tty->cl, o->sid);
+}
 
 static void del_tty_session(struct tty_session *tty)
 {
+    struct tty_observer *o, *tmp;
+
     ev_io_stop(tty->loop, &tty->ior);
     ev_io_stop(tty->loop, &tty->iow);
     ev_timer_stop(tty->loop, &tty->timer);
@@ -77,6 +177,15 @@ static void del_tty_session(struct tty_session *tty)
 
     buffer_free(&tty->wb);
 
+    if (tty->rec)
+        record_close(tty->rec);
+
+    if (tty->hist)
+        history_close(tty->hist);
+
+    list_for_each_entry_safe(o, tmp, &tty->observers, list)
+        del_observer(o);
+
     close(tty->pty);
     kill(tty->pid, SIGTERM);
 
@@ -84,12 +193,12 @@ static void del_tty_session(struct tty_session *tty)
 
     uwsc_log_info("Del session: %d\n", tty->sid);
 
-    free(tty);
+    rtty_free(tty);
 }
 
 static inline struct tty_session *find_tty_session(int sid)
 {
-    if (sid > RTTY_MAX_SESSIONS)
+    if (sid < 0 || sid > RTTY_MAX_SESSIONS)
         return NULL;
 
     return sessions[sid];
@@ -98,21 +207,162 @@ static inline struct tty_session *find_tty_session(int sid)
 static inline void del_tty_session_by_sid(int sid)
 {
     struct tty_session *tty = find_tty_session(sid);
-    if (tty)
+    struct tty_observer *o = find_observer(sid);
+
+    if (tty) {
+        logout_observers(tty);
         del_tty_session(tty);
+    } else if (o) {
+        del_observer(o);
+    }
+}
+
+/*
+ * Send the data just read from the pty to every observer. The frame buffer
+ * is shared: only the sid byte in front of the data is rewritten for each
+ * observer. An observer whose window is full skips the data instead of
+ * holding up the owner.
+ */
+static void fan_out(struct tty_session *tty, uint8_t *data, int len)
+{
+    struct uwsc_client *cl = tty->cl;
+    struct tty_observer *o;
+    int hdrlen;
+
+    list_for_each_entry(o, &tty->observers, list) {
+        if (o->inflight + len > RTTY_OBSERVER_WINDOW) {
+            o->dropped += len;
+            continue;
+        }
+
+        hdrlen = proto_frame_header(data, RTTY_FRAME_DATA, o->sid, 0, 0);
+        cl->send(cl, data - hdrlen, len + hdrlen, UWSC_OP_BINARY);
+        o->inflight += len;
+    }
+}
+
+static void new_observer(struct uwsc_client *cl, int sid, int target)
+{
+    struct tty_session *tty = find_tty_session(target);
+    struct tty_observer *o;
+    char str[128] = "";
+    int err = 0;
+
+    if (sid < 0 || sid > RTTY_MAX_SESSIONS || sessions[sid] || observers[sid]) {
+        err = 2;
+        goto done;
+    }
+
+    if (!tty) {
+        err = 3;
+        goto done;
+    }
+
+    o = rtty_calloc(RTTY_MEM_SESSION, 1, sizeof(struct tty_observer));
+    if (!o) {
+        err = 4;
+        goto done;
+    }
+
+    o->sid = sid;
+    o->tty = tty;
+
+    list_add_tail(&o->list, &tty->observers);
+    observers[sid] = o;
+
+    uwsc_log_info("New observer: %d -> %d\n", sid, target);
+
+done:
+    if (err)
+        snprintf(str, sizeof(str) - 1, "{\"type\":\"observe\",\"sid\":%d,\"err\":%d}", sid, err);
+    else
+        snprintf(str, sizeof(str) - 1, "{\"type\":\"observe\",\"sid\":%d,\"code\":0}", sid);
+    cl->send(cl, str, strlen(str), UWSC_OP_TEXT);
+}
+
+/* The server has delivered len bytes of an observer's output */
+static void observer_ack(struct uwsc_client *cl, int sid, int len)
+{
+    struct tty_observer *o = find_observer(sid);
+    char str[128] = "";
+
+    if (!o)
+        return;
+
+    if (len > o->inflight)
+        len = o->inflight;
+    o->inflight -= len;
+
+    if (o->dropped && o->inflight < RTTY_OBSERVER_WINDOW / 2) {
+        snprintf(str, sizeof(str) - 1, "{\"type\":\"observe\",\"sid\":%d,\"dropped\":%zu}",
+            sid, o->dropped);
+        cl->send(cl, str, strlen(str), UWSC_OP_TEXT);
+        o->dropped = 0;
+    }
+}
+
+/* Tell the client when echo or canonical mode is switched in the pty */
+static void report_termios(struct tty_session *tty)
+{
+    struct termios tio;
+    char str[128] = "";
+
+    if (tcgetattr(tty->pty, &tio) < 0)
+        return;
+
+    if ((tio.c_lflag & (ECHO | ICANON)) == tty->lflag)
+        return;
+
+    tty->lflag = tio.c_lflag & (ECHO | ICANON);
+
+    snprintf(str, sizeof(str) - 1, "{\"type\":\"termios\",\"sid\":%d,\"echo\":%s,\"icanon\":%s}",
+        tty->sid, (tty->lflag & ECHO) ? "true" : "false", (tty->lflag & ICANON) ? "true" : "false");
+    tty->cl->send(tty->cl, str, strlen(str), UWSC_OP_TEXT);
+}
+
+/* Remember where an input frame ends in wb */
+static void seq_queued(struct tty_session *tty, uint32_t seq, int len)
+{
+    tty->queued += len;
+
+    /* Out of slots: extend the newest one, its bytes are written last anyway */
+    if (tty->npending == RTTY_SEQ_PENDING) {
+        tty->pending[tty->npending - 1].seq = seq;
+        tty->pending[tty->npending - 1].end = tty->queued;
+        return;
+    }
+
+    tty->pending[tty->npending].seq = seq;
+    tty->pending[tty->npending].end = tty->queued;
+    tty->npending++;
+}
+
+static void seq_written(struct tty_session *tty, int len)
+{
+    int i;
+
+    tty->written += len;
+
+    for (i = 0; i < tty->npending && tty->pending[i].end <= tty->written; i++)
+        tty->acked = tty->pending[i].seq;
+
+    if (i > 0) {
+        tty->npending -= i;
+        memmove(tty->pending, tty->pending + i, tty->npending * sizeof(tty->pending[0]));
+    }
 }
 
 static void pty_read_cb(struct ev_loop *loop, struct ev_io *w, int revents)
 {
     struct tty_session *tty = container_of(w, struct tty_session, ior);
     struct uwsc_client *cl = tty->cl;
-    static uint8_t buf[4096 + 1];
-    int len;
-
-    buf[0] = tty->sid;
+    static uint8_t buf[RTTY_FRAME_MAX_HDRLEN + RTTY_PTY_MAX_READ];
+    uint8_t *data = buf + RTTY_FRAME_MAX_HDRLEN;
+    int size = tuning.pty_read_size < RTTY_PTY_MAX_READ ? tuning.pty_read_size : RTTY_PTY_MAX_READ;
+    int len, hdrlen;
 
     while (1) {
-        len = read(w->fd, buf + 1, sizeof(buf) - 1);
+        len = read(w->fd, data, size);
         if (likely(len > 0))
             break;
 
@@ -128,7 +378,31 @@ static void pty_read_cb(struct ev_loop *loop, struct ev_io *w, int revents)
             return;
     }
 
-    cl->send(cl, buf, len + 1, UWSC_OP_BINARY);
+    /*
+     * Sealing a full history block and flushing a full record batch
+     * allocate, so both stay out of the hot section
+     */
+    if (tty->hist)
+        history_append(tty->hist, data, len);
+
+    if (tty->rec)
+        record_event(tty->rec, RECORD_EV_OUTPUT, data, len);
+
+    ALLOC_HOT_BEGIN();
+
+    if (!list_empty(&tty->observers))
+        fan_out(tty, data, len);
+
+    if (tty->seq) {
+        report_termios(tty);
+        hdrlen = proto_frame_header(data, RTTY_FRAME_DATA, tty->sid, RTTY_FRAME_FLAG_SEQ, tty->acked);
+    } else {
+        hdrlen = proto_frame_header(data, RTTY_FRAME_DATA, tty->sid, 0, 0);
+    }
+
+    cl->send(cl, data - hdrlen, len + hdrlen, UWSC_OP_BINARY);
+
+    ALLOC_HOT_END("pty output");
 }
 
 static void pty_write_cb(struct ev_loop *loop, struct ev_io *w, int revents)
@@ -143,6 +417,9 @@ static void pty_write_cb(struct ev_loop *loop, struct ev_io *w, int revents)
         return;
     }
 
+    if (tty->seq)
+        seq_written(tty, ret);
+
     if (buffer_length(wb) < 1)
         ev_io_stop(loop, w);
 }
@@ -150,35 +427,140 @@ static void pty_write_cb(struct ev_loop *loop, struct ev_io *w, int revents)
 static void pty_on_exit(struct ev_loop *loop, struct ev_child *w, int revents)
 {
     struct tty_session *tty = container_of(w, struct tty_session, cw);
-    char str[128] = "";
 
-    snprintf(str, sizeof(str) - 1, "{\"type\":\"logout\",\"sid\":%d}", tty->sid);
-
-    tty->cl->send(tty->cl, str, strlen(str), UWSC_OP_TEXT);
+    logout_observers(tty);
+    send_logout(tty->cl, tty->sid);
 
     del_tty_session(tty);
 }
 
-static void new_tty_session(struct uwsc_client *cl, int sid)
+static const char *find_program(const char *name)
 {
+    int i;
+
+    for (i = 0; i < nprograms; i++) {
+        if (!strcmp(programs[i].name, name))
+            return programs[i].cmd;
+    }
+
+    return NULL;
+}
+
+/* TERM and LANG values: letters, digits and ._@- */
+static bool valid_env(const char *val)
+{
+    if (strlen(val) > 63)
+        return false;
+
+    for (; *val; val++) {
+        if (!isalnum(*val) && !strchr("._@-", *val))
+            return false;
+    }
+
+    return true;
+}
+
+static void login_err_reply(struct uwsc_client *cl, int sid, int err, const char *msg)
+{
+    char str[128] = "";
+
+    snprintf(str, sizeof(str) - 1, "{\"type\":\"login\",\"sid\":%d,\"err\":%d,\"msg\":\"%s\"}", sid, err, msg);
+    cl->send(cl, str, strlen(str), UWSC_OP_TEXT);
+}
+
+/*
+ * Optional fields of "login": cols/rows(initial winsize), term, lang and a
+ * program allowed with -l, run in cwd instead of login(1). A program needs
+ * username/password unless -f was given.
+ */
+static void new_tty_session(struct uwsc_client *cl, int sid, const json_value *msg)
+{
+    const char *program = json_get_string(msg, "program");
+    const char *term = json_get_string(msg, "term");
+    const char *lang = json_get_string(msg, "lang");
+    const char *cwd = json_get_string(msg, "cwd");
+    struct winsize size = {
+        .ws_col = json_get_int(msg, "cols"),
+        .ws_row = json_get_int(msg, "rows")
+    };
+    const char *cmd = NULL;
     struct tty_session *s;
     char str[128] = "";
+    int pty, cwd_fd = -1;
     pid_t pid;
-    int pty;
 
-    s = calloc(1, sizeof(struct tty_session));
-    if (!s)
+    if (program[0]) {
+        cmd = find_program(program);
+        if (!cmd) {
+            login_err_reply(cl, sid, 3, "program not allowed");
+            return;
+        }
+
+        const char *user = json_get_string(msg, "username");
+
+        if (!username && (!user[0] || !login_test(user, json_get_string(msg, "password")))) {
+            login_err_reply(cl, sid, 4, "login failed");
+            return;
+        }
+    }
+
+    if (!valid_env(term) || !valid_env(lang) || (cwd[0] && cwd[0] != '/')) {
+        login_err_reply(cl, sid, 5, "invalid options");
         return;
+    }
+
+    /* Opened here so a bad cwd fails the login instead of the program */
+    if (cmd && cwd[0]) {
+        cwd_fd = open(cwd, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cwd_fd < 0) {
+            uwsc_log_err("Open cwd '%s' failed: %s\n", cwd, strerror(errno));
+            login_err_reply(cl, sid, 6, "invalid cwd");
+            return;
+        }
+    }
+
+    s = rtty_calloc(RTTY_MEM_SESSION, 1, sizeof(struct tty_session));
+    if (!s) {
+        if (cwd_fd > -1)
+            close(cwd_fd);
+        return;
+    }
+
+    pid = forkpty(&pty, NULL, NULL, size.ws_col && size.ws_row ? &size : NULL);
+    if (pid == 0) {
+        if (term[0])
+            setenv("TERM", term, 1);
+
+        /* login(1) without -p drops LANG */
+        if (lang[0])
+            setenv("LANG", lang, 1);
+
+        if (cmd) {
+            if (cwd_fd > -1 && fchdir(cwd_fd) < 0) {
+                fprintf(stderr, "chdir %s: %s\r\n", cwd, strerror(errno));
+                exit(1);
+            }
+            execl("/bin/sh", "sh", "-c", cmd, NULL);
+
+            /* Never an interactive login instead of the program asked for */
+            fprintf(stderr, "exec %s: %s\r\n", cmd, strerror(errno));
+            exit(127);
+        }
 
-    pid = forkpty(&pty, NULL, NULL, NULL);
-    if (pid == 0)   
         username ? execl(login,"-p","-f", username , NULL) : execl(login, login, NULL);
-    
+        exit(1);
+    }
+
+    if (cwd_fd > -1)
+        close(cwd_fd);
+
     s->cl = cl;
     s->sid = sid;
     s->pid = pid;
     s->pty = pty;
     s->loop = cl->loop;
+    s->seq = json_get_bool(msg, "seq");
+    INIT_LIST_HEAD(&s->observers);
 
     fcntl(pty, F_SETFL, fcntl(pty, F_GETFL, 0) | O_NONBLOCK);
 
@@ -192,10 +574,15 @@ static void new_tty_session(struct uwsc_client *cl, int sid)
 
     buffer_set_persistent_size(&s->wb, RTTY_BUFFER_PERSISTENT_SIZE);
 
+    s->rec = record_open(sid, size.ws_col, size.ws_row);
+
+    s->hist = history_open(sid);
+
     sessions[sid] = s;
 
     /* Notifying the user that the session was successfully created */
-    snprintf(str, sizeof(str) - 1, "{\"type\":\"login\",\"sid\":%d,\"code\":0}", sid);
+    snprintf(str, sizeof(str) - 1, "{\"type\":\"login\",\"sid\":%d,\"code\":0%s}", sid,
+        s->seq ? ",\"seq\":true" : "");
     cl->send(cl, str, strlen(str), UWSC_OP_TEXT);
 
     uwsc_log_info("New session:%llu\n", sid);
@@ -216,21 +603,85 @@ static void change_winsize(int sid, int cols, int rows)
 
     if(ioctl(tty->pty, TIOCSWINSZ, &size) < 0)
         uwsc_log_err("ioctl TIOCSWINSZ error\n");
+
+    if (tty->rec)
+        record_resize(tty->rec, cols, rows);
+}
+
+/* Legacy frames of a "seq" session carry the seq right after the sid */
+static bool legacy_seq(int sid)
+{
+    struct tty_session *tty = find_tty_session(sid);
+
+    return tty && tty->seq;
+}
+
+static void migrate(struct uwsc_client *cl, const json_value *msg);
+
+static void send_stats(struct uwsc_client *cl)
+{
+    struct buffer b = {};
+
+    buffer_put_printf(&b, "{\"type\":\"stats\",");
+    ws_stats_put(&b);
+#ifdef RTTY_ALLOC_STATS
+    buffer_put_printf(&b, ",");
+    alloc_stats_put(&b);
+#endif
+    buffer_put_printf(&b, "}");
+
+    cl->send(cl, buffer_data(&b), buffer_length(&b), UWSC_OP_TEXT);
+    buffer_free(&b);
 }
 
 static void uwsc_onmessage(struct uwsc_client *cl, void *data, size_t len, bool binary)
 {
+    alloc_count_message();
+
     if (binary) {
-        int sid = (*(uint8_t *)data);
-        struct tty_session *tty = find_tty_session(sid);
+        struct tty_session *tty;
+        struct rtty_frame f;
+
+        if (proto_frame_parse(data, len, &f, legacy_seq) < 0) {
+            uwsc_log_err("Invalid frame\n");
+            return;
+        }
+
+        if (f.type == RTTY_FRAME_CHANNEL) {
+            bridge_deliver(f.sid, f.data, f.len);
+            return;
+        }
+
+        if (f.type != RTTY_FRAME_DATA)
+            return;
 
+        tty = find_tty_session(f.sid);
         if (!tty) {
-            uwsc_log_err("non-existent sid: %d\n", sid);
+            if (find_observer(f.sid)) {
+                uwsc_log_err("sid %d is read-only\n", f.sid);
+                return;
+            }
+            uwsc_log_err("non-existent sid: %d\n", f.sid);
             return;
         }
 
-        buffer_put_data(&tty->wb, data + 1, len - 1);
+        if (tty->seq) {
+            if (!(f.flags & RTTY_FRAME_FLAG_SEQ)) {
+                uwsc_log_err("Missing seq for sid %d\n", f.sid);
+                return;
+            }
+            seq_queued(tty, f.seq, f.len);
+        }
+
+        if (tty->rec)
+            record_event(tty->rec, RECORD_EV_INPUT, f.data, f.len);
+
+        ALLOC_HOT_BEGIN();
+
+        buffer_put_data(&tty->wb, f.data, f.len);
         ev_io_start(tty->loop, &tty->iow);
+
+        ALLOC_HOT_END("pty input");
         return;
     } else {
         const json_value *json;
@@ -251,28 +702,72 @@ static void uwsc_onmessage(struct uwsc_client *cl, void *data, size_t len, bool
 
         sid = json_get_int(json, "sid");
 
-        if (!strcmp(type, "register")) {
+        if (!strcmp(type, "hello")) {
+            proto_on_hello(json);
+        } else if (!strcmp(type, "register")) {
             uwsc_log_err("register failed: %s\n", json_get_string(json, "msg"));
             ev_break(cl->loop, EVBREAK_ALL);
         } else if (!strcmp(type, "login")) {
-            if (sid > RTTY_MAX_SESSIONS) {
-                char str[128] = "";
+            if (sid < 0) {
+                login_err_reply(cl, sid, 5, "invalid sid");
+                goto done;
+            }
+            if (sid > RTTY_MAX_SESSIONS || find_observer(sid)) {
                 /* Notifies the user that the session creation failed  */
-                snprintf(str, sizeof(str) - 1, "{\"type\":\"login\",\"sid\":%d,\"err\":2,\"msg\":\"sessions is full\"}", sid);
-                cl->send(cl, str, strlen(str), UWSC_OP_TEXT);
+                login_err_reply(cl, sid, 2, "sessions is full");
                 uwsc_log_err("Can only run up to 5 sessions at the same time\n");
                 goto done;
             }
-            new_tty_session(cl, sid);
-        } if (!strcmp(type, "logout")) {
+            new_tty_session(cl, sid, json);
+        } else if (!strcmp(type, "observe")) {
+            new_observer(cl, sid, json_get_int(json, "target"));
+        } else if (!strcmp(type, "ack")) {
+            observer_ack(cl, sid, json_get_int(json, "len"));
+        } else if (!strcmp(type, "logout")) {
             del_tty_session_by_sid(sid);
-        } if (!strcmp(type, "cmd")) {
+        } else if (!strcmp(type, "cmd")) {
             run_command(cl, json);
             return;
-        } if (!strcmp(type, "winsize")) {
+        } else if (!strcmp(type, "expect")) {
+            run_expect(cl, json);
+            return;
+        } else if (!strcmp(type, "peer")) {
+            peer_fetch(cl, json);
+            return;
+        } else if (!strcmp(type, "proc")) {
+            run_proc(cl, json);
+            return;
+        } else if (!strcmp(type, "profile")) {
+            run_profile(cl, json);
+            return;
+        } else if (!strcmp(type, "fetch")) {
+            run_fetch(cl, json);
+            return;
+        } else if (!strcmp(type, "manifest")) {
+            run_manifest(cl, json);
+            return;
+        } else if (!strcmp(type, "history")) {
+            run_history(cl, json);
+            return;
+        } else if (!strcmp(type, "ubus")) {
+            run_ubus(cl, json);
+            return;
+        } else if (!strcmp(type, "uci")) {
+            run_uci(cl, json);
+            return;
+        } else if (!strcmp(type, "migrate")) {
+            migrate(cl, json);
+        } else if (!strcmp(type, "stats")) {
+            send_stats(cl);
+        } else if (!strcmp(type, "probe")) {
+            tune_probe();
+            tune_report(cl);
+        } else if (!strcmp(type, "winsize")) {
             int cols = json_get_int(json, "cols");
             int rows = json_get_int(json, "rows");
             change_winsize(sid, cols, rows);
+        } else if (plugin_run(cl, type, json)) {
+            return;
         }
 
 done:
@@ -283,6 +778,20 @@ done:
 static void uwsc_onopen(struct uwsc_client *cl)
 {
     uwsc_log_info("Connect to server succeed\n");
+
+    current = cl;
+    proto_hello(cl);
+    tune_report(cl);
+    bridge_set_client(cl);
+}
+
+/* Jobs started on a closed connection reply over the current one */
+static int forward_send(struct uwsc_client *cl, const void *data, size_t len, int op)
+{
+    if (!current)
+        return -1;
+
+    return current->send(current, data, len, op);
 }
 
 static void uwsc_onerror(struct uwsc_client *cl, int err, const char *msg)
@@ -291,7 +800,13 @@ static void uwsc_onerror(struct uwsc_client *cl, int err, const char *msg)
 
     uwsc_log_err("onerror:%d: %s\n", err, msg);
 
-    free(cl);
+    current = NULL;
+    bulk_close();
+    proto_reset();
+    bridge_set_client(NULL);
+
+    cl->send = forward_send;
+    ws_free(cl);
 
 	if (auto_reconnect)
         ev_timer_again(loop, &reconnect_timer);
@@ -306,11 +821,17 @@ static void uwsc_onclose(struct uwsc_client *cl, int code, const char *reason)
 
     uwsc_log_err("onclose:%d: %s\n", code, reason);
 
+    current = NULL;
+    bulk_close();
+    proto_reset();
+    bridge_set_client(NULL);
+
     for (i = 0; i < RTTY_MAX_SESSIONS + 1; i++)
         if (sessions[i])
             del_tty_session(sessions[i]);
 
-    free(cl);
+    cl->send = forward_send;
+    ws_free(cl);
 
     if (auto_reconnect)
         ev_timer_again(loop, &reconnect_timer);
@@ -318,14 +839,154 @@ static void uwsc_onclose(struct uwsc_client *cl, int code, const char *reason)
         ev_break(loop, EVBREAK_ALL);
 }
 
+static void retired_onclose(struct uwsc_client *cl, int code, const char *reason)
+{
+    uwsc_log_info("Old connection closed: %d\n", code);
+
+    /* Jobs still holding it keep replying through forward_send */
+    ws_free(cl);
+}
+
+static void retired_onerror(struct uwsc_client *cl, int err, const char *msg)
+{
+    retired_onclose(cl, err, msg);
+}
+
+static void migrate_err_reply(struct uwsc_client *cl, const char *token, int err)
+{
+    struct buffer b = {};
+
+    buffer_put_printf(&b, "{\"type\":\"migrated\",\"token\":");
+    buffer_put_json_string(&b, token, strlen(token));
+    buffer_put_printf(&b, ",\"err\":%d,\"msg\":\"%s\"}", err, cmderr2str(err));
+    cl->send(cl, buffer_data(&b), buffer_length(&b), UWSC_OP_TEXT);
+    buffer_free(&b);
+}
+
+static void migrate_onerror(struct uwsc_client *cl, int err, const char *msg)
+{
+    uwsc_log_err("Migration failed:%d: %s\n", err, msg);
+
+    if (current)
+        migrate_err_reply(current, resume_token, RTTY_CMD_ERR_SYSERR);
+
+    ws_free(cl);
+    migrating = NULL;
+}
+
+static void migrate_onclose(struct uwsc_client *cl, int code, const char *reason)
+{
+    migrate_onerror(cl, code, reason);
+}
+
+/*
+ * The new connection is up: move the sessions over to it, then close the
+ * old one. Input the server still sends on the old connection is handled
+ * as usual until it's closed.
+ */
+static void migrate_onopen(struct uwsc_client *cl)
+{
+    struct uwsc_client *old = current;
+    struct buffer b = {};
+    int i, n = 0;
+
+    uwsc_log_info("Migrated to the new endpoint\n");
+
+    migrating = NULL;
+    ev_timer_stop(cl->loop, &reconnect_timer);
+
+    /* Reconnects after a later failure go to the new endpoint as well */
+    strcpy(server_url, migrating_url);
+    bulk_set_url(server_url);
+
+    cl->onmessage = uwsc_onmessage;
+    cl->onerror = uwsc_onerror;
+    cl->onclose = uwsc_onclose;
+
+    bulk_close();
+    proto_reset();
+    uwsc_onopen(cl);
+
+    buffer_put_printf(&b, "{\"type\":\"migrated\",\"token\":");
+    buffer_put_json_string(&b, resume_token, strlen(resume_token));
+    buffer_put_printf(&b, ",\"sids\":[");
+
+    for (i = 0; i < RTTY_MAX_SESSIONS + 1; i++) {
+        if (sessions[i]) {
+            sessions[i]->cl = cl;
+            buffer_put_printf(&b, "%s%d", n++ ? "," : "", i);
+        }
+    }
+
+    buffer_put_printf(&b, "]}");
+    cl->send(cl, buffer_data(&b), buffer_length(&b), UWSC_OP_TEXT);
+    buffer_free(&b);
+
+    if (!old)
+        return;
+
+    old->onclose = retired_onclose;
+    old->onerror = retired_onerror;
+    old->send = forward_send;
+    old->send_close(old, UWSC_CLOSE_STATUS_NORMAL, "migrated");
+}
+
+/* {"type":"migrate","host":"...","port":5912,"ssl":true,"token":"..."} */
+static void migrate(struct uwsc_client *cl, const json_value *msg)
+{
+    const char *host = json_get_string(msg, "host");
+    const char *token = json_get_string(msg, "token");
+    int port = json_get_int(msg, "port");
+    char enc[sizeof(resume_token) * 3];
+    char url[800];
+
+    if (migrating || !host[0] || port <= 0 || port > 65535 || strlen(token) >= sizeof(resume_token)) {
+        uwsc_log_err("Invalid or duplicate migrate request\n");
+        migrate_err_reply(cl, token, RTTY_CMD_ERR_INVALID);
+        return;
+    }
+
+    strcpy(resume_token, token);
+
+    /* Only taken over by migrate_onopen(), a failed attempt keeps the old endpoint */
+    snprintf(migrating_url, sizeof(migrating_url), "ws%s://%s:%d%s",
+        json_get_bool(msg, "ssl") ? "s" : "", host, port, url_path);
+
+    /* The token comes from the server as is and may need escaping in the query */
+    enc[urlencode(enc, sizeof(enc) - 1, token, strlen(token))] = '\0';
+    snprintf(url, sizeof(url), "%s&resume=%s", migrating_url, enc);
+
+    uwsc_log_info("Migrating to %s:%d\n", host, port);
+
+    migrating = ws_new(cl->loop, url, keepalive, extra_header);
+    if (!migrating) {
+        migrate_err_reply(cl, token, RTTY_CMD_ERR_SYSERR);
+        return;
+    }
+
+    migrating->onopen = migrate_onopen;
+    migrating->onmessage = uwsc_onmessage;
+    migrating->onerror = migrate_onerror;
+    migrating->onclose = migrate_onclose;
+    migrating->send = ws_send;
+}
+
 static void do_connect(struct ev_loop *loop, struct ev_timer *w, int revents)
 {
-    struct uwsc_client *cl = uwsc_new(loop, server_url, keepalive, extra_header);
+    struct uwsc_client *cl;
+
+    /* The old connection dropped while the new one is being set up */
+    if (migrating)
+        return;
+
+    cl = ws_new(loop, server_url, keepalive, extra_header);
     if (cl) {
+        ssl_pin_restore();
         cl->onopen = uwsc_onopen;
         cl->onmessage = uwsc_onmessage;
         cl->onerror = uwsc_onerror;
         cl->onclose = uwsc_onclose;
+        cl->send = ws_send;
         ev_timer_stop(cl->loop, &reconnect_timer);
         return;
     }
@@ -353,14 +1014,25 @@ static void usage(const char *prog)
         "      -v           # verbose\n"
         "      -d           # Adding a description to the device(Maximum 126 bytes)\n"
         "      -s           # SSL on\n"
+        "      -C ciphers   # TLS suites to offer with -s, fastest first(see rtty-tlsbench, OpenSSL only)\n"
         "      -k keepalive # keep alive in seconds for this client. Defaults to 5\n"
         "      -b baseurl   # Set a base url\n"
         "      -V           # Show version\n"
         "      -D           # Run in the background\n"
         "      -R           # Receive file\n"
-        "      -S file      # Send file\n"
+        "      -S file      # Send file, a named pipe or stdin(-)\n"
         "      -t token     # Authorization token\n"
         "      -f username  # Skip a second login authentication. See man login(1) about the details\n"
+        "      -l name=cmd  # Allow \"login\" to run cmd instead of login(1), may be repeated\n"
+        "      -r dir       # Record sessions into dir(asciicast v2)\n"
+        "      -z           # Compress the recordings(gzip)\n"
+        "      -H kb        # Keep up to kb of compressed output per session, searchable by the server\n"
+        "      -M dir       # Load plugins(*.so) from dir\n"
+        "      -B           # Use a second connection for bulk data(command results)\n"
+        "      -L path      # Let local agents publish over rtty's connection via a UNIX socket\n"
+        "      -P           # Share received files with other devices on the LAN(peer cache)\n"
+        "      -i ifname    # Interface the peer cache is shared on, may be repeated. Defaults to br-lan\n"
+        "      -T           # Benchmark the device at startup and tune buffer sizes to it\n"
         , prog);
     exit(1);
 }
@@ -378,8 +1050,19 @@ int main(int argc, char **argv)
     bool background = false;
     bool verbose = false;
     bool ssl = false;
-
-    while ((opt = getopt(argc, argv, "h:b:f:p:I:avd:sk:VDRS:t:")) != -1) {
+    const char *ciphers = NULL;
+    const char *record_dir = NULL;
+    bool record_compress = false;
+    int history_kb = 0;
+    const char *plugin_dir = NULL;
+    bool bulk_conn = false;
+    const char *bridge_path = NULL;
+    bool peer = false;
+    const char *peer_ifaces[RTTY_PEER_MAX_IFACES] = { RTTY_PEER_IFACE };
+    int npeer_ifaces = 0;
+    bool probe = false;
+
+    while ((opt = getopt(argc, argv, "h:b:f:p:I:avd:sk:VDRS:t:r:zH:M:BL:Pi:Tl:C:")) != -1) {
         switch (opt) {
         case 'h':
             host = optarg;
@@ -390,6 +1073,17 @@ int main(int argc, char **argv)
         case 'f':
             username = optarg;
             break;
+        case 'l': {
+            char *eq = strchr(optarg, '=');
+
+            if (!eq || eq == optarg || nprograms == RTTY_MAX_PROGRAMS)
+                usage(argv[0]);
+
+            *eq = 0;
+            programs[nprograms].name = optarg;
+            programs[nprograms++].cmd = eq + 1;
+            break;
+        }
         case 'p':
             port = atoi(optarg);
             break;
@@ -417,6 +1111,9 @@ int main(int argc, char **argv)
         case 's':
             ssl = true;
             break;
+        case 'C':
+            ciphers = optarg;
+            break;
         case 'k':
             keepalive = atoi(optarg);
             break;
@@ -436,6 +1133,37 @@ int main(int argc, char **argv)
         case 't':
             snprintf(extra_header, sizeof(extra_header) - 1, "Authorization: %s\r\n", optarg);
             break;
+        case 'r':
+            record_dir = optarg;
+            break;
+        case 'z':
+            record_compress = true;
+            break;
+        case 'H':
+            history_kb = atoi(optarg);
+            if (history_kb < 0)
+                usage(argv[0]);
+            break;
+        case 'M':
+            plugin_dir = optarg;
+            break;
+        case 'B':
+            bulk_conn = true;
+            break;
+        case 'L':
+            bridge_path = optarg;
+            break;
+        case 'P':
+            peer = true;
+            break;
+        case 'i':
+            if (npeer_ifaces == RTTY_PEER_MAX_IFACES)
+                usage(argv[0]);
+            peer_ifaces[npeer_ifaces++] = optarg;
+            break;
+        case 'T':
+            probe = true;
+            break;
         default: /* '?' */
             usage(argv[0]);
         }
@@ -475,12 +1203,43 @@ int main(int argc, char **argv)
         return -1;
     }
 
-    snprintf(server_url, sizeof(server_url),
-        "ws%s://%s:%d%s/ws?device=1&devid=%s&description=%s&keepalive=%d",
-        ssl ? "s" : "", host, port, baseurl ? baseurl : "", devid, description ? description : "", keepalive);
+    if (probe)
+        tune_probe();
+    else
+        tune_load();
+
+    if (record_dir && record_init(loop, record_dir, record_compress) < 0)
+        return -1;
+
+    history_init(history_kb * 1024);
+
+    if (plugin_dir && plugin_init(loop, plugin_dir) < 0)
+        return -1;
+
+    if (bridge_path && bridge_init(loop, bridge_path) < 0)
+        return -1;
+
+    if (peer && peer_init(loop, RTTY_PEER_PORT, peer_ifaces, npeer_ifaces ? npeer_ifaces : 1) < 0)
+        return -1;
+
+    if (ciphers) {
+        if (!ssl) {
+            uwsc_log_info("-C has no effect without -s\n");
+        } else if (ssl_pin_ciphers(ciphers) < 0) {
+            uwsc_log_err("Pin ciphers failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    snprintf(url_path, sizeof(url_path), "%s/ws?device=1&devid=%s&description=%s&keepalive=%d",
+        baseurl ? baseurl : "", devid, description ? description : "", keepalive);
+    snprintf(server_url, sizeof(server_url), "ws%s://%s:%d%s", ssl ? "s" : "", host, port, url_path);
 
     free(description);
 
+    if (bulk_conn)
+        bulk_init(server_url, keepalive, extra_header);
+
     ev_timer_init(&reconnect_timer, do_connect, 0.0, RTTY_RECONNECT_INTERVAL);
 	ev_timer_start(loop, &reconnect_timer);
 
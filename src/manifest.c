@@ -0,0 +1,661 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <uwsc/log.h>
+
+#include "manifest.h"
+#include "command.h"
+#include "sha256.h"
+#include "utils.h"
+#include "bulk.h"
+#include "wsframe.h"
+#include "profiler.h"
+
+struct mfile {
+    char *path;     /* Relative to the scanned directory */
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t ino;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    bool hashed;
+    bool failed;
+};
+
+struct mindex_entry {
+    struct mindex_entry *next;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t ino;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    char path[0];   /* Absolute */
+};
+
+struct manifest_job {
+    struct manifest_job *next;
+    struct uwsc_client *ws;
+    char token[33];
+    char root[PATH_MAX];
+    bool only_root;
+    int err;
+
+    struct mfile *files;
+    int nfiles;
+    int size;
+    int nhashed;
+    int next_hash;  /* Taken by the hash workers */
+    double elapsed;
+
+    struct buffer reply;
+};
+
+static struct mindex_entry **mindex;
+static int mindex_size;
+static int mindex_count;
+static bool mindex_loaded;
+static pthread_mutex_t mindex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct manifest_job *done_jobs;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ev_async done_watcher;
+static bool done_watcher_ready;
+
+static uint32_t path_hash(const char *path)
+{
+    uint32_t h = 2166136261u;
+
+    while (*path)
+        h = (h ^ (uint8_t)*path++) * 16777619u;
+
+    return h;
+}
+
+static struct mindex_entry *mindex_find(const char *path)
+{
+    struct mindex_entry *e;
+
+    if (!mindex_size)
+        return NULL;
+
+    for (e = mindex[path_hash(path) & (mindex_size - 1)]; e; e = e->next) {
+        if (!strcmp(e->path, path))
+            return e;
+    }
+
+    return NULL;
+}
+
+static void mindex_grow()
+{
+    int size = mindex_size ? mindex_size * 2 : 1024;
+    struct mindex_entry **tbl = calloc(size, sizeof(*tbl));
+    struct mindex_entry *e, *next;
+    int i;
+
+    if (!tbl)
+        return;
+
+    for (i = 0; i < mindex_size; i++) {
+        for (e = mindex[i]; e; e = next) {
+            uint32_t h = path_hash(e->path) & (size - 1);
+
+            next = e->next;
+            e->next = tbl[h];
+            tbl[h] = e;
+        }
+    }
+
+    free(mindex);
+    mindex = tbl;
+    mindex_size = size;
+}
+
+static void mindex_put(const char *path, uint64_t size, uint64_t mtime, uint64_t ino,
+    const uint8_t *digest)
+{
+    struct mindex_entry *e = mindex_find(path);
+
+    if (!e) {
+        if (mindex_count >= mindex_size / 2)
+            mindex_grow();
+
+        if (!mindex_size)
+            return;
+
+        e = malloc(sizeof(*e) + strlen(path) + 1);
+        if (!e)
+            return;
+
+        uint32_t h = path_hash(path) & (mindex_size - 1);
+
+        strcpy(e->path, path);
+        e->next = mindex[h];
+        mindex[h] = e;
+        mindex_count++;
+    }
+
+    e->size = size;
+    e->mtime = mtime;
+    e->ino = ino;
+    memcpy(e->digest, digest, SHA256_DIGEST_LENGTH);
+}
+
+static int cmp_mfile(const void *a, const void *b)
+{
+    return strcmp(((const struct mfile *)a)->path, ((const struct mfile *)b)->path);
+}
+
+/* Drop entries below root that were not seen by the scan that just finished */
+static void mindex_prune(const char *root, struct manifest_job *job)
+{
+    int rlen = strlen(root);
+    struct mindex_entry **pe, *e;
+    int i;
+
+    for (i = 0; i < mindex_size; i++) {
+        for (pe = &mindex[i]; (e = *pe); ) {
+            struct mfile key = { .path = e->path + rlen + 1 };
+
+            if (!strncmp(e->path, root, rlen) && e->path[rlen] == '/' &&
+                !bsearch(&key, job->files, job->nfiles, sizeof(key), cmp_mfile)) {
+                *pe = e->next;
+                free(e);
+                mindex_count--;
+            } else {
+                pe = &e->next;
+            }
+        }
+    }
+}
+
+static int hex2bin(const char *hex, uint8_t *bin, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        if (sscanf(hex + i * 2, "%2hhx", &bin[i]) != 1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void mindex_load()
+{
+    FILE *fp = fopen(RTTY_MANIFEST_INDEX, "r");
+    char line[PATH_MAX + 128];
+
+    mindex_loaded = true;
+
+    if (!fp)
+        return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long long size, mtime, ino;
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        char hex[65];
+        int pos;
+
+        line[strcspn(line, "\n")] = 0;
+
+        if (sscanf(line, "%64s %llu %llu %llu %n", hex, &size, &mtime, &ino, &pos) != 4)
+            continue;
+
+        if (hex2bin(hex, digest, sizeof(digest)) < 0 || line[pos] != '/')
+            continue;
+
+        mindex_put(line + pos, size, mtime, ino, digest);
+    }
+
+    fclose(fp);
+}
+
+static void mindex_save()
+{
+    char tmp[] = RTTY_MANIFEST_INDEX ".tmp";
+    struct mindex_entry *e;
+    char hex[65];
+    FILE *fp;
+    int i;
+
+    mkdir(RTTY_MANIFEST_DIR, 0700);
+
+    fp = fopen(tmp, "w");
+    if (!fp)
+        return;
+
+    for (i = 0; i < mindex_size; i++) {
+        for (e = mindex[i]; e; e = e->next) {
+            sha256_hex(e->digest, hex);
+            fprintf(fp, "%s %llu %llu %llu %s\n", hex, (unsigned long long)e->size,
+                (unsigned long long)e->mtime, (unsigned long long)e->ino, e->path);
+        }
+    }
+
+    if (fclose(fp) == 0)
+        rename(tmp, RTTY_MANIFEST_INDEX);
+    else
+        unlink(tmp);
+}
+
+static int add_file(struct manifest_job *job, const char *rel, struct stat *st)
+{
+    struct mfile *f;
+
+    if (job->nfiles == RTTY_MANIFEST_MAX_FILES)
+        return RTTY_CMD_ERR_RESP_TOOBIG;
+
+    if (job->nfiles == job->size) {
+        int size = job->size ? job->size * 2 : 256;
+
+        f = realloc(job->files, size * sizeof(*f));
+        if (!f)
+            return RTTY_CMD_ERR_NOMEM;
+
+        job->files = f;
+        job->size = size;
+    }
+
+    f = &job->files[job->nfiles];
+    memset(f, 0, sizeof(*f));
+
+    f->path = strdup(rel);
+    if (!f->path)
+        return RTTY_CMD_ERR_NOMEM;
+
+    f->size = st->st_size;
+    f->mtime = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+    f->ino = st->st_ino;
+    job->nfiles++;
+
+    return 0;
+}
+
+/* Symlinks are not followed; special files are skipped */
+static int walk(struct manifest_job *job, char *path, int plen)
+{
+    int rlen = strlen(job->root);
+    struct dirent *de;
+    struct stat st;
+    int err = 0;
+    DIR *dir;
+
+    dir = opendir(plen ? path : "/");
+    if (!dir)
+        return 0;
+
+    while (!err && (de = readdir(dir))) {
+        int len;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        len = snprintf(path + plen, PATH_MAX - plen, "/%s", de->d_name);
+        if (len >= PATH_MAX - plen)
+            continue;
+
+        if (lstat(path, &st) < 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode))
+            err = walk(job, path, plen + len);
+        else if (S_ISREG(st.st_mode))
+            err = add_file(job, path + rlen + 1, &st);
+    }
+
+    path[plen] = 0;
+    closedir(dir);
+
+    return err;
+}
+
+/* Paths were built within PATH_MAX by walk() */
+static void full_path(struct manifest_job *job, struct mfile *f, char *path)
+{
+    if (snprintf(path, PATH_MAX, "%s/%s", job->root, f->path) >= PATH_MAX)
+        path[0] = 0;
+}
+
+static void *hash_worker(void *arg)
+{
+    struct manifest_job *job = arg;
+    char path[PATH_MAX];
+    int i;
+
+    profiler_thread_init();
+
+    while ((i = __sync_fetch_and_add(&job->next_hash, 1)) < job->nfiles) {
+        struct mfile *f = &job->files[i];
+
+        if (f->hashed)
+            continue;
+
+        full_path(job, f, path);
+        if (sha256_file(path, f->digest) < 0)
+            f->failed = true;
+        else
+            __sync_fetch_and_add(&job->nhashed, 1);
+    }
+
+    return NULL;
+}
+
+/*
+ * Hash the directory whose entries are files[lo, hi), all sharing the
+ * first plen bytes of their path. Files that couldn't be read are left
+ * out, and so is a subdirectory with nothing else in it. Returns the
+ * number of entries hashed.
+ */
+static int merkle(struct mfile *files, int lo, int hi, int plen, uint8_t *digest)
+{
+    struct sha256_ctx ctx;
+    char hex[65];
+    int i = lo, n = 0;
+
+    sha256_init(&ctx);
+
+    while (i < hi) {
+        const char *name = files[i].path + plen;
+        const char *slash = strchr(name, '/');
+
+        if (slash) {
+            uint8_t sub[SHA256_DIGEST_LENGTH];
+            int nlen = slash - name + 1;
+            int j = i + 1;
+
+            while (j < hi && !strncmp(files[j].path + plen, name, nlen))
+                j++;
+
+            if (!merkle(files, i, j, plen + nlen, sub)) {
+                i = j;
+                continue;
+            }
+
+            sha256_hex(sub, hex);
+            sha256_update(&ctx, hex, 64);
+            sha256_update(&ctx, "  ", 2);
+            sha256_update(&ctx, name, nlen);
+            i = j;
+        } else if (files[i].failed) {
+            i++;
+            continue;
+        } else {
+            sha256_hex(files[i].digest, hex);
+            sha256_update(&ctx, hex, 64);
+            sha256_update(&ctx, "  ", 2);
+            sha256_update(&ctx, name, strlen(name));
+            i++;
+        }
+
+        sha256_update(&ctx, "\n", 1);
+        n++;
+    }
+
+    sha256_final(&ctx, digest);
+
+    return n;
+}
+
+static void build_reply(struct manifest_job *job)
+{
+    struct buffer *b = &job->reply;
+    uint8_t root[SHA256_DIGEST_LENGTH];
+    char hex[65];
+    int i;
+
+    merkle(job->files, 0, job->nfiles, 0, root);
+    sha256_hex(root, hex);
+
+    buffer_put_printf(b, "{\"type\":\"manifest\",\"token\":\"%s\",\"attrs\":{\"root\":\"%s\","
+        "\"count\":%d,\"hashed\":%d,\"elapsed\":%.3f", job->token, hex, job->nfiles, job->nhashed,
+        job->elapsed);
+
+    if (!job->only_root) {
+        buffer_put_printf(b, ",\"files\":[");
+
+        for (i = 0; i < job->nfiles; i++) {
+            struct mfile *f = &job->files[i];
+
+            buffer_put_printf(b, "%s{\"path\":", i ? "," : "");
+            buffer_put_json_string(b, f->path, strlen(f->path));
+            buffer_put_printf(b, ",\"size\":%llu", (unsigned long long)f->size);
+
+            if (f->failed) {
+                buffer_put_printf(b, ",\"err\":%d,\"msg\":\"%s\"}", RTTY_CMD_ERR_SYSERR,
+                    cmderr2str(RTTY_CMD_ERR_SYSERR));
+            } else {
+                sha256_hex(f->digest, hex);
+                buffer_put_printf(b, ",\"sha256\":\"%s\"}", hex);
+            }
+        }
+
+        buffer_put_printf(b, "]");
+    }
+
+    buffer_put_printf(b, "}}");
+}
+
+static int scan(struct manifest_job *job)
+{
+    pthread_t workers[RTTY_MANIFEST_MAX_THREADS];
+    int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    char path[PATH_MAX];
+    int i, err, n = 0;
+
+    strcpy(path, job->root);
+
+    err = walk(job, path, strlen(path));
+    if (err)
+        return err;
+
+    qsort(job->files, job->nfiles, sizeof(struct mfile), cmp_mfile);
+
+    pthread_mutex_lock(&mindex_lock);
+
+    if (!mindex_loaded)
+        mindex_load();
+
+    for (i = 0; i < job->nfiles; i++) {
+        struct mfile *f = &job->files[i];
+        struct mindex_entry *e;
+
+        full_path(job, f, path);
+
+        e = mindex_find(path);
+        if (e && e->size == f->size && e->mtime == f->mtime && e->ino == f->ino) {
+            memcpy(f->digest, e->digest, SHA256_DIGEST_LENGTH);
+            f->hashed = true;
+        }
+    }
+
+    pthread_mutex_unlock(&mindex_lock);
+
+    if (nworkers > RTTY_MANIFEST_MAX_THREADS)
+        nworkers = RTTY_MANIFEST_MAX_THREADS;
+
+    for (i = 1; i < nworkers; i++) {
+        if (pthread_create(&workers[n], NULL, hash_worker, job))
+            break;
+        n++;
+    }
+
+    hash_worker(job);
+
+    for (i = 0; i < n; i++)
+        pthread_join(workers[i], NULL);
+
+    pthread_mutex_lock(&mindex_lock);
+
+    for (i = 0; i < job->nfiles; i++) {
+        struct mfile *f = &job->files[i];
+
+        if (f->failed)
+            continue;
+
+        full_path(job, f, path);
+        mindex_put(path, f->size, f->mtime, f->ino, f->digest);
+    }
+
+    mindex_prune(job->root, job);
+    mindex_save();
+
+    pthread_mutex_unlock(&mindex_lock);
+
+    return 0;
+}
+
+static void *manifest_thread(void *arg)
+{
+    struct manifest_job *job = arg;
+    struct timespec start, end;
+
+    profiler_thread_init();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    job->err = scan(job);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    job->elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (!job->err)
+        build_reply(job);
+
+    pthread_mutex_lock(&done_lock);
+    job->next = done_jobs;
+    done_jobs = job;
+    pthread_mutex_unlock(&done_lock);
+
+    ev_async_send(job->ws->loop, &done_watcher);
+
+    return NULL;
+}
+
+static void manifest_err_reply(struct uwsc_client *ws, const char *token, int err)
+{
+    char str[256] = "";
+
+    snprintf(str, sizeof(str) - 1, "{\"type\":\"manifest\",\"token\":\"%s\",\"attrs\":{\"err\":%d,\"msg\":\"%s\"}}",
+        token, err, cmderr2str(err));
+    ws->send(ws, str, strlen(str), UWSC_OP_TEXT);
+}
+
+static void free_job(struct manifest_job *job)
+{
+    int i;
+
+    for (i = 0; i < job->nfiles; i++)
+        free(job->files[i].path);
+
+    free(job->files);
+    buffer_free(&job->reply);
+    ws_put(job->ws);
+    free(job);
+}
+
+static void done_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+    struct manifest_job *job, *next;
+
+    pthread_mutex_lock(&done_lock);
+    job = done_jobs;
+    done_jobs = NULL;
+    pthread_mutex_unlock(&done_lock);
+
+    for (; job; job = next) {
+        next = job->next;
+
+        if (job->err)
+            manifest_err_reply(job->ws, job->token, job->err);
+        else
+            bulk_send(job->ws, buffer_data(&job->reply), buffer_length(&job->reply), UWSC_OP_TEXT);
+
+        free_job(job);
+    }
+}
+
+void run_manifest(struct uwsc_client *ws, const json_value *msg)
+{
+    const json_value *attrs = json_get_value(msg, "attrs");
+    const char *username = json_get_string(attrs, "username");
+    const char *password = json_get_string(attrs, "password");
+    const char *token = json_get_string(msg, "token");
+    struct manifest_job *job = NULL;
+    pthread_t tid;
+    int err;
+
+    if (!username[0] || !login_test(username, password)) {
+        err = RTTY_CMD_ERR_PERMIT;
+        goto err;
+    }
+
+    job = calloc(1, sizeof(*job));
+    if (!job) {
+        err = RTTY_CMD_ERR_NOMEM;
+        goto err;
+    }
+
+    if (!realpath(json_get_string(attrs, "path"), job->root)) {
+        err = errno == ENOENT ? RTTY_CMD_ERR_NOT_FOUND : RTTY_CMD_ERR_INVALID;
+        goto err;
+    }
+
+    /* Keep the root without a trailing slash so relative paths start right after it */
+    if (!strcmp(job->root, "/"))
+        job->root[0] = 0;
+
+    job->ws = ws;
+    job->only_root = json_get_bool(attrs, "root");
+    strncpy(job->token, token, sizeof(job->token) - 1);
+
+    if (!done_watcher_ready) {
+        ev_async_init(&done_watcher, done_cb);
+        ev_async_start(ws->loop, &done_watcher);
+        done_watcher_ready = true;
+    }
+
+    if (pthread_create(&tid, NULL, manifest_thread, job)) {
+        err = RTTY_CMD_ERR_SYSERR;
+        goto err;
+    }
+
+    pthread_detach(tid);
+    ws_hold(ws);
+    json_value_free((json_value *)msg);
+    return;
+
+err:
+    free(job);
+    manifest_err_reply(ws, token, err);
+    json_value_free((json_value *)msg);
+}
@@ -0,0 +1,47 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _MANIFEST_H
+#define _MANIFEST_H
+
+#include <uwsc/uwsc.h>
+
+#include "json.h"
+
+#define RTTY_MANIFEST_DIR           "/var/cache/rtty-manifest"    /* Not the peer cache's */
+#define RTTY_MANIFEST_INDEX         RTTY_MANIFEST_DIR "/manifest.idx"
+#define RTTY_MANIFEST_MAX_THREADS   4
+#define RTTY_MANIFEST_MAX_FILES     100000
+
+/*
+ * Hash every regular file below attrs.path and reply with the per-file
+ * sha256 and a Merkle root, or only the root if attrs.root is true. The
+ * hash of a directory is the sha256 of its "hash  name\n" lines in
+ * sorted order(subdirectories named "name/"), so the root of a subtree
+ * can be compared on its own. Files whose path, size, mtime and inode
+ * are unchanged since the last scan are not read again.
+ */
+void run_manifest(struct uwsc_client *ws, const json_value *msg);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Masking throughput of the scalar loop versus ws_mask for typical
+ * payload sizes: rtty-maskbench [total MB]
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wsframe.h"
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(void (*mask)(uint8_t *, const uint8_t *, size_t, const uint8_t *),
+    uint8_t *dst, const uint8_t *src, size_t len, size_t total)
+{
+    static const uint8_t key[4] = {0x12, 0x34, 0x56, 0x78};
+    size_t done = 0;
+    double start = now();
+
+    while (done < total) {
+        mask(dst, src, len, key);
+        done += len;
+    }
+
+    return total / (now() - start) / (1024 * 1024);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = {64, 1500, 4096, 8912, 65536};
+    size_t total = (argc > 1 ? atoi(argv[1]) : 256) * 1024 * 1024;
+    uint8_t *src = malloc(65536 + 1);
+    uint8_t *dst = malloc(65536 + 1);
+    uint8_t *ref = malloc(65536 + 1);
+    int i;
+
+    if (!src || !dst || !ref)
+        return 1;
+
+    for (i = 0; i < 65536 + 1; i++)
+        src[i] = rand();
+
+    printf("%8s %14s %14s\n", "size", "scalar MB/s", "ws_mask MB/s");
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t len = sizes[i];
+        double scalar, fast;
+
+        /* Odd offset: payloads follow a 2..10 byte header plus the key */
+        scalar = run(ws_mask_scalar, ref + 1, src + 1, len, total);
+        fast = run(ws_mask, dst + 1, src + 1, len, total);
+
+        if (memcmp(ref + 1, dst + 1, len)) {
+            printf("mismatch at size %zu\n", len);
+            return 1;
+        }
+
+        printf("%8zu %14.0f %14.0f\n", len, scalar, fast);
+    }
+
+    return 0;
+}
@@ -0,0 +1,360 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uwsc/log.h>
+
+#include "config.h"
+#include "command.h"
+#include "openwrt.h"
+#include "utils.h"
+#include "bulk.h"
+#include "wsframe.h"
+
+#ifdef HAVE_UBUS
+
+#include <pthread.h>
+
+#include "list.h"
+#include "openwrt_call.h"
+#include "profiler.h"
+
+enum {
+    OP_UBUS,
+    OP_UCI
+};
+
+struct openwrt_job {
+    struct list_head list;
+    struct uwsc_client *ws;
+    const json_value *msg;
+    int op;
+    int err;
+    struct buffer reply;    /* Inside attrs */
+};
+
+static LIST_HEAD(pending);
+static LIST_HEAD(done);
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct ev_async done_watcher;
+static bool started;
+
+/* openwrt_call.c can't see json.h, params are handed over as JSON text */
+static void put_json_value(struct buffer *b, const json_value *v)
+{
+    unsigned int i;
+
+    switch (v->type) {
+    case json_object:
+        buffer_put_printf(b, "{");
+        for (i = 0; i < v->u.object.length; i++) {
+            buffer_put_printf(b, "%s", i ? "," : "");
+            buffer_put_json_string(b, v->u.object.values[i].name, v->u.object.values[i].name_length);
+            buffer_put_printf(b, ":");
+            put_json_value(b, v->u.object.values[i].value);
+        }
+        buffer_put_printf(b, "}");
+        break;
+    case json_array:
+        buffer_put_printf(b, "[");
+        for (i = 0; i < v->u.array.length; i++) {
+            buffer_put_printf(b, "%s", i ? "," : "");
+            put_json_value(b, v->u.array.values[i]);
+        }
+        buffer_put_printf(b, "]");
+        break;
+    case json_integer:
+        buffer_put_printf(b, "%lld", (long long)v->u.integer);
+        break;
+    case json_double:
+        buffer_put_printf(b, "%.17g", v->u.dbl);
+        break;
+    case json_string:
+        buffer_put_json_string(b, v->u.string.ptr, v->u.string.length);
+        break;
+    case json_boolean:
+        buffer_put_printf(b, "%s", v->u.boolean ? "true" : "false");
+        break;
+    default:
+        buffer_put_printf(b, "null");
+        break;
+    }
+}
+
+static int map_err(int err)
+{
+    switch (err) {
+    case 0:
+        return 0;
+    case OPENWRT_ERR_NOT_FOUND:
+        return RTTY_CMD_ERR_NOT_FOUND;
+    case OPENWRT_ERR_NOMEM:
+        return RTTY_CMD_ERR_NOMEM;
+    case OPENWRT_ERR_TIMEOUT:
+        return RTTY_CMD_ERR_TIMEOUT;
+    case OPENWRT_ERR_INVALID:
+        return RTTY_CMD_ERR_INVALID;
+    default:
+        return RTTY_CMD_ERR_SYSERR;
+    }
+}
+
+static int do_ubus(struct openwrt_job *job)
+{
+    const json_value *attrs = json_get_value(job->msg, "attrs");
+    const json_value *params = json_get_value(attrs, "params");
+    const char *path = json_get_string(attrs, "path");
+    const char *method = json_get_string(attrs, "method");
+    int timeout = json_get_int(attrs, "timeout");
+    struct buffer b = {};
+    int err;
+
+    if (!path[0] || !method[0] || (params && params->type != json_object))
+        return RTTY_CMD_ERR_INVALID;
+
+    if (timeout <= 0 || timeout > RTTY_UBUS_MAX_TIMEOUT / 1000)
+        timeout = RTTY_UBUS_TIMEOUT;
+    else
+        timeout *= 1000;
+
+    if (params) {
+        put_json_value(&b, params);
+        buffer_put_u8(&b, 0);
+    }
+
+    err = openwrt_ubus_call(path, method, params ? buffer_data(&b) : NULL, timeout, &job->reply);
+
+    buffer_free(&b);
+
+    return map_err(err);
+}
+
+static int do_uci(struct openwrt_job *job)
+{
+    const json_value *attrs = json_get_value(job->msg, "attrs");
+    const json_value *value = json_get_value(attrs, "value");
+    const char *values[RTTY_UCI_MAX_VALUES];
+    struct openwrt_uci_req req = {
+        .op = json_get_string(attrs, "op"),
+        .config = json_get_string(attrs, "config"),
+        .section = json_get_string(attrs, "section"),
+        .option = json_get_string(attrs, "option"),
+        .values = values
+    };
+    unsigned int i;
+
+    if (!req.config[0] || strchr(req.config, '/'))
+        return RTTY_CMD_ERR_INVALID;
+
+    if (!req.section[0])
+        req.section = NULL;
+    if (!req.option[0])
+        req.option = NULL;
+
+    if (!value) {
+        /* get, delete and commit */
+    } else if (value->type == json_string) {
+        values[req.nvalues++] = value->u.string.ptr;
+    } else if (value->type == json_array) {
+        if (value->u.array.length > RTTY_UCI_MAX_VALUES)
+            return RTTY_CMD_ERR_INVALID;
+
+        for (i = 0; i < value->u.array.length; i++) {
+            if (value->u.array.values[i]->type != json_string)
+                return RTTY_CMD_ERR_INVALID;
+            values[req.nvalues++] = value->u.array.values[i]->u.string.ptr;
+        }
+
+        req.list = true;
+    } else {
+        return RTTY_CMD_ERR_INVALID;
+    }
+
+    return map_err(openwrt_uci(&req, &job->reply));
+}
+
+static void *openwrt_worker(void *arg)
+{
+    struct ev_loop *loop = arg;
+    struct openwrt_job *job;
+
+    profiler_thread_init();
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (list_empty(&pending))
+            pthread_cond_wait(&cond, &lock);
+        job = list_first_entry(&pending, struct openwrt_job, list);
+        list_del(&job->list);
+        pthread_mutex_unlock(&lock);
+
+        job->err = job->op == OP_UBUS ? do_ubus(job) : do_uci(job);
+
+        pthread_mutex_lock(&lock);
+        list_add_tail(&job->list, &done);
+        pthread_mutex_unlock(&lock);
+
+        ev_async_send(loop, &done_watcher);
+    }
+
+    return NULL;
+}
+
+static void openwrt_reply(struct uwsc_client *ws, const json_value *msg, int err, struct buffer *data)
+{
+    const char *token = json_get_string(msg, "token");
+    const char *type = json_get_string(msg, "type");
+    struct buffer b = {};
+
+    buffer_put_printf(&b, "{\"type\":\"%s\",\"token\":", type);
+    buffer_put_json_string(&b, token, strlen(token));
+    buffer_put_printf(&b, ",\"attrs\":{");
+
+    if (err)
+        buffer_put_printf(&b, "\"err\":%d,\"msg\":\"%s\"", err, cmderr2str(err));
+    else if (data)
+        buffer_put_data(&b, buffer_data(data), buffer_length(data));
+
+    buffer_put_printf(&b, "}}");
+
+    bulk_send(ws, buffer_data(&b), buffer_length(&b), UWSC_OP_TEXT);
+    buffer_free(&b);
+}
+
+static void done_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+    struct openwrt_job *job, *tmp;
+    LIST_HEAD(jobs);
+
+    pthread_mutex_lock(&lock);
+    list_splice_init(&done, &jobs);
+    pthread_mutex_unlock(&lock);
+
+    list_for_each_entry_safe(job, tmp, &jobs, list) {
+        openwrt_reply(job->ws, job->msg, job->err, &job->reply);
+        buffer_free(&job->reply);
+        json_value_free((json_value *)job->msg);
+        ws_put(job->ws);
+        free(job);
+    }
+}
+
+static int start_worker(struct ev_loop *loop)
+{
+    pthread_t tid;
+
+    if (started)
+        return 0;
+
+    if (pthread_create(&tid, NULL, openwrt_worker, loop))
+        return -1;
+    pthread_detach(tid);
+
+    ev_async_init(&done_watcher, done_cb);
+    ev_async_start(loop, &done_watcher);
+
+    started = true;
+
+    return 0;
+}
+
+static void queue_job(struct uwsc_client *ws, const json_value *msg, int op)
+{
+    const json_value *attrs = json_get_value(msg, "attrs");
+    const char *username = json_get_string(attrs, "username");
+    const char *password = json_get_string(attrs, "password");
+    struct openwrt_job *job;
+    int err;
+
+    if (!username[0] || !login_test(username, password)) {
+        err = RTTY_CMD_ERR_PERMIT;
+        goto err;
+    }
+
+    if (start_worker(ws->loop) < 0) {
+        err = RTTY_CMD_ERR_SYSERR;
+        goto err;
+    }
+
+    job = calloc(1, sizeof(struct openwrt_job));
+    if (!job) {
+        err = RTTY_CMD_ERR_NOMEM;
+        goto err;
+    }
+
+    job->ws = ws;
+    job->msg = msg;
+    job->op = op;
+    ws_hold(ws);
+
+    pthread_mutex_lock(&lock);
+    list_add_tail(&job->list, &pending);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+
+    return;
+
+err:
+    openwrt_reply(ws, msg, err, NULL);
+    json_value_free((json_value *)msg);
+}
+
+void run_ubus(struct uwsc_client *ws, const json_value *msg)
+{
+    queue_job(ws, msg, OP_UBUS);
+}
+
+void run_uci(struct uwsc_client *ws, const json_value *msg)
+{
+    queue_job(ws, msg, OP_UCI);
+}
+
+#else
+
+static void not_supported(struct uwsc_client *ws, const json_value *msg)
+{
+    char str[256] = "";
+
+    snprintf(str, sizeof(str) - 1, "{\"type\":\"%s\",\"token\":\"%s\","
+        "\"attrs\":{\"err\":%d,\"msg\":\"%s\"}}", json_get_string(msg, "type"), json_get_string(msg, "token"),
+        RTTY_CMD_ERR_NOT_SUPPORTED, cmderr2str(RTTY_CMD_ERR_NOT_SUPPORTED));
+    ws->send(ws, str, strlen(str), UWSC_OP_TEXT);
+
+    json_value_free((json_value *)msg);
+}
+
+void run_ubus(struct uwsc_client *ws, const json_value *msg)
+{
+    not_supported(ws, msg);
+}
+
+void run_uci(struct uwsc_client *ws, const json_value *msg)
+{
+    not_supported(ws, msg);
+}
+
+#endif
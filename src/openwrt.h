@@ -0,0 +1,45 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _OPENWRT_H
+#define _OPENWRT_H
+
+#include <uwsc/uwsc.h>
+
+#include "json.h"
+
+#define RTTY_UBUS_TIMEOUT       5000    /* ms, default of a ubus call */
+#define RTTY_UBUS_MAX_TIMEOUT   60000
+#define RTTY_UCI_MAX_VALUES     64      /* Of a list */
+
+/*
+ * ubus calls and uci lookups done by rtty itself instead of running
+ * "ubus call" or "uci" through "cmd". Both contexts are kept open on a
+ * worker thread, where the requests run one at a time.
+ */
+void run_ubus(struct uwsc_client *ws, const json_value *msg);
+
+void run_uci(struct uwsc_client *ws, const json_value *msg);
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uwsc/log.h>
+
+#include "config.h"
+#include "utils.h"
+#include "openwrt_call.h"
+
+#ifdef HAVE_UBUS
+
+#include <uci.h>
+#include <libubus.h>
+#include <libubox/blobmsg_json.h>
+
+#define OPENWRT_MAX_REPLY   (1024 * 1024)
+
+static struct ubus_context *ubus_ctx;
+static struct uci_context *uci_ctx;
+
+static void ubus_data_cb(struct ubus_request *req, int type, struct blob_attr *msg)
+{
+    struct buffer *data = req->priv;
+    char *str;
+
+    if (!msg)
+        return;
+
+    str = blobmsg_format_json(msg, true);
+    if (!str)
+        return;
+
+    /* Only the last reply is kept, "ubus call" prints a method's replies one after another */
+    buffer_free(data);
+    if (strlen(str) < OPENWRT_MAX_REPLY)
+        buffer_put_printf(data, ",\"data\":%s", str);
+    free(str);
+}
+
+int openwrt_ubus_call(const char *path, const char *method, const char *params, int timeout,
+    struct buffer *reply)
+{
+    struct blob_buf b = {};
+    struct buffer data = {};
+    uint32_t id;
+    int ret;
+
+    /* Reconnect if ubusd was restarted */
+    if (ubus_ctx && ubus_ctx->sock.eof) {
+        ubus_free(ubus_ctx);
+        ubus_ctx = NULL;
+    }
+
+    if (!ubus_ctx) {
+        ubus_ctx = ubus_connect(NULL);
+        if (!ubus_ctx) {
+            uwsc_log_err("Connect to ubus failed\n");
+            return OPENWRT_ERR_SYSERR;
+        }
+    }
+
+    if (ubus_lookup_id(ubus_ctx, path, &id))
+        return OPENWRT_ERR_NOT_FOUND;
+
+    blob_buf_init(&b, 0);
+
+    if (params && !blobmsg_add_json_from_string(&b, params)) {
+        blob_buf_free(&b);
+        return OPENWRT_ERR_INVALID;
+    }
+
+    ret = ubus_invoke(ubus_ctx, id, method, b.head, ubus_data_cb, &data, timeout);
+    blob_buf_free(&b);
+
+    if (ret == UBUS_STATUS_TIMEOUT || ret == UBUS_STATUS_CONNECTION_FAILED) {
+        buffer_free(&data);
+        return ret == UBUS_STATUS_TIMEOUT ? OPENWRT_ERR_TIMEOUT : OPENWRT_ERR_SYSERR;
+    }
+
+    /* The status of the method goes back like the exit code of "cmd" */
+    buffer_put_printf(reply, "\"code\":%d,\"msg\":\"%s\"", ret, ubus_strerror(ret));
+    if (buffer_length(&data) > 0)
+        buffer_put_data(reply, buffer_data(&data), buffer_length(&data));
+
+    buffer_free(&data);
+
+    return 0;
+}
+
+static void put_uci_option(struct buffer *b, struct uci_option *o)
+{
+    struct uci_element *e;
+    bool first = true;
+
+    if (o->type == UCI_TYPE_STRING) {
+        buffer_put_json_string(b, o->v.string, strlen(o->v.string));
+        return;
+    }
+
+    buffer_put_printf(b, "[");
+    uci_foreach_element(&o->v.list, e) {
+        buffer_put_printf(b, "%s", first ? "" : ",");
+        buffer_put_json_string(b, e->name, strlen(e->name));
+        first = false;
+    }
+    buffer_put_printf(b, "]");
+}
+
+/* Like "ubus call uci get": options plus .type, .name and .anonymous */
+static void put_uci_section(struct buffer *b, struct uci_section *s)
+{
+    struct uci_element *e;
+
+    buffer_put_printf(b, "{\".anonymous\":%s,\".type\":", s->anonymous ? "true" : "false");
+    buffer_put_json_string(b, s->type, strlen(s->type));
+    buffer_put_printf(b, ",\".name\":");
+    buffer_put_json_string(b, s->e.name, strlen(s->e.name));
+
+    uci_foreach_element(&s->options, e) {
+        buffer_put_printf(b, ",");
+        buffer_put_json_string(b, e->name, strlen(e->name));
+        buffer_put_printf(b, ":");
+        put_uci_option(b, uci_to_option(e));
+    }
+
+    buffer_put_printf(b, "}");
+}
+
+static int uci_get(struct uci_ptr *ptr, struct buffer *b)
+{
+    struct uci_element *e;
+    bool first = true;
+
+    if (!(ptr->flags & UCI_LOOKUP_COMPLETE))
+        return OPENWRT_ERR_NOT_FOUND;
+
+    buffer_put_printf(b, "\"values\":");
+
+    switch (ptr->last->type) {
+    case UCI_TYPE_OPTION:
+        put_uci_option(b, ptr->o);
+        break;
+    case UCI_TYPE_SECTION:
+        put_uci_section(b, ptr->s);
+        break;
+    case UCI_TYPE_PACKAGE:
+        buffer_put_printf(b, "{");
+        uci_foreach_element(&ptr->p->sections, e) {
+            buffer_put_printf(b, "%s", first ? "" : ",");
+            buffer_put_json_string(b, e->name, strlen(e->name));
+            buffer_put_printf(b, ":");
+            put_uci_section(b, uci_to_section(e));
+            first = false;
+        }
+        buffer_put_printf(b, "}");
+        break;
+    default:
+        return OPENWRT_ERR_NOT_FOUND;
+    }
+
+    return 0;
+}
+
+/* A string sets an option, a list replaces a list option, no option adds the section of type value */
+static int uci_set_value(const struct openwrt_uci_req *req, struct uci_ptr *ptr)
+{
+    int i;
+
+    if (!ptr->section || req->nvalues < 1)
+        return UCI_ERR_INVAL;
+
+    if (!req->list) {
+        ptr->value = req->values[0];
+        return uci_set(uci_ctx, ptr);
+    }
+
+    if (!ptr->option)
+        return UCI_ERR_INVAL;
+
+    if ((ptr->flags & UCI_LOOKUP_COMPLETE) && uci_delete(uci_ctx, ptr))
+        return UCI_ERR_INVAL;
+
+    for (i = 0; i < req->nvalues; i++) {
+        ptr->value = req->values[i];
+        if (uci_add_list(uci_ctx, ptr))
+            return UCI_ERR_INVAL;
+    }
+
+    return 0;
+}
+
+int openwrt_uci(const struct openwrt_uci_req *req, struct buffer *reply)
+{
+    struct uci_ptr ptr = {
+        .package = req->config,
+        .section = req->section,
+        .option = req->option
+    };
+    int ret, err = 0;
+
+    if (!uci_ctx) {
+        uci_ctx = uci_alloc_context();
+        if (!uci_ctx)
+            return OPENWRT_ERR_NOMEM;
+    }
+
+    if (uci_lookup_ptr(uci_ctx, &ptr, NULL, false) || !ptr.p)
+        return OPENWRT_ERR_NOT_FOUND;
+
+    if (!strcmp(req->op, "get")) {
+        err = uci_get(&ptr, reply);
+    } else if (!strcmp(req->op, "set")) {
+        /* Saved to the delta directory like "uci set", "commit" applies it */
+        ret = uci_set_value(req, &ptr);
+        if (!ret)
+            ret = uci_save(uci_ctx, ptr.p);
+        err = ret == UCI_ERR_INVAL ? OPENWRT_ERR_INVALID : ret ? OPENWRT_ERR_SYSERR : 0;
+    } else if (!strcmp(req->op, "delete")) {
+        if (!(ptr.flags & UCI_LOOKUP_COMPLETE) || !ptr.section)
+            err = OPENWRT_ERR_NOT_FOUND;
+        else if (uci_delete(uci_ctx, &ptr) || uci_save(uci_ctx, ptr.p))
+            err = OPENWRT_ERR_SYSERR;
+    } else if (!strcmp(req->op, "commit")) {
+        if (uci_commit(uci_ctx, &ptr.p, false))
+            err = OPENWRT_ERR_SYSERR;
+    } else {
+        err = OPENWRT_ERR_INVALID;
+    }
+
+    /* The context stays, the config is read again next time to see changes made by others */
+    if (ptr.p)
+        uci_unload(uci_ctx, ptr.p);
+
+    return err;
+}
+
+#endif
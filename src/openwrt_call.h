@@ -0,0 +1,61 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _OPENWRT_CALL_H
+#define _OPENWRT_CALL_H
+
+#include <stdbool.h>
+#include <uwsc/buffer.h>
+
+/*
+ * The calls into libubus and libuci, kept out of openwrt.c: libblobmsg_json
+ * pulls in json-c, whose json_object and json_type clash with json.h. Only
+ * used from the worker thread of openwrt.c.
+ */
+
+enum {
+    OPENWRT_ERR_NOT_FOUND = 1,
+    OPENWRT_ERR_NOMEM,
+    OPENWRT_ERR_SYSERR,
+    OPENWRT_ERR_TIMEOUT,
+    OPENWRT_ERR_INVALID
+};
+
+/* params is a JSON object or NULL. On success the members of the reply's attrs are put in reply */
+int openwrt_ubus_call(const char *path, const char *method, const char *params, int timeout,
+    struct buffer *reply);
+
+struct openwrt_uci_req {
+    const char *op;
+    const char *config;
+    const char *section;    /* NULL if not given, likewise option */
+    const char *option;
+    const char **values;    /* One for a string, any number for a list */
+    int nvalues;
+    bool list;
+};
+
+int openwrt_uci(const struct openwrt_uci_req *req, struct buffer *reply);
+
+#endif
@@ -0,0 +1,1067 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <ifaddrs.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <uwsc/log.h>
+
+#include "list.h"
+#include "peer.h"
+#include "sha256.h"
+#include "command.h"
+#include "wsframe.h"
+#include "profiler.h"
+
+#define PEER_MAGIC  "RTTY-PEER"
+
+/* A cache entry hashed off the loop before it's used, copied to out on the way */
+struct peer_check {
+    struct list_head list;
+    int fd;
+    int out;                /* -1 to only hash */
+    const char *hash;
+    bool ok;
+    void (*done)(struct peer_check *c);
+};
+
+struct peer_serve {
+    struct list_head list;
+    struct ev_io io;
+    struct ev_timer timer;
+    char req[72];
+    int reqlen;
+    int fd;                 /* File being sent */
+    off_t offset;
+    off_t size;
+    char hdr[32];
+    int hdrlen;
+    int hdrsent;
+    struct peer_check check;
+};
+
+struct peer_job {
+    struct list_head list;
+    struct uwsc_client *ws;
+    struct ev_timer timer;
+    struct ev_io io;
+    struct sha256_ctx ctx;
+    char token[33];
+    char hash[SHA256_DIGEST_LENGTH * 2 + 1];
+    char path[512];
+    char tmp[520];          /* Next to path, renamed to it */
+    char dl[256];           /* In the cache, what a peer sends */
+    const char *part;       /* Of the two, the one fd is writing */
+    int fd;
+    bool connected;
+    bool from_peer;
+    char hdr[32];           /* Size line sent by the peer */
+    int hdrlen;
+    int64_t size;
+    int64_t received;
+    struct peer_check check;
+};
+
+struct cache_entry {
+    char name[SHA256_DIGEST_LENGTH * 2 + 1];
+    time_t atime;
+    off_t size;
+};
+
+static struct ev_loop *peer_loop;
+static int peer_port;
+static int tcp_port;
+static struct ev_io udp_watchers[RTTY_PEER_MAX_IFACES];
+static struct ev_io accept_watchers[RTTY_PEER_MAX_IFACES];
+static int nifaces;
+static LIST_HEAD(serving);
+static LIST_HEAD(jobs);
+static int nserving;
+static unsigned int ndownloads;     /* Tells apart the downloads of the same hash */
+
+static LIST_HEAD(checked);
+static pthread_mutex_t checked_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ev_async checked_watcher;
+
+static bool valid_hash(const char *hash)
+{
+    int i;
+
+    for (i = 0; i < SHA256_DIGEST_LENGTH * 2; i++) {
+        if (!isxdigit(hash[i]) || isupper(hash[i]))
+            return false;
+    }
+
+    return hash[i] == '\0';
+}
+
+static void cache_path(char *buf, int len, const char *hash)
+{
+    snprintf(buf, len, "%s/%s", RTTY_PEER_DIR, hash);
+}
+
+static bool cache_has(const char *hash)
+{
+    char path[256];
+    struct stat st;
+
+    cache_path(path, sizeof(path), hash);
+    return !stat(path, &st) && S_ISREG(st.st_mode);
+}
+
+/* "rtty -R" is another process, it learns from the pid file whether an rtty started with -P runs */
+static bool peer_enabled()
+{
+    char buf[32];
+    int fd, n, pid;
+
+    fd = open(RTTY_PEER_PIDFILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if (n <= 0)
+        return false;
+
+    buf[n] = '\0';
+    pid = atoi(buf);
+
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+static void write_pidfile()
+{
+    char tmp[256], buf[32];
+    int fd, len;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", RTTY_PEER_PIDFILE);
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+
+    len = snprintf(buf, sizeof(buf), "%d\n", (int)getpid());
+    if (write(fd, buf, len) != len)
+        len = -1;
+
+    if (close(fd) < 0 || len < 0 || rename(tmp, RTTY_PEER_PIDFILE) < 0) {
+        uwsc_log_err("Write '%s' failed: %s\n", RTTY_PEER_PIDFILE, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/* sha256 of what's read from fd, written to out as well unless it's -1 */
+static int hash_copy(int fd, int out, uint8_t digest[SHA256_DIGEST_LENGTH])
+{
+    struct sha256_ctx ctx;
+    uint8_t buf[8192];
+    int len;
+
+    sha256_init(&ctx);
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        if (out > -1 && write(out, buf, len) != len)
+            return -1;
+        sha256_update(&ctx, buf, len);
+    }
+
+    if (len < 0)
+        return -1;
+
+    sha256_final(&ctx, digest);
+
+    return 0;
+}
+
+/* Mark a cache entry as used, eviction goes by access time */
+static void cache_touch(const char *path)
+{
+    struct timespec ts[2] = {
+        { .tv_nsec = UTIME_NOW },
+        { .tv_nsec = UTIME_OMIT }
+    };
+
+    utimensat(AT_FDCWD, path, ts, 0);
+}
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+    const struct cache_entry *ea = a, *eb = b;
+
+    return (ea->atime > eb->atime) - (ea->atime < eb->atime);
+}
+
+/* Drop the least recently used entries until the cache fits RTTY_PEER_CACHE_MAX */
+static void cache_trim()
+{
+    struct cache_entry *entries = NULL, *tmp;
+    int n = 0, cap = 0, i;
+    off_t total = 0;
+    struct dirent *e;
+    char path[256];
+    struct stat st;
+    DIR *dir;
+
+    dir = opendir(RTTY_PEER_DIR);
+    if (!dir)
+        return;
+
+    while ((e = readdir(dir))) {
+        if (!valid_hash(e->d_name))
+            continue;
+
+        cache_path(path, sizeof(path), e->d_name);
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        if (n == cap) {
+            tmp = realloc(entries, sizeof(struct cache_entry) * (cap ? cap * 2 : 64));
+            if (!tmp)
+                break;
+            entries = tmp;
+            cap = cap ? cap * 2 : 64;
+        }
+
+        strcpy(entries[n].name, e->d_name);
+        entries[n].atime = st.st_atime;
+        entries[n].size = st.st_size;
+        total += st.st_size;
+        n++;
+    }
+
+    closedir(dir);
+
+    if (total > RTTY_PEER_CACHE_MAX) {
+        qsort(entries, n, sizeof(struct cache_entry), cache_entry_cmp);
+
+        for (i = 0; i < n && total > RTTY_PEER_CACHE_MAX; i++) {
+            cache_path(path, sizeof(path), entries[i].name);
+            if (!unlink(path))
+                total -= entries[i].size;
+        }
+    }
+
+    free(entries);
+}
+
+/*
+ * Entries are private copies, so nothing writing to the received file can
+ * change them. The copy is what gets hashed, and only then named after it.
+ */
+void peer_cache_add(const char *path)
+{
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    char hash[SHA256_DIGEST_LENGTH * 2 + 1];
+    char tmp[256], dst[256];
+    int fd, out, ret;
+
+    if (!peer_enabled())
+        return;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    snprintf(tmp, sizeof(tmp), "%s/.%d.tmp", RTTY_PEER_DIR, (int)getpid());
+
+    out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        uwsc_log_err("Cache '%s' failed: %s\n", path, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    ret = hash_copy(fd, out, digest);
+
+    close(fd);
+    close(out);
+
+    sha256_hex(digest, hash);
+    cache_path(dst, sizeof(dst), hash);
+
+    if (ret < 0 || rename(tmp, dst) < 0) {
+        uwsc_log_err("Cache '%s' failed: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+
+    cache_touch(dst);
+    cache_trim();
+}
+
+static void *check_thread(void *arg)
+{
+    struct peer_check *c = arg;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    char hash[SHA256_DIGEST_LENGTH * 2 + 1];
+
+    profiler_thread_init();
+
+    if (!hash_copy(c->fd, c->out, digest)) {
+        sha256_hex(digest, hash);
+        c->ok = !strcmp(hash, c->hash);
+    }
+
+    pthread_mutex_lock(&checked_lock);
+    list_add_tail(&c->list, &checked);
+    pthread_mutex_unlock(&checked_lock);
+
+    ev_async_send(peer_loop, &checked_watcher);
+
+    return NULL;
+}
+
+static void checked_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+    struct peer_check *c, *tmp;
+    LIST_HEAD(done);
+
+    pthread_mutex_lock(&checked_lock);
+    list_splice_init(&checked, &done);
+    pthread_mutex_unlock(&checked_lock);
+
+    list_for_each_entry_safe(c, tmp, &done, list) {
+        list_del(&c->list);
+
+        if (!c->ok) {
+            char path[256];
+
+            /* Corrupted on disk, nobody gets it again */
+            uwsc_log_err("Cache entry %s is corrupted, dropped\n", c->hash);
+            cache_path(path, sizeof(path), c->hash);
+            unlink(path);
+        }
+
+        c->done(c);
+    }
+}
+
+/* Hash the entry of c->hash opened on c->fd, c->done is called on the loop */
+static int cache_check(struct peer_check *c)
+{
+    pthread_t tid;
+
+    c->ok = false;
+
+    if (pthread_create(&tid, NULL, check_thread, c))
+        return -1;
+    pthread_detach(tid);
+
+    return 0;
+}
+
+static void job_reply(struct peer_job *j, int err, const char *source)
+{
+    char str[256] = "";
+
+    if (err)
+        snprintf(str, sizeof(str) - 1, "{\"type\":\"peer\",\"token\":\"%s\","
+            "\"attrs\":{\"err\":%d,\"msg\":\"%s\"}}", j->token, err, cmderr2str(err));
+    else
+        snprintf(str, sizeof(str) - 1, "{\"type\":\"peer\",\"token\":\"%s\","
+            "\"attrs\":{\"code\":0,\"source\":\"%s\"}}", j->token, source);
+
+    j->ws->send(j->ws, str, strlen(str), UWSC_OP_TEXT);
+}
+
+static void job_free(struct peer_job *j)
+{
+    ev_timer_stop(peer_loop, &j->timer);
+
+    if (j->io.fd > 0) {
+        ev_io_stop(peer_loop, &j->io);
+        close(j->io.fd);
+    }
+
+    if (j->fd > 0) {
+        close(j->fd);
+        unlink(j->part);
+    }
+
+    list_del(&j->list);
+    ws_put(j->ws);
+    free(j);
+}
+
+static void job_fail(struct peer_job *j)
+{
+    job_reply(j, RTTY_CMD_ERR_NOT_FOUND, NULL);
+    job_free(j);
+}
+
+static void job_query(struct peer_job *j);
+
+static void job_checked(struct peer_check *c)
+{
+    struct peer_job *j = container_of(c, struct peer_job, check);
+
+    close(c->fd);
+
+    if (!c->ok) {
+        close(j->fd);
+        j->fd = -1;
+        unlink(j->tmp);
+
+        /* A corrupted entry is gone, maybe a peer has it */
+        if (j->from_peer) {
+            job_fail(j);
+            return;
+        }
+
+        job_query(j);
+        return;
+    }
+
+    close(j->fd);
+    j->fd = -1;
+
+    if (rename(j->tmp, j->path) < 0) {
+        uwsc_log_err("rename '%s' failed: %s\n", j->path, strerror(errno));
+        unlink(j->tmp);
+        job_reply(j, RTTY_CMD_ERR_SYSERR, NULL);
+        job_free(j);
+        return;
+    }
+
+    job_reply(j, 0, j->from_peer ? "peer" : "cache");
+    job_free(j);
+}
+
+/* Copy the cache entry to path, verifying it on the way */
+static int job_from_cache(struct peer_job *j)
+{
+    char src[256];
+
+    cache_path(src, sizeof(src), j->hash);
+
+    j->check.fd = open(src, O_RDONLY | O_CLOEXEC);
+    if (j->check.fd < 0)
+        return -1;
+
+    j->fd = open(j->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (j->fd < 0) {
+        close(j->check.fd);
+        return -1;
+    }
+
+    j->part = j->tmp;
+
+    cache_touch(src);
+
+    j->check.out = j->fd;
+    j->check.hash = j->hash;
+    j->check.done = job_checked;
+
+    if (cache_check(&j->check) < 0) {
+        close(j->check.fd);
+        close(j->fd);
+        j->fd = -1;
+        unlink(j->tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void job_done(struct peer_job *j)
+{
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    char hash[SHA256_DIGEST_LENGTH * 2 + 1];
+    char path[256];
+
+    sha256_final(&j->ctx, digest);
+    sha256_hex(digest, hash);
+
+    if (strcmp(hash, j->hash)) {
+        uwsc_log_err("Peer sent corrupted data for %s\n", j->hash);
+        job_fail(j);
+        return;
+    }
+
+    close(j->fd);
+    j->fd = -1;
+
+    ev_timer_stop(peer_loop, &j->timer);
+    ev_io_stop(peer_loop, &j->io);
+    close(j->io.fd);
+    j->io.fd = -1;
+
+    /* Only the cache has it, the copy at path is made from there */
+    cache_path(path, sizeof(path), j->hash);
+    if (rename(j->dl, path) < 0) {
+        uwsc_log_err("rename '%s' failed: %s\n", path, strerror(errno));
+        unlink(j->dl);
+        job_reply(j, RTTY_CMD_ERR_SYSERR, NULL);
+        job_free(j);
+        return;
+    }
+
+    j->from_peer = true;
+
+    if (job_from_cache(j) < 0) {
+        job_reply(j, RTTY_CMD_ERR_SYSERR, NULL);
+        job_free(j);
+    }
+
+    /* After it's opened, in case the new entry itself doesn't fit */
+    cache_trim();
+}
+
+static int job_consume(struct peer_job *j, uint8_t *data, int len)
+{
+    char *eol;
+    int n;
+
+    /* Header: size in decimal followed by a newline */
+    if (j->size < 0) {
+        n = len < sizeof(j->hdr) - 1 - j->hdrlen ? len : sizeof(j->hdr) - 1 - j->hdrlen;
+        memcpy(j->hdr + j->hdrlen, data, n);
+        j->hdrlen += n;
+        j->hdr[j->hdrlen] = '\0';
+
+        eol = strchr(j->hdr, '\n');
+        if (!eol)
+            return j->hdrlen < sizeof(j->hdr) - 1 ? 0 : -1;
+
+        j->size = strtoll(j->hdr, NULL, 10);
+
+        /* What came after the header is file data */
+        n = eol + 1 - j->hdr - (j->hdrlen - n);
+        data += n;
+        len -= n;
+    }
+
+    if (j->received + len > j->size)
+        return -1;
+
+    if (write(j->fd, data, len) != len)
+        return -1;
+
+    sha256_update(&j->ctx, data, len);
+    j->received += len;
+
+    return 0;
+}
+
+static void job_io_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    struct peer_job *j = container_of(w, struct peer_job, io);
+    uint8_t buf[8192];
+    int len;
+
+    if (!j->connected) {
+        int err = 0;
+        socklen_t elen = sizeof(err);
+
+        getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &elen);
+        if (err) {
+            job_fail(j);
+            return;
+        }
+
+        j->connected = true;
+
+        len = snprintf((char *)buf, sizeof(buf), "%s\n", j->hash);
+        if (write(w->fd, buf, len) != len) {
+            job_fail(j);
+            return;
+        }
+
+        ev_io_stop(loop, w);
+        ev_io_set(w, w->fd, EV_READ);
+        ev_io_start(loop, w);
+        return;
+    }
+
+    len = read(w->fd, buf, sizeof(buf));
+    if (len < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return;
+        job_fail(j);
+        return;
+    }
+
+    if (len == 0 || job_consume(j, buf, len) < 0) {
+        job_fail(j);
+        return;
+    }
+
+    if (j->size >= 0 && j->received == j->size)
+        job_done(j);
+}
+
+static void job_connect(struct peer_job *j, struct sockaddr_in *addr)
+{
+    int sock;
+
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        job_fail(j);
+        return;
+    }
+
+    if (connect(sock, (struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) {
+        close(sock);
+        job_fail(j);
+        return;
+    }
+
+    /* Downloaded into the cache, it becomes the entry without a copy */
+    j->fd = open(j->dl, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (j->fd < 0) {
+        close(sock);
+        job_reply(j, RTTY_CMD_ERR_SYSERR, NULL);
+        job_free(j);
+        return;
+    }
+
+    j->part = j->dl;
+
+    sha256_init(&j->ctx);
+
+    ev_io_init(&j->io, job_io_cb, sock, EV_WRITE);
+    ev_io_start(peer_loop, &j->io);
+
+    ev_timer_stop(peer_loop, &j->timer);
+    ev_timer_set(&j->timer, RTTY_PEER_FETCH_TIMEOUT, 0);
+    ev_timer_start(peer_loop, &j->timer);
+}
+
+static void job_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+    struct peer_job *j = container_of(w, struct peer_job, timer);
+
+    job_fail(j);
+}
+
+static void send_query(const char *hash)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(peer_port),
+        .sin_addr.s_addr = htonl(INADDR_BROADCAST)
+    };
+    char msg[128];
+    int len, i;
+
+    len = snprintf(msg, sizeof(msg), PEER_MAGIC " Q %s", hash);
+
+    for (i = 0; i < nifaces; i++)
+        sendto(udp_watchers[i].fd, msg, len, 0, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+static void job_query(struct peer_job *j)
+{
+    ev_timer_set(&j->timer, RTTY_PEER_QUERY_TIMEOUT, 0);
+    ev_timer_start(peer_loop, &j->timer);
+
+    send_query(j->hash);
+}
+
+void peer_fetch(struct uwsc_client *ws, const json_value *msg)
+{
+    const json_value *attrs = json_get_value(msg, "attrs");
+    const char *username = json_get_string(attrs, "username");
+    const char *password = json_get_string(attrs, "password");
+    const char *hash = json_get_string(attrs, "sha256");
+    const char *path = json_get_string(attrs, "path");
+    struct peer_job *j;
+    int err = 0;
+
+    j = calloc(1, sizeof(struct peer_job));
+    if (!j) {
+        json_value_free((json_value *)msg);
+        return;
+    }
+
+    INIT_LIST_HEAD(&j->list);
+    j->ws = ws;
+    j->size = -1;
+    strncpy(j->token, json_get_string(msg, "token"), sizeof(j->token) - 1);
+
+    if (!peer_loop) {
+        err = RTTY_CMD_ERR_NOT_FOUND;
+        goto ERR;
+    }
+
+    if (!username[0] || !login_test(username, password)) {
+        err = RTTY_CMD_ERR_PERMIT;
+        goto ERR;
+    }
+
+    if (!valid_hash(hash) || !path[0] || strlen(path) >= sizeof(j->path)) {
+        err = RTTY_CMD_ERR_INVALID;
+        goto ERR;
+    }
+
+    strcpy(j->hash, hash);
+    strcpy(j->path, path);
+    snprintf(j->tmp, sizeof(j->tmp), "%s.peer", path);
+    snprintf(j->dl, sizeof(j->dl), "%s/.%s.%u", RTTY_PEER_DIR, hash, ++ndownloads);
+
+    json_value_free((json_value *)msg);
+
+    list_add_tail(&j->list, &jobs);
+    ws_hold(ws);
+
+    ev_init(&j->timer, job_timer_cb);
+
+    /* Already here */
+    if (cache_has(j->hash) && job_from_cache(j) == 0)
+        return;
+
+    job_query(j);
+    return;
+
+ERR:
+    job_reply(j, err, NULL);
+    json_value_free((json_value *)msg);
+    free(j);
+}
+
+static void serve_free(struct peer_serve *s)
+{
+    ev_io_stop(peer_loop, &s->io);
+    ev_timer_stop(peer_loop, &s->timer);
+    close(s->io.fd);
+
+    if (s->fd > 0)
+        close(s->fd);
+
+    list_del(&s->list);
+    free(s);
+
+    nserving--;
+}
+
+static void serve_checked(struct peer_check *c)
+{
+    struct peer_serve *s = container_of(c, struct peer_serve, check);
+    char path[256];
+    struct stat st;
+
+    if (!c->ok || fstat(s->fd, &st) < 0) {
+        serve_free(s);
+        return;
+    }
+
+    cache_path(path, sizeof(path), s->req);
+    cache_touch(path);
+
+    s->size = st.st_size;
+    s->hdrlen = snprintf(s->hdr, sizeof(s->hdr), "%lld\n", (long long)s->size);
+
+    ev_io_set(&s->io, s->io.fd, EV_WRITE);
+    ev_io_start(peer_loop, &s->io);
+
+    ev_timer_set(&s->timer, RTTY_PEER_FETCH_TIMEOUT, 0);
+    ev_timer_start(peer_loop, &s->timer);
+}
+
+/* Nothing is sent until the entry is verified, the timeout starts over after */
+static int serve_open(struct peer_serve *s)
+{
+    char path[256];
+
+    if (!valid_hash(s->req))
+        return -1;
+
+    cache_path(path, sizeof(path), s->req);
+
+    s->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (s->fd < 0)
+        return -1;
+
+    /* The entry is only ever replaced by rename(), so what's checked on fd is what's sent */
+    s->check.fd = s->fd;
+    s->check.out = -1;
+    s->check.hash = s->req;
+    s->check.done = serve_checked;
+
+    ev_io_stop(peer_loop, &s->io);
+    ev_timer_stop(peer_loop, &s->timer);
+
+    return cache_check(&s->check);
+}
+
+static void serve_io_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    struct peer_serve *s = container_of(w, struct peer_serve, io);
+    char *eol;
+    int ret;
+
+    /* Request: hash followed by a newline */
+    if (!s->fd) {
+        ret = read(w->fd, s->req + s->reqlen, sizeof(s->req) - 1 - s->reqlen);
+        if (ret <= 0) {
+            if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+                return;
+            serve_free(s);
+            return;
+        }
+
+        s->reqlen += ret;
+        s->req[s->reqlen] = '\0';
+
+        eol = strchr(s->req, '\n');
+        if (!eol) {
+            if (s->reqlen == sizeof(s->req) - 1)
+                serve_free(s);
+            return;
+        }
+
+        *eol = '\0';
+
+        if (serve_open(s) < 0)
+            serve_free(s);
+        return;
+    }
+
+    if (s->hdrsent < s->hdrlen) {
+        ret = write(w->fd, s->hdr + s->hdrsent, s->hdrlen - s->hdrsent);
+        if (ret < 0) {
+            if (errno != EINTR && errno != EAGAIN)
+                serve_free(s);
+            return;
+        }
+        s->hdrsent += ret;
+        return;
+    }
+
+    ret = sendfile(w->fd, s->fd, &s->offset, s->size - s->offset);
+    if (ret < 0 && errno != EINTR && errno != EAGAIN) {
+        serve_free(s);
+        return;
+    }
+
+    if (s->offset == s->size)
+        serve_free(s);
+}
+
+static void serve_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+    struct peer_serve *s = container_of(w, struct peer_serve, timer);
+
+    serve_free(s);
+}
+
+static void accept_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    struct peer_serve *s;
+    int sock;
+
+    sock = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sock < 0)
+        return;
+
+    if (nserving == RTTY_PEER_MAX_SERVING) {
+        close(sock);
+        return;
+    }
+
+    s = calloc(1, sizeof(struct peer_serve));
+    if (!s) {
+        close(sock);
+        return;
+    }
+
+    ev_io_init(&s->io, serve_io_cb, sock, EV_READ);
+    ev_io_start(loop, &s->io);
+
+    ev_timer_init(&s->timer, serve_timer_cb, RTTY_PEER_FETCH_TIMEOUT, 0);
+    ev_timer_start(loop, &s->timer);
+
+    list_add_tail(&s->list, &serving);
+    nserving++;
+}
+
+/* A query from a peer or the answer to one of ours */
+static void udp_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+    struct peer_job *j, *tmp;
+    char msg[128], reply[128];
+    char type, hash[SHA256_DIGEST_LENGTH * 2 + 1];
+    int len, port;
+
+    len = recvfrom(w->fd, msg, sizeof(msg) - 1, 0, (struct sockaddr *)&addr, &alen);
+    if (len <= 0)
+        return;
+
+    msg[len] = '\0';
+
+    port = 0;
+    if (sscanf(msg, PEER_MAGIC " %c %64s %d", &type, hash, &port) < 2 || !valid_hash(hash))
+        return;
+
+    if (type == 'Q') {
+        if (!cache_has(hash))
+            return;
+
+        len = snprintf(reply, sizeof(reply), PEER_MAGIC " H %s %d", hash, tcp_port);
+        sendto(w->fd, reply, len, 0, (struct sockaddr *)&addr, alen);
+        return;
+    }
+
+    if (type != 'H' || port <= 0 || port > 65535)
+        return;
+
+    list_for_each_entry_safe(j, tmp, &jobs, list) {
+        /* Still waiting for an answer, not being checked or downloaded */
+        if (!strcmp(j->hash, hash) && !j->io.fd && ev_is_active(&j->timer)) {
+            addr.sin_port = htons(port);
+            job_connect(j, &addr);
+            return;
+        }
+    }
+}
+
+/* The IPv4 address of an interface */
+static int iface_addr(const char *name, struct in_addr *addr)
+{
+    struct ifaddrs *ifa, *p;
+    int ret = -1;
+
+    if (getifaddrs(&ifa) < 0)
+        return -1;
+
+    for (p = ifa; p; p = p->ifa_next) {
+        if (p->ifa_addr && p->ifa_addr->sa_family == AF_INET && !strcmp(p->ifa_name, name)) {
+            *addr = ((struct sockaddr_in *)p->ifa_addr)->sin_addr;
+            ret = 0;
+            break;
+        }
+    }
+
+    freeifaddrs(ifa);
+
+    return ret;
+}
+
+/* Queries and answers on an interface, files served on its address only */
+static int open_iface(struct ev_loop *loop, const char *name, int port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY)
+    };
+    socklen_t alen = sizeof(addr);
+    int udp, tcp, on = 1;
+
+    udp = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (udp < 0)
+        return -1;
+
+    /* Several instances on one host can share the discovery port */
+    setsockopt(udp, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(udp, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+
+    /* Broadcasts only reach the wildcard address, the device keeps it to this interface */
+    if (setsockopt(udp, SOL_SOCKET, SO_BINDTODEVICE, name, strlen(name) + 1) < 0 ||
+        bind(udp, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        uwsc_log_err("Bind peer port %d on %s failed: %s\n", port, name, strerror(errno));
+        close(udp);
+        return -1;
+    }
+
+    if (iface_addr(name, &addr.sin_addr) < 0) {
+        uwsc_log_err("No IPv4 address on %s\n", name);
+        close(udp);
+        return -1;
+    }
+
+    tcp = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (tcp < 0) {
+        close(udp);
+        return -1;
+    }
+
+    /* The port is announced in answers, any free one will do, the same on every interface */
+    addr.sin_port = htons(tcp_port);
+    if (bind(tcp, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(tcp, 8) < 0 ||
+        getsockname(tcp, (struct sockaddr *)&addr, &alen) < 0) {
+        uwsc_log_err("Listen for peers on %s failed: %s\n", name, strerror(errno));
+        close(udp);
+        close(tcp);
+        return -1;
+    }
+
+    tcp_port = ntohs(addr.sin_port);
+
+    ev_io_init(&udp_watchers[nifaces], udp_cb, udp, EV_READ);
+    ev_io_start(loop, &udp_watchers[nifaces]);
+
+    ev_io_init(&accept_watchers[nifaces], accept_cb, tcp, EV_READ);
+    ev_io_start(loop, &accept_watchers[nifaces]);
+
+    nifaces++;
+
+    uwsc_log_info("Peer cache on %s(%s) port %d, serving on tcp port %d\n", name,
+        inet_ntoa(addr.sin_addr), port, tcp_port);
+
+    return 0;
+}
+
+int peer_init(struct ev_loop *loop, int port, const char **ifaces, int n)
+{
+    int i;
+
+    if (mkdir(RTTY_PEER_DIR, 0755) < 0 && errno != EEXIST) {
+        uwsc_log_err("Create '%s' failed: %s\n", RTTY_PEER_DIR, strerror(errno));
+        return -1;
+    }
+
+    peer_loop = loop;
+    peer_port = port;
+
+    ev_async_init(&checked_watcher, checked_cb);
+    ev_async_start(loop, &checked_watcher);
+
+    for (i = 0; i < n && i < RTTY_PEER_MAX_IFACES; i++) {
+        if (open_iface(loop, ifaces[i], port) < 0)
+            return -1;
+    }
+
+    cache_trim();
+    write_pidfile();
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _PEER_H
+#define _PEER_H
+
+#include <uwsc/uwsc.h>
+
+#include "json.h"
+
+#define RTTY_PEER_DIR               "/var/cache/rtty"
+#define RTTY_PEER_PIDFILE           RTTY_PEER_DIR "/.pid"  /* Of the rtty sharing it, peer mode is on while it runs */
+#define RTTY_PEER_PORT              5913
+#define RTTY_PEER_QUERY_TIMEOUT     1.0     /* second */
+#define RTTY_PEER_FETCH_TIMEOUT     120     /* second */
+#define RTTY_PEER_MAX_SERVING       4
+#define RTTY_PEER_MAX_IFACES        4
+#define RTTY_PEER_IFACE             "br-lan"            /* Shared on by default */
+#define RTTY_PEER_CACHE_MAX         (64 * 1024 * 1024)  /* bytes, least recently used dropped first */
+
+/*
+ * LAN peer cache. Copies of the files received with "rtty -R" are kept in
+ * RTTY_PEER_DIR under their sha256, and hashed again before they're used
+ * or served, a corrupted one is dropped. Before the server sends a file, it asks the device
+ * to "peer" fetch it: the device broadcasts a query on the LAN, downloads
+ * the file from the first peer that has it and verifies the hash. If no
+ * peer answers, the server falls back to sending the file itself.
+ * Peers are only talked to on the given interfaces(the LAN).
+ */
+int peer_init(struct ev_loop *loop, int port, const char **ifaces, int n);
+
+void peer_fetch(struct uwsc_client *ws, const json_value *msg);
+
+/* Called by "rtty -R" for every file received, a no-op unless an rtty with -P runs */
+void peer_cache_add(const char *path);
+
+#endif
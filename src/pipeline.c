@@ -0,0 +1,272 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <uwsc/log.h>
+
+#include "list.h"
+#include "pipeline.h"
+
+enum {
+    BLK_FREE,
+    BLK_READY       /* Read, hashed and processed, waiting to be emitted */
+};
+
+struct pipeline_block {
+    int state;
+    int len;            /* Read */
+    uint8_t *out;       /* What is emitted */
+    int out_len;
+    bool last;
+    uint8_t digest[SHA256_DIGEST_LENGTH];   /* Of the block, for the hash list of a regular file */
+    uint8_t data[0];
+};
+
+struct pipeline {
+    struct ev_loop *loop;
+    struct ev_async async;
+    const struct pipeline_ops *ops;
+    void *arg;
+
+    int fd;
+    bool seekable;
+    int blk_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_mutex_t read_lock;      /* Keeps reads of a pipe in order */
+
+    uint64_t next_read;
+    uint64_t next_emit;
+    bool eof;
+    bool err;
+
+    struct sha256_ctx sha;          /* Of the data */
+    struct sha256_ctx list_sha;     /* Of a file's block digests */
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    uint8_t list[SHA256_DIGEST_LENGTH];
+
+    struct pipeline_block *blocks[PIPELINE_DEPTH];
+};
+
+#define BLOCK(p, seq) ((p)->blocks[(seq) % PIPELINE_DEPTH])
+
+static int read_block(struct pipeline *p, uint8_t *data, uint64_t seq)
+{
+    int len = 0, n;
+
+    while (len < p->blk_size) {
+        if (p->seekable)
+            n = pread(p->fd, data + len, p->blk_size - len, seq * p->blk_size + len);
+        else
+            n = read(p->fd, data + len, p->blk_size - len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            uwsc_log_err("Read failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (n == 0)
+            break;
+
+        len += n;
+
+        /* Don't hold back what a pipe has given so far */
+        if (!p->seekable)
+            break;
+    }
+
+    return len;
+}
+
+static void *read_worker(void *arg)
+{
+    struct pipeline *p = arg;
+    struct pipeline_block *blk;
+    uint64_t seq;
+    int len;
+
+    for (;;) {
+        if (!p->seekable)
+            pthread_mutex_lock(&p->read_lock);
+
+        pthread_mutex_lock(&p->lock);
+
+        while (!p->eof && p->next_read >= p->next_emit + PIPELINE_DEPTH)
+            pthread_cond_wait(&p->cond, &p->lock);
+
+        if (p->eof) {
+            pthread_mutex_unlock(&p->lock);
+            if (!p->seekable)
+                pthread_mutex_unlock(&p->read_lock);
+            return NULL;
+        }
+
+        seq = p->next_read++;
+        blk = BLOCK(p, seq);
+
+        pthread_mutex_unlock(&p->lock);
+
+        len = read_block(p, blk->data + PIPELINE_HEADROOM, seq);
+
+        /*
+         * A pipe is read in order and the stream hashed as it comes. The blocks of a
+         * file are hashed in parallel, their digests are combined in order when emitted,
+         * with the data itself for the sha256 of the whole file.
+         */
+        if (!p->seekable) {
+            if (len > 0)
+                sha256_update(&p->sha, blk->data + PIPELINE_HEADROOM, len);
+            pthread_mutex_unlock(&p->read_lock);
+        } else if (len > 0) {
+            struct sha256_ctx ctx;
+
+            sha256_init(&ctx);
+            sha256_update(&ctx, blk->data + PIPELINE_HEADROOM, len);
+            sha256_final(&ctx, blk->digest);
+        }
+
+        blk->len = len > 0 ? len : 0;
+        blk->out_len = blk->len;
+        blk->out = NULL;
+
+        if (len > 0)
+            blk->out = p->ops->process(blk->data + PIPELINE_HEADROOM, &blk->out_len, p->arg);
+
+        pthread_mutex_lock(&p->lock);
+
+        /* A short block of a regular file is its last, a pipe ends with an empty read */
+        blk->last = len <= 0 || (p->seekable && len < p->blk_size);
+        if (blk->last)
+            p->eof = true;
+        if (len < 0)
+            p->err = true;
+
+        blk->state = BLK_READY;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+
+        ev_async_send(p->loop, &p->async);
+    }
+}
+
+static void emit_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+    struct pipeline *p = container_of(w, struct pipeline, async);
+    struct pipeline_block *blk;
+    bool last;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        blk = BLOCK(p, p->next_emit);
+        if (blk->state != BLK_READY) {
+            pthread_mutex_unlock(&p->lock);
+            return;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        if (blk->out_len > 0)
+            p->ops->emit(blk->out, blk->out_len, p->arg);
+
+        /* process() only writes the headroom, the data is still as read */
+        if (p->seekable && blk->len > 0) {
+            sha256_update(&p->sha, blk->data + PIPELINE_HEADROOM, blk->len);
+            sha256_update(&p->list_sha, blk->digest, SHA256_DIGEST_LENGTH);
+        }
+
+        last = blk->last;
+        if (last) {
+            sha256_final(&p->sha, p->digest);
+            sha256_final(&p->list_sha, p->list);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        blk->state = BLK_FREE;
+        p->next_emit++;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+
+        if (last) {
+            ev_async_stop(loop, w);
+            p->ops->done(p->digest, p->seekable ? p->list : NULL, p->blk_size, p->err, p->arg);
+            return;
+        }
+    }
+}
+
+struct pipeline *pipeline_start(struct ev_loop *loop, int fd, bool seekable, int blk_size,
+    const struct pipeline_ops *ops, void *arg)
+{
+    int nworkers = seekable ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    struct pipeline *p;
+    pthread_t tid;
+    int i;
+
+    if (nworkers < 1)
+        nworkers = 1;
+    if (nworkers > PIPELINE_MAX_WORKERS)
+        nworkers = PIPELINE_MAX_WORKERS;
+
+    p = calloc(1, sizeof(struct pipeline));
+    if (!p)
+        return NULL;
+
+    for (i = 0; i < PIPELINE_DEPTH; i++) {
+        p->blocks[i] = calloc(1, sizeof(struct pipeline_block) + PIPELINE_HEADROOM + blk_size);
+        if (!p->blocks[i])
+            return NULL;
+    }
+
+    p->loop = loop;
+    p->ops = ops;
+    p->arg = arg;
+    p->fd = fd;
+    p->seekable = seekable;
+    p->blk_size = blk_size;
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    pthread_mutex_init(&p->read_lock, NULL);
+    sha256_init(&p->sha);
+    sha256_init(&p->list_sha);
+
+    ev_async_init(&p->async, emit_cb);
+    ev_async_start(loop, &p->async);
+
+    /* The process exits when the transfer is over, so the threads are never joined */
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&tid, NULL, read_worker, p))
+            return i ? p : NULL;
+        pthread_detach(tid);
+    }
+
+    return p;
+}
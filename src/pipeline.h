@@ -0,0 +1,64 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include <ev.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sha256.h"
+
+#define PIPELINE_MAX_WORKERS    4
+#define PIPELINE_DEPTH          16      /* Blocks in flight */
+#define PIPELINE_HEADROOM       8       /* Bytes before the data of a block, for a record header */
+
+/*
+ * Sends a file in blocks through stages: reading, hashing and processing
+ * run on a pool of worker threads, emitting in the loop, in order. Blocks
+ * of a regular file are read and hashed in parallel for a hash list(the
+ * sha256 of the sha256 of every block in order), the sha256 of the whole
+ * file is computed as they're emitted. A pipe is read by one worker at a
+ * time and hashed as a whole as it's read.
+ */
+struct pipeline_ops {
+    /* Worker thread, in any order, after data is hashed. It may write the PIPELINE_HEADROOM
+     * bytes before data. Returns the start of what is emitted and its length in *len */
+    uint8_t *(*process)(uint8_t *data, int *len, void *arg);
+
+    /* Loop thread, in order */
+    void (*emit)(const uint8_t *data, int len, void *arg);
+
+    /* Loop thread, after the last block. digest is the sha256 of everything read, list the
+     * hash list over blocks of blk_size bytes, or NULL for a pipe. err is set if reading failed */
+    void (*done)(const uint8_t *digest, const uint8_t *list, int blk_size, bool err, void *arg);
+};
+
+struct pipeline;
+
+struct pipeline *pipeline_start(struct ev_loop *loop, int fd, bool seekable, int blk_size,
+    const struct pipeline_ops *ops, void *arg);
+
+#endif
@@ -0,0 +1,373 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <uwsc/log.h>
+
+#include "list.h"
+#include "utils.h"
+#include "proto.h"
+#include "plugin.h"
+#include "command.h"
+#include "bulk.h"
+#include "wsframe.h"
+#include "rtty_plugin.h"
+#include "profiler.h"
+
+struct plugin_handler {
+    char type[32];
+    rtty_plugin_handler_t handler;
+    int flags;
+    void *priv;
+};
+
+struct rtty_plugin_req {
+    struct list_head list;
+    struct plugin_handler *h;
+    struct uwsc_client *ws;
+    const json_value *msg;
+    const json_value *attrs;
+    int id;                 /* Of the binary reply frame, 0 for a text reply */
+    int err;
+    struct buffer reply;
+};
+
+static struct plugin_handler handlers[RTTY_PLUGIN_MAX_HANDLERS];
+static int nhandlers;
+
+static LIST_HEAD(pending);      /* For the workers */
+static LIST_HEAD(done);         /* Back to the loop */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct ev_async done_watcher;
+static bool workers_started;
+
+static int register_handler(const char *type, rtty_plugin_handler_t handler, int flags, void *priv)
+{
+    struct plugin_handler *h;
+    int i;
+
+    if (!type[0] || strlen(type) >= sizeof(h->type) || nhandlers == RTTY_PLUGIN_MAX_HANDLERS)
+        return -1;
+
+    for (i = 0; i < nhandlers; i++) {
+        if (!strcmp(type, handlers[i].type))
+            return -1;
+    }
+
+    h = &handlers[nhandlers++];
+    strcpy(h->type, type);
+    h->handler = handler;
+    h->flags = flags;
+    h->priv = priv;
+
+    return 0;
+}
+
+static const char *api_get_string(struct rtty_plugin_req *req, const char *name)
+{
+    return json_get_string(req->attrs, name);
+}
+
+static int api_get_int(struct rtty_plugin_req *req, const char *name)
+{
+    return json_get_int(req->attrs, name);
+}
+
+static int api_reply(struct rtty_plugin_req *req, const void *data, size_t len)
+{
+    if (buffer_length(&req->reply) + len > RTTY_PLUGIN_MAX_REPLY)
+        return -1;
+
+    return buffer_put_data(&req->reply, data, len) < 0 ? -1 : 0;
+}
+
+static void api_log(const char *fmt, ...)
+{
+    char str[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(str, sizeof(str), fmt, ap);
+    va_end(ap);
+
+    uwsc_log_info("%s", str);
+}
+
+static const struct rtty_plugin_api api = {
+    .version = RTTY_PLUGIN_API_VERSION,
+    .register_handler = register_handler,
+    .get_string = api_get_string,
+    .get_int = api_get_int,
+    .reply = api_reply,
+    .log = api_log
+};
+
+static void send_reply(struct rtty_plugin_req *req)
+{
+    const char *token = json_get_string(req->msg, "token");
+    struct buffer b = {};
+
+    /* With the feature negotiated, a request with an id gets a binary frame: the id in the sid field */
+    if (!req->err && req->id && proto_has(RTTY_FEAT_FRAME_V2 | RTTY_FEAT_PLUGIN)) {
+        int len = buffer_length(&req->reply), hdrlen;
+
+        if (!buffer_put(&b, RTTY_FRAME_MAX_HDRLEN) || buffer_put_data(&b, buffer_data(&req->reply), len) < 0) {
+            buffer_free(&b);
+            return;
+        }
+
+        hdrlen = proto_frame_header(buffer_data(&b) + RTTY_FRAME_MAX_HDRLEN, RTTY_FRAME_REPLY, req->id, 0, 0);
+        bulk_send(req->ws, buffer_data(&b) + RTTY_FRAME_MAX_HDRLEN - hdrlen, len + hdrlen, UWSC_OP_BINARY);
+        buffer_free(&b);
+        return;
+    }
+
+    buffer_put_printf(&b, "{\"type\":");
+    buffer_put_json_string(&b, req->h->type, strlen(req->h->type));
+    buffer_put_printf(&b, ",\"token\":");
+    buffer_put_json_string(&b, token, strlen(token));
+
+    if (req->err) {
+        buffer_put_printf(&b, ",\"attrs\":{\"err\":%d,\"msg\":\"%s\"}}", req->err, cmderr2str(req->err));
+    } else {
+        int len = buffer_length(&req->reply);
+        int size = len * 4 / 3 + 4;
+        char *data = malloc(size);
+        int n = data ? b64_encode(buffer_data(&req->reply), len, data, size) : -1;
+
+        buffer_put_printf(&b, ",\"attrs\":{\"data\":\"");
+        if (n > 0)
+            buffer_put_data(&b, data, n);
+        buffer_put_printf(&b, "\"}}");
+
+        free(data);
+    }
+
+    bulk_send(req->ws, buffer_data(&b), buffer_length(&b), UWSC_OP_TEXT);
+    buffer_free(&b);
+}
+
+static void run_req(struct rtty_plugin_req *req)
+{
+    req->err = req->h->handler(req, req->h->priv);
+}
+
+/* On the loop only: getspnam() and crypt() keep static state */
+static bool auth_req(struct rtty_plugin_req *req)
+{
+    const char *username = json_get_string(req->attrs, "username");
+    const char *password = json_get_string(req->attrs, "password");
+
+    if (!(req->h->flags & RTTY_PLUGIN_AUTH))
+        return true;
+
+    return username[0] && login_test(username, password);
+}
+
+static void free_req(struct rtty_plugin_req *req)
+{
+    buffer_free(&req->reply);
+    json_value_free((json_value *)req->msg);
+    ws_put(req->ws);
+    free(req);
+}
+
+static void *worker(void *arg)
+{
+    struct rtty_plugin_req *req;
+    struct ev_loop *loop = arg;
+
+    profiler_thread_init();
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (list_empty(&pending))
+            pthread_cond_wait(&cond, &lock);
+        req = list_first_entry(&pending, struct rtty_plugin_req, list);
+        list_del(&req->list);
+        pthread_mutex_unlock(&lock);
+
+        run_req(req);
+
+        pthread_mutex_lock(&lock);
+        list_add_tail(&req->list, &done);
+        pthread_mutex_unlock(&lock);
+
+        ev_async_send(loop, &done_watcher);
+    }
+
+    return NULL;
+}
+
+static void done_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+    struct rtty_plugin_req *req, *tmp;
+    LIST_HEAD(reqs);
+
+    pthread_mutex_lock(&lock);
+    list_splice_init(&done, &reqs);
+    pthread_mutex_unlock(&lock);
+
+    list_for_each_entry_safe(req, tmp, &reqs, list) {
+        send_reply(req);
+        free_req(req);
+    }
+}
+
+static void start_workers(struct ev_loop *loop)
+{
+    pthread_t tid;
+    int i;
+
+    for (i = 0; i < RTTY_PLUGIN_WORKERS; i++) {
+        if (pthread_create(&tid, NULL, worker, loop)) {
+            uwsc_log_err("Start plugin worker failed\n");
+            break;
+        }
+        pthread_detach(tid);
+    }
+
+    workers_started = i > 0;
+}
+
+static void load_plugin(const char *path)
+{
+    int (*init)(const struct rtty_plugin_api *api);
+    int n = nhandlers;
+    void *dl;
+
+    dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!dl) {
+        uwsc_log_err("Load plugin '%s' failed: %s\n", path, dlerror());
+        return;
+    }
+
+    init = dlsym(dl, "rtty_plugin_init");
+    if (!init || init(&api)) {
+        uwsc_log_err("Init plugin '%s' failed\n", path);
+        /* Handlers point into it */
+        nhandlers = n;
+        dlclose(dl);
+        return;
+    }
+
+    uwsc_log_info("Plugin '%s' loaded, %d handlers\n", path, nhandlers - n);
+}
+
+int plugin_init(struct ev_loop *loop, const char *dir)
+{
+    struct dirent *e;
+    char path[512];
+    DIR *d;
+    int i;
+
+    d = opendir(dir);
+    if (!d) {
+        uwsc_log_err("Open plugin dir '%s' failed: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    while ((e = readdir(d))) {
+        int len = strlen(e->d_name);
+
+        if (len < 4 || strcmp(e->d_name + len - 3, ".so"))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        load_plugin(path);
+    }
+
+    closedir(d);
+
+    ev_async_init(&done_watcher, done_cb);
+    ev_async_start(loop, &done_watcher);
+
+    for (i = 0; i < nhandlers; i++) {
+        if (handlers[i].flags & RTTY_PLUGIN_THREAD) {
+            start_workers(loop);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+bool plugin_run(struct uwsc_client *ws, const char *type, const json_value *msg)
+{
+    struct rtty_plugin_req *req;
+    struct plugin_handler *h = NULL;
+    int i;
+
+    for (i = 0; i < nhandlers; i++) {
+        if (!strcmp(type, handlers[i].type)) {
+            h = &handlers[i];
+            break;
+        }
+    }
+
+    if (!h)
+        return false;
+
+    req = calloc(1, sizeof(struct rtty_plugin_req));
+    if (!req) {
+        json_value_free((json_value *)msg);
+        return true;
+    }
+
+    req->h = h;
+    req->ws = ws;
+    req->msg = msg;
+    ws_hold(ws);
+    req->attrs = json_get_value(msg, "attrs");
+    req->id = json_get_int(msg, "id") & 0xffff;
+
+    if (!auth_req(req)) {
+        req->err = RTTY_CMD_ERR_PERMIT;
+        send_reply(req);
+        free_req(req);
+        return true;
+    }
+
+    if ((h->flags & RTTY_PLUGIN_THREAD) && workers_started) {
+        pthread_mutex_lock(&lock);
+        list_add_tail(&req->list, &pending);
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+        return true;
+    }
+
+    run_req(req);
+    send_reply(req);
+    free_req(req);
+
+    return true;
+}
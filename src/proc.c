@@ -0,0 +1,410 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <signal.h>
+#include <uwsc/log.h>
+
+#include "proc.h"
+#include "utils.h"
+#include "command.h"
+#include "bulk.h"
+
+struct proc_stat {
+    int pid;
+    int ppid;
+    char state;
+    char comm[64];
+    unsigned long long utime;
+    unsigned long long stime;
+    unsigned long long starttime;
+    unsigned long vsize;
+    long rss;
+    int nthreads;
+    int uid;
+};
+
+/* The previous sample of each pid looked at, sorted by pid */
+struct cpu_sample {
+    int pid;
+    unsigned long long starttime;   /* Tells a reused pid apart */
+    unsigned long long ticks;
+    double when;
+    double cpu;
+};
+
+static struct cpu_sample *samples;
+static int nsamples, samples_cap;
+
+static int read_file(const char *path, char *buf, int len)
+{
+    int fd, n;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    n = read(fd, buf, len - 1);
+    close(fd);
+
+    if (n < 0)
+        return -1;
+
+    buf[n] = '\0';
+    return n;
+}
+
+static int read_stat(int pid, struct proc_stat *ps)
+{
+    char path[64], buf[1024];
+    char *start, *end;
+    struct stat st;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if (read_file(path, buf, sizeof(buf)) < 0)
+        return -1;
+
+    /* comm may contain spaces and parentheses */
+    start = strchr(buf, '(');
+    end = strrchr(buf, ')');
+    if (!start || !end || end < start)
+        return -1;
+
+    memset(ps, 0, sizeof(struct proc_stat));
+
+    ps->pid = pid;
+    snprintf(ps->comm, sizeof(ps->comm), "%.*s", (int)(end - start - 1), start + 1);
+
+    if (sscanf(end + 2, "%c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %d %*d %llu %lu %ld",
+        &ps->state, &ps->ppid, &ps->utime, &ps->stime, &ps->nthreads, &ps->starttime,
+        &ps->vsize, &ps->rss) != 8)
+        return -1;
+
+    snprintf(path, sizeof(path), "/proc/%d", pid);
+    ps->uid = stat(path, &st) ? -1 : st.st_uid;
+
+    return 0;
+}
+
+static double uptime()
+{
+    char buf[64];
+
+    if (read_file("/proc/uptime", buf, sizeof(buf)) < 0)
+        return 0;
+
+    return atof(buf);
+}
+
+static int cmp_sample(const void *key, const void *elem)
+{
+    return *(const int *)key - ((const struct cpu_sample *)elem)->pid;
+}
+
+static void expire_samples(double now)
+{
+    int i, n = 0;
+
+    for (i = 0; i < nsamples; i++) {
+        if (now - samples[i].when <= RTTY_PROC_SAMPLE_TTL)
+            samples[n++] = samples[i];
+    }
+
+    nsamples = n;
+}
+
+static struct cpu_sample *get_sample(int pid)
+{
+    struct cpu_sample *s = bsearch(&pid, samples, nsamples, sizeof(struct cpu_sample), cmp_sample);
+    int i;
+
+    if (s)
+        return s;
+
+    if (nsamples == samples_cap) {
+        int cap = samples_cap ? samples_cap * 2 : 256;
+
+        s = realloc(samples, cap * sizeof(struct cpu_sample));
+        if (!s)
+            return NULL;
+        samples = s;
+        samples_cap = cap;
+    }
+
+    for (i = nsamples; i > 0 && samples[i - 1].pid > pid; i--)
+        ;
+
+    memmove(samples + i + 1, samples + i, (nsamples - i) * sizeof(struct cpu_sample));
+    nsamples++;
+
+    s = &samples[i];
+    memset(s, 0, sizeof(struct cpu_sample));
+    s->pid = pid;
+
+    return s;
+}
+
+/*
+ * Percent of a CPU used since the previous sample of the pid. The first
+ * time a pid is seen there is none, so it's the average over its lifetime.
+ */
+static double cpu_usage(struct proc_stat *ps, double now, long hz)
+{
+    unsigned long long ticks = ps->utime + ps->stime;
+    struct cpu_sample *s = get_sample(ps->pid);
+    double elapsed;
+
+    if (s && s->when && s->starttime == ps->starttime) {
+        /* Too short to tell, keep what was computed last */
+        if (now - s->when < RTTY_PROC_MIN_INTERVAL)
+            return s->cpu;
+
+        elapsed = now - s->when;
+        ticks -= s->ticks;
+    } else {
+        elapsed = now - (double)ps->starttime / hz;
+    }
+
+    if (!s)
+        return elapsed > 0 ? (double)ticks / hz * 100 / elapsed : 0.0;
+
+    s->cpu = elapsed > 0 ? (double)ticks / hz * 100 / elapsed : 0.0;
+    s->starttime = ps->starttime;
+    s->ticks = ps->utime + ps->stime;
+    s->when = now;
+
+    return s->cpu;
+}
+
+static void put_proc(struct buffer *b, struct proc_stat *ps, double now)
+{
+    static long hz, pagesize;
+    double cpu;
+
+    if (!hz) {
+        hz = sysconf(_SC_CLK_TCK);
+        pagesize = sysconf(_SC_PAGESIZE);
+    }
+
+    cpu = (double)(ps->utime + ps->stime) / hz;
+
+    buffer_put_printf(b, "{\"pid\":%d,\"ppid\":%d,\"uid\":%d,\"state\":\"%c\",\"name\":",
+        ps->pid, ps->ppid, ps->uid, ps->state);
+    buffer_put_json_string(b, ps->comm, strlen(ps->comm));
+    buffer_put_printf(b, ",\"threads\":%d,\"cputime\":%.2f,\"cpu\":%.1f,\"vsz\":%lu,\"rss\":%ld}",
+        ps->nthreads, cpu, cpu_usage(ps, now, hz),
+        ps->vsize / 1024, ps->rss * pagesize / 1024);
+}
+
+static int cmp_pid(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Returns the number of pids, sorted */
+static int list_pids(int **pids)
+{
+    struct dirent *e;
+    int n = 0, cap = 0;
+    int *tmp;
+    DIR *dir;
+
+    *pids = NULL;
+
+    dir = opendir("/proc");
+    if (!dir)
+        return -1;
+
+    while ((e = readdir(dir))) {
+        if (!isdigit(e->d_name[0]))
+            continue;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            tmp = realloc(*pids, cap * sizeof(int));
+            if (!tmp)
+                break;
+            *pids = tmp;
+        }
+
+        (*pids)[n++] = atoi(e->d_name);
+    }
+
+    closedir(dir);
+
+    qsort(*pids, n, sizeof(int), cmp_pid);
+
+    return n;
+}
+
+static int proc_list(struct buffer *b, const json_value *attrs)
+{
+    int offset = json_get_int(attrs, "offset");
+    int limit = json_get_int(attrs, "limit");
+    double now = uptime();
+    struct proc_stat ps;
+    int i, n, count = 0;
+    int *pids;
+
+    if (limit <= 0)
+        limit = RTTY_PROC_PAGE_SIZE;
+    if (limit > RTTY_PROC_MAX_PAGE)
+        limit = RTTY_PROC_MAX_PAGE;
+    if (offset < 0)
+        offset = 0;
+
+    n = list_pids(&pids);
+    if (n < 0)
+        return RTTY_CMD_ERR_SYSERR;
+
+    expire_samples(now);
+
+    buffer_put_printf(b, "\"total\":%d,\"offset\":%d,\"procs\":[", n, offset);
+
+    for (i = offset; i < n && count < limit; i++) {
+        /* Gone in the meantime */
+        if (read_stat(pids[i], &ps) < 0)
+            continue;
+
+        if (count++)
+            buffer_put_u8(b, ',');
+        put_proc(b, &ps, now);
+    }
+
+    buffer_put_printf(b, "],\"more\":%s", i < n ? "true" : "false");
+
+    free(pids);
+
+    return 0;
+}
+
+static int proc_info(struct buffer *b, const json_value *attrs)
+{
+    int pid = json_get_int(attrs, "pid");
+    char path[64], buf[4096];
+    struct proc_stat ps;
+    struct dirent *e;
+    int i, len, nfd = 0;
+    DIR *dir;
+
+    if (pid <= 0 || read_stat(pid, &ps) < 0)
+        return RTTY_CMD_ERR_NOT_FOUND;
+
+    buffer_put_printf(b, "\"proc\":");
+    put_proc(b, &ps, uptime());
+
+    /* Arguments are separated by '\0' */
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+    len = read_file(path, buf, sizeof(buf));
+    for (i = 0; i < len; i++) {
+        if (buf[i] == '\0')
+            buf[i] = ' ';
+    }
+
+    buffer_put_printf(b, ",\"cmdline\":");
+    buffer_put_json_string(b, buf, len > 0 ? len : 0);
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    dir = opendir(path);
+    if (dir) {
+        while ((e = readdir(dir))) {
+            if (e->d_name[0] != '.')
+                nfd++;
+        }
+        closedir(dir);
+    }
+
+    buffer_put_printf(b, ",\"fds\":%d,\"status\":", nfd);
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    len = read_file(path, buf, sizeof(buf));
+    buffer_put_json_string(b, buf, len > 0 ? len : 0);
+
+    return 0;
+}
+
+static int proc_kill(struct buffer *b, const json_value *attrs)
+{
+    int pid = json_get_int(attrs, "pid");
+    int sig = json_get_int(attrs, "signal");
+
+    if (!json_get_value(attrs, "signal"))
+        sig = SIGTERM;
+
+    /* Never signal process groups or ourselves */
+    if (pid <= 1 || pid == getpid())
+        return RTTY_CMD_ERR_PERMIT;
+
+    if (kill(pid, sig) < 0)
+        return errno == ESRCH ? RTTY_CMD_ERR_NOT_FOUND : RTTY_CMD_ERR_SYSERR;
+
+    buffer_put_printf(b, "\"pid\":%d,\"signal\":%d", pid, sig);
+
+    return 0;
+}
+
+void run_proc(struct uwsc_client *ws, const json_value *msg)
+{
+    const json_value *attrs = json_get_value(msg, "attrs");
+    const char *username = json_get_string(attrs, "username");
+    const char *password = json_get_string(attrs, "password");
+    const char *op = json_get_string(attrs, "op");
+    struct buffer b = {};
+    int err;
+
+    buffer_put_printf(&b, "{\"type\":\"proc\",\"token\":");
+    buffer_put_json_string(&b, json_get_string(msg, "token"), strlen(json_get_string(msg, "token")));
+    buffer_put_printf(&b, ",\"attrs\":{");
+
+    if (!username[0] || !login_test(username, password))
+        err = RTTY_CMD_ERR_PERMIT;
+    else if (!strcmp(op, "list"))
+        err = proc_list(&b, attrs);
+    else if (!strcmp(op, "info"))
+        err = proc_info(&b, attrs);
+    else if (!strcmp(op, "kill"))
+        err = proc_kill(&b, attrs);
+    else
+        err = RTTY_CMD_ERR_INVALID;
+
+    if (err) {
+        buffer_free(&b);
+        buffer_put_printf(&b, "{\"type\":\"proc\",\"token\":\"%s\",\"attrs\":{\"err\":%d,\"msg\":\"%s\"",
+            json_get_string(msg, "token"), err, cmderr2str(err));
+    }
+
+    buffer_put_printf(&b, "}}");
+
+    bulk_send(ws, buffer_data(&b), buffer_length(&b), UWSC_OP_TEXT);
+
+    buffer_free(&b);
+    json_value_free((json_value *)msg);
+}
@@ -0,0 +1,44 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _PROC_H
+#define _PROC_H
+
+#include <uwsc/uwsc.h>
+
+#include "json.h"
+
+#define RTTY_PROC_PAGE_SIZE     100     /* Default number of processes per reply */
+#define RTTY_PROC_MAX_PAGE      500
+#define RTTY_PROC_MIN_INTERVAL  1       /* Seconds between the cpu samples of a pid */
+#define RTTY_PROC_SAMPLE_TTL    300     /* Seconds a sample is kept without being looked at */
+
+/*
+ * Native process operations read from /proc, so process triage doesn't
+ * spawn ps/top/kill. attrs.op is "list"(paginated by offset/limit),
+ * "info"(one pid) or "kill"(pid, signal).
+ */
+void run_proc(struct uwsc_client *ws, const json_value *msg);
+
+#endif
@@ -0,0 +1,389 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <uwsc/log.h>
+
+#include "config.h"
+#include "profiler.h"
+#include "command.h"
+#include "utils.h"
+#include "bulk.h"
+
+#ifdef RTTY_PROFILER
+
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <ucontext.h>
+
+struct prof_sample {
+    int depth;
+    uintptr_t pc[RTTY_PROF_MAX_DEPTH];  /* Innermost first */
+};
+
+static struct prof_sample *samples;
+static volatile int nsamples;
+static volatile bool running;
+static int lost;
+static struct sigaction saved_sa;   /* SIGPROF before prof_start() */
+
+/* Of the current thread, 0 until profiler_thread_init() */
+static __thread uintptr_t stack_lo, stack_hi;
+
+void profiler_thread_init()
+{
+    pthread_attr_t attr;
+    size_t size;
+    void *addr;
+
+    if (stack_hi || pthread_getattr_np(pthread_self(), &attr))
+        return;
+
+    if (!pthread_attr_getstack(&attr, &addr, &size)) {
+        stack_lo = (uintptr_t)addr;
+        stack_hi = (uintptr_t)addr + size;
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+/* Interrupted pc, frame pointer and stack pointer */
+static bool context_regs(void *uc, uintptr_t *pc, uintptr_t *fp, uintptr_t *sp)
+{
+    mcontext_t *mc = &((ucontext_t *)uc)->uc_mcontext;
+
+#if defined(__x86_64__)
+    *pc = mc->gregs[REG_RIP];
+    *fp = mc->gregs[REG_RBP];
+    *sp = mc->gregs[REG_RSP];
+#elif defined(__i386__)
+    *pc = mc->gregs[REG_EIP];
+    *fp = mc->gregs[REG_EBP];
+    *sp = mc->gregs[REG_ESP];
+#elif defined(__aarch64__)
+    *pc = mc->pc;
+    *fp = mc->regs[29];
+    *sp = mc->sp;
+#elif defined(__arm__)
+    *pc = mc->arm_pc;
+    *fp = mc->arm_fp;
+    *sp = mc->arm_sp;
+#else
+    (void)mc;
+    return false;
+#endif
+
+    return true;
+}
+
+/*
+ * Follow the frame pointer chain: each frame starts with the caller's
+ * frame pointer followed by the return address. Code without frame
+ * pointers(OpenSSL, zlib, libc assembly) uses the register for anything,
+ * so a frame is only read if it lies between the interrupted sp and the
+ * top of the thread's stack, and frames must move up the stack.
+ */
+static void prof_handler(int sig, siginfo_t *info, void *uc)
+{
+    struct prof_sample *s;
+    uintptr_t pc, fp, sp, next, lo, hi = stack_hi;
+    int n;
+
+    if (!running)
+        return;
+
+    n = __sync_fetch_and_add(&nsamples, 1);
+    if (n >= RTTY_PROF_MAX_SAMPLES) {
+        nsamples = RTTY_PROF_MAX_SAMPLES;
+        lost++;
+        return;
+    }
+
+    s = &samples[n];
+    s->depth = 0;
+
+    if (!context_regs(uc, &pc, &fp, &sp))
+        return;
+
+    s->pc[s->depth++] = pc;
+
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+    lo = sp > stack_lo ? sp : stack_lo;
+
+    /* hi is 0 if the thread's bounds are unknown, then only pc is recorded */
+    while (s->depth < RTTY_PROF_MAX_DEPTH && fp >= lo && fp < hi && hi - fp >= 2 * sizeof(uintptr_t) &&
+        !(fp & (sizeof(uintptr_t) - 1))) {
+        next = ((uintptr_t *)fp)[0];
+        pc = ((uintptr_t *)fp)[1];
+
+        if (!pc)
+            break;
+
+        s->pc[s->depth++] = pc - 1;     /* Inside the call instruction */
+
+        if (next <= fp)
+            break;
+        fp = next;
+    }
+#else
+    (void)next;
+    (void)lo;
+    (void)hi;
+    (void)sp;
+#endif
+}
+
+static int prof_start(int hz)
+{
+    struct itimerval it = {};
+    struct sigaction sa = {};
+
+    if (running)
+        return RTTY_CMD_ERR_SYSERR;
+
+    if (!samples) {
+        samples = calloc(RTTY_PROF_MAX_SAMPLES, sizeof(struct prof_sample));
+        if (!samples)
+            return RTTY_CMD_ERR_NOMEM;
+    }
+
+    if (hz <= 0)
+        hz = RTTY_PROF_HZ;
+    if (hz > RTTY_PROF_MAX_HZ)
+        hz = RTTY_PROF_MAX_HZ;
+
+    nsamples = 0;
+    lost = 0;
+
+    sa.sa_sigaction = prof_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, &saved_sa);
+
+    profiler_thread_init();
+
+    running = true;
+
+    it.it_interval.tv_usec = 1000000 / hz;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF, &it, NULL);
+
+    uwsc_log_info("Profiler started at %d Hz\n", hz);
+
+    return 0;
+}
+
+static void prof_stop()
+{
+    struct itimerval it = {};
+
+    setitimer(ITIMER_PROF, &it, NULL);
+    running = false;
+
+    /* An ignored SIGPROF would be inherited by every session and command started later */
+    sigaction(SIGPROF, &saved_sa, NULL);
+}
+
+static int cmp_sample(const void *a, const void *b)
+{
+    const struct prof_sample *sa = a, *sb = b;
+    int i;
+
+    for (i = 0; i < sa->depth && i < sb->depth; i++) {
+        if (sa->pc[i] != sb->pc[i])
+            return sa->pc[i] < sb->pc[i] ? -1 : 1;
+    }
+
+    return sa->depth - sb->depth;
+}
+
+/*
+ * Name of the function at pc. Static functions are not in the dynamic
+ * symbol table, so the size of the nearest symbol is checked where libc
+ * allows it and the module offset is used otherwise, for addr2line.
+ */
+static void put_frame(struct buffer *b, uintptr_t pc)
+{
+    const char *module;
+    Dl_info info;
+
+#ifdef __GLIBC__
+    const ElfW(Sym) *sym = NULL;
+
+    if (!dladdr1((void *)pc, &info, (void **)&sym, RTLD_DL_SYMENT))
+        goto unknown;
+
+    if (info.dli_sname && sym && pc < (uintptr_t)info.dli_saddr + sym->st_size) {
+        buffer_put_string(b, info.dli_sname);
+        return;
+    }
+#else
+    if (!dladdr((void *)pc, &info))
+        goto unknown;
+#endif
+
+    module = info.dli_fname ? strrchr(info.dli_fname, '/') : NULL;
+    module = module ? module + 1 : info.dli_fname;
+
+    buffer_put_printf(b, "%s+0x%lx", module ? module : "?",
+        (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+    return;
+
+unknown:
+    buffer_put_printf(b, "0x%lx", (unsigned long)pc);
+}
+
+struct prof_stack {
+    char *frames;
+    int count;
+};
+
+static int cmp_stack(const void *a, const void *b)
+{
+    return strcmp(((const struct prof_stack *)a)->frames, ((const struct prof_stack *)b)->frames);
+}
+
+/*
+ * One line per distinct stack: outermost;...;innermost count. Different
+ * pcs in the same functions resolve to the same line, so stacks are
+ * merged again after symbolization.
+ */
+static void prof_fold(struct buffer *b)
+{
+    struct prof_stack *stacks;
+    struct buffer line = {};
+    int i, j, count, n = 0;
+
+    qsort(samples, nsamples, sizeof(struct prof_sample), cmp_sample);
+
+    stacks = calloc(nsamples, sizeof(struct prof_stack));
+    if (!stacks)
+        return;
+
+    for (i = 0; i < nsamples; i += count) {
+        for (count = 1; i + count < nsamples; count++) {
+            if (cmp_sample(&samples[i], &samples[i + count]))
+                break;
+        }
+
+        if (!samples[i].depth)
+            continue;
+
+        for (j = samples[i].depth - 1; j >= 0; j--) {
+            put_frame(&line, samples[i].pc[j]);
+            buffer_put_u8(&line, j ? ';' : '\0');
+        }
+
+        stacks[n].frames = strdup(buffer_data(&line));
+        stacks[n].count = count;
+        buffer_pull(&line, NULL, buffer_length(&line));
+
+        if (stacks[n].frames)
+            n++;
+    }
+
+    qsort(stacks, n, sizeof(struct prof_stack), cmp_stack);
+
+    for (i = 0; i < n; i = j) {
+        count = 0;
+        for (j = i; j < n && !strcmp(stacks[i].frames, stacks[j].frames); j++)
+            count += stacks[j].count;
+
+        buffer_put_printf(b, "%s %d\n", stacks[i].frames, count);
+    }
+
+    for (i = 0; i < n; i++)
+        free(stacks[i].frames);
+    free(stacks);
+    buffer_free(&line);
+}
+
+void run_profile(struct uwsc_client *ws, const json_value *msg)
+{
+    const json_value *attrs = json_get_value(msg, "attrs");
+    const char *username = json_get_string(attrs, "username");
+    const char *password = json_get_string(attrs, "password");
+    const char *token = json_get_string(msg, "token");
+    const char *op = json_get_string(attrs, "op");
+    struct buffer folded = {};
+    struct buffer b = {};
+    int err = 0;
+
+    if (!username[0] || !login_test(username, password)) {
+        err = RTTY_CMD_ERR_PERMIT;
+    } else if (!strcmp(op, "start")) {
+        err = prof_start(json_get_int(attrs, "hz"));
+    } else if (!strcmp(op, "stop")) {
+        if (running) {
+            prof_stop();
+            prof_fold(&folded);
+        } else {
+            err = RTTY_CMD_ERR_NOT_FOUND;
+        }
+    } else {
+        err = RTTY_CMD_ERR_INVALID;
+    }
+
+    buffer_put_printf(&b, "{\"type\":\"profile\",\"token\":\"%s\",\"attrs\":{", token);
+
+    if (err) {
+        buffer_put_printf(&b, "\"err\":%d,\"msg\":\"%s\"}}", err, cmderr2str(err));
+    } else {
+        buffer_put_printf(&b, "\"code\":0,\"samples\":%d,\"lost\":%d,\"folded\":", nsamples, lost);
+        buffer_put_json_string(&b, buffer_data(&folded), buffer_length(&folded));
+        buffer_put_printf(&b, "}}");
+    }
+
+    bulk_send(ws, buffer_data(&b), buffer_length(&b), UWSC_OP_TEXT);
+
+    buffer_free(&folded);
+    buffer_free(&b);
+    json_value_free((json_value *)msg);
+}
+
+#else
+
+void profiler_thread_init()
+{
+}
+
+void run_profile(struct uwsc_client *ws, const json_value *msg)
+{
+    char str[256] = "";
+
+    snprintf(str, sizeof(str) - 1, "{\"type\":\"profile\",\"token\":\"%s\","
+        "\"attrs\":{\"err\":%d,\"msg\":\"%s\"}}", json_get_string(msg, "token"),
+        RTTY_CMD_ERR_NOT_SUPPORTED, cmderr2str(RTTY_CMD_ERR_NOT_SUPPORTED));
+    ws->send(ws, str, strlen(str), UWSC_OP_TEXT);
+
+    json_value_free((json_value *)msg);
+}
+
+#endif
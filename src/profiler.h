@@ -0,0 +1,51 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _PROFILER_H
+#define _PROFILER_H
+
+#include <uwsc/uwsc.h>
+
+#include "json.h"
+
+#define RTTY_PROF_HZ            99
+#define RTTY_PROF_MAX_HZ        1000
+#define RTTY_PROF_MAX_SAMPLES   20000
+#define RTTY_PROF_MAX_DEPTH     32
+
+/*
+ * Built-in sampling profiler(cmake -DRTTY_PROFILER=ON). attrs.op "start"
+ * begins sampling with SIGPROF at attrs.hz, "stop" replies with the
+ * samples as folded stacks, ready for flamegraph.pl.
+ */
+void run_profile(struct uwsc_client *ws, const json_value *msg);
+
+/*
+ * Caches the stack bounds of the calling thread, call it first thing in a
+ * thread. The signal handler can't look them up and only walks the stacks
+ * of threads that did. The loop thread is done when sampling starts.
+ */
+void profiler_thread_init();
+
+#endif
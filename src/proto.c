@@ -0,0 +1,157 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <uwsc/log.h>
+
+#include "proto.h"
+
+#define RTTY_LOCAL_FEATURES (RTTY_FEAT_FRAME_V2 | RTTY_FEAT_SEQ | RTTY_FEAT_OBSERVE | RTTY_FEAT_BULK | \
+    RTTY_FEAT_CHANNEL | RTTY_FEAT_PLUGIN)
+
+uint32_t proto_features;
+
+static int proto_version = 1;
+
+/* Sent right after the connection is opened */
+void proto_hello(struct uwsc_client *cl)
+{
+    char str[128] = "";
+
+    snprintf(str, sizeof(str) - 1, "{\"type\":\"hello\",\"version\":%d,\"features\":%u}",
+        RTTY_PROTO_VERSION, RTTY_LOCAL_FEATURES);
+    cl->send(cl, str, strlen(str), UWSC_OP_TEXT);
+}
+
+/* An older server never answers, so we stay at version 1 without features */
+void proto_on_hello(const json_value *msg)
+{
+    int version = json_get_int(msg, "version");
+
+    if (version < 1) {
+        uwsc_log_err("Ignore hello with invalid version %d\n", version);
+        return;
+    }
+
+    proto_version = version < RTTY_PROTO_VERSION ? version : RTTY_PROTO_VERSION;
+    proto_features = (uint32_t)json_get_int(msg, "features") & RTTY_LOCAL_FEATURES;
+
+    if (proto_version < 2)
+        proto_features &= ~RTTY_FEAT_FRAME_V2;
+
+    uwsc_log_info("Protocol version %d, features 0x%x\n", proto_version, proto_features);
+}
+
+void proto_reset()
+{
+    proto_version = 1;
+    proto_features = 0;
+}
+
+int proto_frame_header(uint8_t *data, int type, int sid, int flags, uint32_t seq)
+{
+    uint8_t *hdr;
+    int hdrlen;
+
+    if (!proto_has(RTTY_FEAT_FRAME_V2)) {
+        if (flags & RTTY_FRAME_FLAG_SEQ) {
+            seq = htonl(seq);
+            memcpy(data - 4, &seq, 4);
+            data[-5] = sid;
+            return 5;
+        }
+
+        data[-1] = sid;
+        return 1;
+    }
+
+    hdrlen = RTTY_FRAME_V2_HDRLEN;
+    if (flags & RTTY_FRAME_FLAG_SEQ)
+        hdrlen += 4;
+
+    hdr = data - hdrlen;
+    hdr[0] = proto_version;
+    hdr[1] = type;
+    hdr[2] = flags;
+    hdr[3] = hdrlen;
+    hdr[4] = sid >> 8;
+    hdr[5] = sid & 0xff;
+
+    if (flags & RTTY_FRAME_FLAG_SEQ) {
+        seq = htonl(seq);
+        memcpy(hdr + RTTY_FRAME_V2_HDRLEN, &seq, 4);
+    }
+
+    return hdrlen;
+}
+
+int proto_frame_parse(uint8_t *data, int len, struct rtty_frame *f, bool (*legacy_seq)(int sid))
+{
+    int hdrlen;
+
+    memset(f, 0, sizeof(struct rtty_frame));
+
+    if (!proto_has(RTTY_FEAT_FRAME_V2)) {
+        if (len < 1)
+            return -1;
+
+        f->sid = data[0];
+        hdrlen = 1;
+
+        if (legacy_seq(f->sid)) {
+            if (len < 5)
+                return -1;
+            f->flags = RTTY_FRAME_FLAG_SEQ;
+            memcpy(&f->seq, data + 1, 4);
+            f->seq = ntohl(f->seq);
+            hdrlen = 5;
+        }
+    } else {
+        if (len < RTTY_FRAME_V2_HDRLEN || data[3] < RTTY_FRAME_V2_HDRLEN || data[3] > len)
+            return -1;
+
+        /* The layout after the version byte is only known for the negotiated one */
+        if (data[0] != proto_version)
+            return -1;
+
+        f->type = data[1];
+        f->flags = data[2];
+        f->sid = (data[4] << 8) | data[5];
+        hdrlen = data[3];
+
+        if (f->flags & RTTY_FRAME_FLAG_SEQ) {
+            if (hdrlen < RTTY_FRAME_V2_HDRLEN + 4)
+                return -1;
+            memcpy(&f->seq, data + RTTY_FRAME_V2_HDRLEN, 4);
+            f->seq = ntohl(f->seq);
+        }
+    }
+
+    f->data = data + hdrlen;
+    f->len = len - hdrlen;
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _PROTO_H
+#define _PROTO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <uwsc/uwsc.h>
+
+#include "json.h"
+
+#define RTTY_PROTO_VERSION      2
+
+/* Feature bits exchanged in the "hello" message */
+#define RTTY_FEAT_FRAME_V2      (1 << 0)    /* Versioned binary frame header */
+#define RTTY_FEAT_SEQ           (1 << 1)    /* Input/echo sequence numbers */
+#define RTTY_FEAT_OBSERVE       (1 << 2)    /* Read-only session observers */
+#define RTTY_FEAT_BULK          (1 << 3)    /* Secondary bulk connection */
+#define RTTY_FEAT_CHANNEL       (1 << 4)    /* Channel frames of local agents */
+#define RTTY_FEAT_PLUGIN        (1 << 5)    /* Binary replies of plugin handlers */
+
+/*
+ * Binary frame header once RTTY_FEAT_FRAME_V2 is negotiated:
+ *
+ *   0         1        2        3        4 - 5
+ *   version   type     flags    hdrlen   sid(big endian)   [extensions]   payload
+ *
+ * hdrlen is the length of the whole header, so a receiver can skip
+ * extensions it does not know. Extensions appear in the order of their
+ * flag bits. version is the negotiated one, a frame of another version is
+ * dropped. Without the feature a frame is a one-byte sid and the payload.
+ */
+#define RTTY_FRAME_V2_HDRLEN    6
+#define RTTY_FRAME_MAX_HDRLEN   (RTTY_FRAME_V2_HDRLEN + 4)
+
+enum {
+    RTTY_FRAME_DATA,
+    RTTY_FRAME_CHANNEL,     /* sid is a channel id of the local bridge */
+    RTTY_FRAME_REPLY        /* sid is the id of a request to a plugin */
+};
+
+#define RTTY_FRAME_FLAG_SEQ     (1 << 0)    /* 4 bytes: seq(input) or acked seq(output) */
+
+struct rtty_frame {
+    int type;
+    int flags;
+    int sid;
+    uint32_t seq;
+    uint8_t *data;
+    int len;
+};
+
+extern uint32_t proto_features;     /* Negotiated for the current connection */
+
+static inline bool proto_has(uint32_t feat)
+{
+    return (proto_features & feat) == feat;
+}
+
+void proto_hello(struct uwsc_client *cl);
+
+void proto_on_hello(const json_value *msg);
+
+void proto_reset();
+
+/*
+ * Write the header of a frame in front of data, which must have at least
+ * RTTY_FRAME_MAX_HDRLEN bytes of headroom. Returns the header length.
+ * Legacy frames can only be of type RTTY_FRAME_DATA.
+ */
+int proto_frame_header(uint8_t *data, int type, int sid, int flags, uint32_t seq);
+
+/* legacy_seq tells whether a legacy frame carries a seq after the sid */
+int proto_frame_parse(uint8_t *data, int len, struct rtty_frame *f, bool (*legacy_seq)(int sid));
+
+#endif
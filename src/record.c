@@ -0,0 +1,572 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <uwsc/log.h>
+#include <uwsc/buffer.h>
+
+#include "list.h"
+#include "config.h"
+#include "record.h"
+#include "tune.h"
+#include "alloc.h"
+#include "profiler.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+struct record_event {
+    double ts;          /* Relative to the start of the session */
+    uint32_t len;
+    uint8_t type;
+} __attribute__((packed));
+
+struct record {
+    struct list_head list;
+    int sid;
+    ev_tstamp start;
+    struct buffer b;    /* Events not yet handed over to the writer */
+
+    /* Owned by the writer thread */
+    struct list_head open;      /* On open_records while a file is open */
+    char path[512];
+    int cols, rows;             /* For the header of the next part */
+    uint8_t carry[2][4];        /* Incomplete UTF-8 at the end of the last output/input event */
+    int ncarry[2];
+    int part;
+    size_t size;
+    FILE *fp;
+#ifdef HAVE_ZLIB
+    gzFile gz;
+#endif
+};
+
+struct record_chunk {
+    struct list_head list;
+    struct record *r;
+    bool close;
+    struct buffer b;
+};
+
+static struct ev_loop *record_loop;
+static struct ev_timer flush_timer;
+static const char *record_dir;
+static bool record_compress;
+static LIST_HEAD(records);
+
+static pthread_t writer;
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chunk_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(chunks);
+static LIST_HEAD(open_records);     /* Owned by the writer thread */
+
+static void record_write(struct record *r, const void *data, size_t len)
+{
+#ifdef HAVE_ZLIB
+    if (r->gz) {
+        gzwrite(r->gz, data, len);
+        r->size += len;
+        return;
+    }
+#endif
+
+    if (fwrite(data, 1, len, r->fp) != len)
+        uwsc_log_err("Write record failed: %s\n", strerror(errno));
+    r->size += len;
+}
+
+static void record_printf(struct record *r, const char *fmt, ...)
+{
+    char str[256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(str, sizeof(str), fmt, ap);
+    va_end(ap);
+
+    if (len >= sizeof(str))
+        len = sizeof(str) - 1;
+
+    record_write(r, str, len);
+}
+
+static void record_write_escaped(struct record *r, uint8_t c)
+{
+    static const char hex[] = "0123456789abcdef";
+    char esc[6] = {'\\', 'u', '0', '0'};
+
+    esc[4] = hex[c >> 4];
+    esc[5] = hex[c & 0xf];
+    record_write(r, esc, 6);
+}
+
+/* Length of the valid UTF-8 sequence at p, 0 if it's cut short by the end, -1 if invalid */
+static int utf8_check(const uint8_t *p, size_t len)
+{
+    uint8_t lo = 0x80, hi = 0xbf;
+    int n, i;
+
+    if (p[0] < 0x80)
+        return 1;
+
+    if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+        n = 2;
+    } else if (p[0] >= 0xe0 && p[0] <= 0xef) {
+        n = 3;
+        if (p[0] == 0xe0)
+            lo = 0xa0;      /* Overlong */
+        else if (p[0] == 0xed)
+            hi = 0x9f;      /* Surrogates */
+    } else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+        n = 4;
+        if (p[0] == 0xf0)
+            lo = 0x90;      /* Overlong */
+        else if (p[0] == 0xf4)
+            hi = 0x8f;      /* Above U+10FFFF */
+    } else {
+        return -1;
+    }
+
+    for (i = 1; i < n; i++) {
+        if (i == len)
+            return 0;
+        if (p[i] < lo || p[i] > hi)
+            return -1;
+        lo = 0x80;
+        hi = 0xbf;
+    }
+
+    return n;
+}
+
+/*
+ * A JSON string must be valid UTF-8. A character split across two reads is
+ * carried over to the next event of the same stream, bytes that are not
+ * UTF-8 are written as \u00XX.
+ */
+static void record_write_string(struct record *r, int stream, const uint8_t *data, size_t len)
+{
+    uint8_t *carry = r->carry[stream];
+    int *ncarry = &r->ncarry[stream];
+    size_t i, start = 0;
+    int n;
+
+    if (*ncarry) {
+        uint8_t seq[4];
+        int take = len < 4 - *ncarry ? len : 4 - *ncarry;
+
+        memcpy(seq, carry, *ncarry);
+        memcpy(seq + *ncarry, data, take);
+
+        n = utf8_check(seq, *ncarry + take);
+        if (n == 0) {
+            memcpy(carry, seq, *ncarry + take);
+            *ncarry += take;
+            return;
+        }
+
+        if (n > 0) {
+            record_write(r, seq, n);
+            start = n - *ncarry;
+        } else {
+            for (i = 0; i < *ncarry; i++)
+                record_write_escaped(r, carry[i]);
+        }
+
+        *ncarry = 0;
+    }
+
+    for (i = start; i < len; i++) {
+        if (data[i] < 0x80) {
+            if (data[i] >= 0x20 && data[i] != '"' && data[i] != '\\')
+                continue;
+        } else {
+            n = utf8_check(data + i, len - i);
+            if (n > 0) {
+                i += n - 1;
+                continue;
+            }
+
+            if (n == 0) {
+                record_write(r, data + start, i - start);
+                *ncarry = len - i;
+                memcpy(carry, data + i, *ncarry);
+                return;
+            }
+        }
+
+        record_write(r, data + start, i - start);
+        start = i + 1;
+        record_write_escaped(r, data[i]);
+    }
+
+    record_write(r, data + start, len - start);
+}
+
+static void record_file_close(struct record *r)
+{
+#ifdef HAVE_ZLIB
+    if (r->gz) {
+        gzclose(r->gz);
+        r->gz = NULL;
+    }
+#endif
+
+    if (r->fp) {
+        fclose(r->fp);
+        r->fp = NULL;
+    }
+
+    if (r->path[0]) {
+        list_del(&r->open);
+        r->path[0] = '\0';
+    }
+}
+
+static int record_file_open(struct record *r)
+{
+    char *path = r->path;
+
+    snprintf(path, sizeof(r->path), "%s/rtty-%u-%d-%d.cast%s", record_dir,
+        (unsigned int)r->start, r->sid, r->part, record_compress ? ".gz" : "");
+
+    r->fp = fopen(path, "w");
+    if (!r->fp) {
+        uwsc_log_err("Open record '%s' failed: %s\n", path, strerror(errno));
+        path[0] = '\0';
+        return -1;
+    }
+
+    /* Still written to, the quota leaves it alone */
+    list_add_tail(&r->open, &open_records);
+
+#ifdef HAVE_ZLIB
+    if (record_compress) {
+        char mode[] = "wb0";
+
+        mode[2] += tuning.compress_level;
+        r->gz = gzdopen(dup(fileno(r->fp)), mode);
+        fclose(r->fp);
+        r->fp = NULL;
+
+        if (!r->gz) {
+            uwsc_log_err("Open record '%s' failed\n", path);
+            return -1;
+        }
+    }
+#endif
+
+    r->size = 0;
+    record_printf(r, "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %u}\n",
+        r->cols, r->rows, (unsigned int)r->start);
+
+    return 0;
+}
+
+struct record_file {
+    char name[512];
+    time_t mtime;
+    off_t size;
+};
+
+static bool record_file_active(const char *path)
+{
+    struct record *r;
+
+    list_for_each_entry(r, &open_records, open) {
+        if (!strcmp(r->path, path))
+            return true;
+    }
+
+    return false;
+}
+
+static int record_cmp_mtime(const void *a, const void *b)
+{
+    const struct record_file *fa = a, *fb = b;
+
+    return fa->mtime - fb->mtime;
+}
+
+/* Delete the oldest recordings until the directory is within quota */
+static void record_enforce_quota()
+{
+    struct record_file *files = NULL, *tmp;
+    struct dirent *e;
+    struct stat st;
+    size_t total = 0;
+    int i, n = 0, cap = 0;
+    DIR *dir;
+
+    dir = opendir(record_dir);
+    if (!dir)
+        return;
+
+    while ((e = readdir(dir))) {
+        if (strncmp(e->d_name, "rtty-", 5) || !strstr(e->d_name, ".cast"))
+            continue;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            tmp = realloc(files, cap * sizeof(struct record_file));
+            if (!tmp)
+                goto done;
+            files = tmp;
+        }
+
+        snprintf(files[n].name, sizeof(files[n].name), "%s/%s", record_dir, e->d_name);
+        if (stat(files[n].name, &st) < 0)
+            continue;
+
+        /* Counts, but can't be deleted */
+        if (record_file_active(files[n].name)) {
+            total += st.st_size;
+            continue;
+        }
+
+        files[n].mtime = st.st_mtime;
+        files[n].size = st.st_size;
+        total += st.st_size;
+        n++;
+    }
+
+    if (total <= RTTY_RECORD_QUOTA)
+        goto done;
+
+    qsort(files, n, sizeof(struct record_file), record_cmp_mtime);
+
+    for (i = 0; i < n && total > RTTY_RECORD_QUOTA; i++) {
+        if (unlink(files[i].name) == 0)
+            total -= files[i].size;
+    }
+
+done:
+    closedir(dir);
+    free(files);
+}
+
+static void record_rotate(struct record *r)
+{
+    record_file_close(r);
+    record_enforce_quota();
+
+    r->part++;
+    record_file_open(r);
+}
+
+static void record_write_chunk(struct record_chunk *c)
+{
+    struct record *r = c->r;
+    struct buffer *b = &c->b;
+    struct record_event ev;
+    char size[32];
+
+    if (!r->fp
+#ifdef HAVE_ZLIB
+        && !r->gz
+#endif
+        && record_file_open(r) < 0) {
+        buffer_free(b);
+        return;
+    }
+
+    while (buffer_length(b) >= sizeof(ev)) {
+        buffer_pull(b, &ev, sizeof(ev));
+
+        if (buffer_length(b) < ev.len)
+            break;
+
+        /* Later parts start with the size at that point */
+        if (ev.type == RECORD_EV_RESIZE && ev.len < sizeof(size)) {
+            memcpy(size, buffer_data(b), ev.len);
+            size[ev.len] = '\0';
+            sscanf(size, "%dx%d", &r->cols, &r->rows);
+        }
+
+        record_printf(r, "[%.6f, \"%c\", \"", ev.ts, ev.type);
+        record_write_string(r, ev.type == RECORD_EV_INPUT, buffer_data(b), ev.len);
+        record_write(r, "\"]\n", 3);
+
+        buffer_pull(b, NULL, ev.len);
+
+        if (r->size > RTTY_RECORD_MAX_FILE)
+            record_rotate(r);
+    }
+
+    buffer_free(b);
+}
+
+static void *record_writer(void *arg)
+{
+    struct record_chunk *c;
+
+    profiler_thread_init();
+
+    while (1) {
+        pthread_mutex_lock(&chunk_lock);
+        while (list_empty(&chunks))
+            pthread_cond_wait(&chunk_cond, &chunk_lock);
+        c = list_first_entry(&chunks, struct record_chunk, list);
+        list_del(&c->list);
+        pthread_mutex_unlock(&chunk_lock);
+
+        record_write_chunk(c);
+
+        if (c->close) {
+            record_file_close(c->r);
+            record_enforce_quota();
+            rtty_free(c->r);
+        }
+
+        rtty_free(c);
+    }
+
+    return NULL;
+}
+
+/* Hand the buffered events over to the writer without copying them */
+static void record_flush(struct record *r, bool close)
+{
+    struct record_chunk *c;
+
+    if (!close && buffer_length(&r->b) == 0)
+        return;
+
+    c = rtty_calloc(RTTY_MEM_RECORD, 1, sizeof(struct record_chunk));
+    if (!c) {
+        buffer_free(&r->b);
+        return;
+    }
+
+    c->r = r;
+    c->close = close;
+    c->b = r->b;
+    memset(&r->b, 0, sizeof(r->b));
+
+    pthread_mutex_lock(&chunk_lock);
+    list_add_tail(&c->list, &chunks);
+    pthread_cond_signal(&chunk_cond);
+    pthread_mutex_unlock(&chunk_lock);
+}
+
+static void flush_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+    struct record *r;
+
+    list_for_each_entry(r, &records, list)
+        record_flush(r, false);
+}
+
+int record_init(struct ev_loop *loop, const char *dir, bool compress)
+{
+    struct stat st;
+
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        uwsc_log_err("Record directory '%s' is not a directory\n", dir);
+        return -1;
+    }
+
+#ifndef HAVE_ZLIB
+    if (compress) {
+        uwsc_log_err("Compressed recording is not supported: rtty was built without zlib\n");
+        return -1;
+    }
+#endif
+
+    if (pthread_create(&writer, NULL, record_writer, NULL)) {
+        uwsc_log_err("Create record writer failed\n");
+        return -1;
+    }
+    pthread_detach(writer);
+
+    record_loop = loop;
+    record_dir = dir;
+    record_compress = compress;
+
+    ev_timer_init(&flush_timer, flush_timer_cb, RTTY_RECORD_FLUSH_INTERVAL, RTTY_RECORD_FLUSH_INTERVAL);
+    ev_timer_start(loop, &flush_timer);
+
+    return 0;
+}
+
+struct record *record_open(int sid, int cols, int rows)
+{
+    struct record *r;
+
+    if (!record_dir)
+        return NULL;
+
+    r = rtty_calloc(RTTY_MEM_RECORD, 1, sizeof(struct record));
+    if (!r)
+        return NULL;
+
+    r->sid = sid;
+    r->start = ev_now(record_loop);
+    r->cols = cols > 0 ? cols : 80;
+    r->rows = rows > 0 ? rows : 24;
+
+    list_add_tail(&r->list, &records);
+
+    return r;
+}
+
+void record_event(struct record *r, int type, const void *data, int len)
+{
+    struct record_event ev = {
+        .ts = ev_now(record_loop) - r->start,
+        .type = type,
+        .len = len
+    };
+
+    buffer_put_data(&r->b, &ev, sizeof(ev));
+    buffer_put_data(&r->b, data, len);
+
+    if (buffer_length(&r->b) > RTTY_RECORD_BATCH_SIZE)
+        record_flush(r, false);
+}
+
+void record_resize(struct record *r, int cols, int rows)
+{
+    char str[32];
+    int len;
+
+    len = snprintf(str, sizeof(str), "%dx%d", cols, rows);
+    record_event(r, RECORD_EV_RESIZE, str, len);
+}
+
+void record_close(struct record *r)
+{
+    list_del(&r->list);
+    record_flush(r, true);
+}
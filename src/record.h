@@ -0,0 +1,61 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <ev.h>
+#include <stdbool.h>
+
+#define RTTY_RECORD_FLUSH_INTERVAL  1.0                 /* second */
+#define RTTY_RECORD_BATCH_SIZE      (64 * 1024)         /* Hand over to the writer early */
+#define RTTY_RECORD_MAX_FILE        (1024 * 1024)       /* Rotate after this many bytes */
+#define RTTY_RECORD_QUOTA           (16 * 1024 * 1024)  /* Total size of all recordings */
+
+enum {
+    RECORD_EV_OUTPUT = 'o',
+    RECORD_EV_INPUT = 'i',
+    RECORD_EV_RESIZE = 'r'
+};
+
+struct record;
+
+/*
+ * Recordings are written in asciicast v2 format, one file per session
+ * and rotated by size. pty callbacks only append events to an in-memory
+ * buffer; formatting, compression and disk I/O happen on a writer thread.
+ */
+int record_init(struct ev_loop *loop, const char *dir, bool compress);
+
+/* Returns NULL if recording is disabled. cols/rows of 0 are taken as 80x24 */
+struct record *record_open(int sid, int cols, int rows);
+
+void record_event(struct record *r, int type, const void *data, int len);
+
+void record_resize(struct record *r, int cols, int rows);
+
+/* r must not be used after this */
+void record_close(struct record *r);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _RTTY_PLUGIN_H
+#define _RTTY_PLUGIN_H
+
+/*
+ * Interface of rtty plugins: shared objects loaded from the directory given
+ * with -M. A plugin exports rtty_plugin_init(), which registers handlers for
+ * new message types. A handler runs inside rtty, on the event loop or, with
+ * RTTY_PLUGIN_THREAD, on a worker thread, so it must not block the loop.
+ */
+
+#include <stddef.h>
+
+#define RTTY_PLUGIN_API_VERSION     1
+
+/* Flags of a handler */
+#define RTTY_PLUGIN_THREAD          (1 << 0)    /* Run on a worker thread */
+#define RTTY_PLUGIN_AUTH            (1 << 1)    /* Check username and password like "cmd" */
+
+/* Errors a handler may return, as listed in COMMAND.md */
+#define RTTY_PLUGIN_ERR_PERMIT      1
+#define RTTY_PLUGIN_ERR_NOT_FOUND   2
+#define RTTY_PLUGIN_ERR_NOMEM       3
+#define RTTY_PLUGIN_ERR_SYSERR      4
+#define RTTY_PLUGIN_ERR_INVALID     7
+
+struct rtty_plugin_req;
+
+/* Returns 0 or an error. Whatever was passed to reply() is sent back */
+typedef int (*rtty_plugin_handler_t)(struct rtty_plugin_req *req, void *priv);
+
+struct rtty_plugin_api {
+    int version;
+
+    /* Only from rtty_plugin_init(). Messages of types rtty handles itself never reach a plugin */
+    int (*register_handler)(const char *type, rtty_plugin_handler_t handler, int flags, void *priv);
+
+    /* Fields of the request's attrs, "" and 0 if missing */
+    const char *(*get_string)(struct rtty_plugin_req *req, const char *name);
+    int (*get_int)(struct rtty_plugin_req *req, const char *name);
+
+    /* Append to the reply, which is binary */
+    int (*reply)(struct rtty_plugin_req *req, const void *data, size_t len);
+
+    /* printf-like, goes to rtty's log */
+    void (*log)(const char *fmt, ...);
+};
+
+/* Exported by the plugin, returns 0 on success */
+int rtty_plugin_init(const struct rtty_plugin_api *api);
+
+#endif
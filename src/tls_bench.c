@@ -0,0 +1,327 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * TLS handshake and bulk encryption benchmark against an in-process peer
+ * (a BIO pair, so only the crypto is measured). For every suite it runs
+ * full and resumed handshakes and encrypts 16 KB records, then runs once
+ * more with hardware AES masked off. Use the fastest suite with "rtty -C".
+ *
+ * rtty-tlsbench [seconds per test]
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/wait.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+
+#define RECORD_SIZE     16384
+
+struct suite {
+    const char *name;
+    int version;
+};
+
+static const struct suite suites[] = {
+    { "TLS_AES_128_GCM_SHA256", TLS1_3_VERSION },
+    { "TLS_AES_256_GCM_SHA384", TLS1_3_VERSION },
+    { "TLS_CHACHA20_POLY1305_SHA256", TLS1_3_VERSION },
+    { "ECDHE-ECDSA-AES128-GCM-SHA256", TLS1_2_VERSION },
+    { "ECDHE-ECDSA-AES256-GCM-SHA384", TLS1_2_VERSION },
+    { "ECDHE-ECDSA-CHACHA20-POLY1305", TLS1_2_VERSION }
+};
+
+static double budget = 1.0;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "%s failed\n", what);
+    ERR_print_errors_fp(stderr);
+    exit(1);
+}
+
+/* Self-signed P-256 certificate, like most device servers would use */
+static void make_cert(EVP_PKEY **key, X509 **cert)
+{
+    EVP_PKEY_CTX *kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    X509_NAME *name;
+
+    *key = NULL;
+
+    if (!kctx || EVP_PKEY_keygen_init(kctx) <= 0 ||
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1) <= 0 ||
+        EVP_PKEY_keygen(kctx, key) <= 0)
+        fail("Key generation");
+
+    EVP_PKEY_CTX_free(kctx);
+
+    *cert = X509_new();
+    X509_set_version(*cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(*cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(*cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(*cert), 3600);
+    X509_set_pubkey(*cert, *key);
+
+    name = X509_get_subject_name(*cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"rtty", -1, -1, 0);
+    X509_set_issuer_name(*cert, name);
+
+    if (!X509_sign(*cert, *key, EVP_sha256()))
+        fail("Certificate signing");
+}
+
+static SSL_CTX *new_ctx(const struct suite *s, bool server, EVP_PKEY *key, X509 *cert)
+{
+    SSL_CTX *ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+    int ok;
+
+    if (!ctx)
+        fail("SSL_CTX_new");
+
+    SSL_CTX_set_min_proto_version(ctx, s->version);
+    SSL_CTX_set_max_proto_version(ctx, s->version);
+
+    if (s->version == TLS1_3_VERSION)
+        ok = SSL_CTX_set_ciphersuites(ctx, s->name);
+    else
+        ok = SSL_CTX_set_cipher_list(ctx, s->name);
+
+    if (!ok)
+        return NULL;
+
+    if (server) {
+        SSL_CTX_use_certificate(ctx, cert);
+        SSL_CTX_use_PrivateKey(ctx, key);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+    }
+
+    return ctx;
+}
+
+/* Handshake over a BIO pair, resuming sess if given */
+static void connect_pair(SSL_CTX *sctx, SSL_CTX *cctx, SSL_SESSION *sess, SSL **server, SSL **client)
+{
+    BIO *sbio, *cbio;
+    int sdone = 0, cdone = 0;
+
+    *server = SSL_new(sctx);
+    *client = SSL_new(cctx);
+
+    BIO_new_bio_pair(&sbio, RECORD_SIZE * 4, &cbio, RECORD_SIZE * 4);
+    SSL_set_bio(*server, sbio, sbio);
+    SSL_set_bio(*client, cbio, cbio);
+
+    SSL_set_accept_state(*server);
+    SSL_set_connect_state(*client);
+
+    if (sess)
+        SSL_set_session(*client, sess);
+
+    while (!sdone || !cdone) {
+        int ret;
+
+        if (!cdone) {
+            ret = SSL_do_handshake(*client);
+            if (ret == 1)
+                cdone = 1;
+            else if (SSL_get_error(*client, ret) != SSL_ERROR_WANT_READ)
+                fail("Client handshake");
+        }
+
+        if (!sdone) {
+            ret = SSL_do_handshake(*server);
+            if (ret == 1)
+                sdone = 1;
+            else if (SSL_get_error(*server, ret) != SSL_ERROR_WANT_READ)
+                fail("Server handshake");
+        }
+    }
+}
+
+/* A byte from the server makes the client process TLS 1.3 session tickets */
+static void exchange_byte(SSL *server, SSL *client)
+{
+    char c = 0;
+
+    SSL_write(server, &c, 1);
+    SSL_read(client, &c, 1);
+}
+
+/* Without a shutdown OpenSSL marks the session not resumable */
+static void free_pair(SSL *server, SSL *client)
+{
+    SSL_shutdown(client);
+    SSL_shutdown(server);
+    SSL_free(server);
+    SSL_free(client);
+}
+
+/*
+ * Milliseconds per handshake. With *sess every handshake resumes the last
+ * ticket, as TLS 1.3 tickets are meant to be used once; *reused counts
+ * the resumptions that succeeded.
+ */
+static double handshakes(SSL_CTX *sctx, SSL_CTX *cctx, SSL_SESSION **sess, int *total, int *reused)
+{
+    double start = now(), elapsed;
+    SSL *server, *client;
+
+    *total = *reused = 0;
+
+    do {
+        connect_pair(sctx, cctx, sess ? *sess : NULL, &server, &client);
+        *reused += SSL_session_reused(client);
+        (*total)++;
+
+        if (sess) {
+            exchange_byte(server, client);
+            SSL_SESSION_free(*sess);
+            *sess = SSL_get1_session(client);
+        }
+
+        free_pair(server, client);
+
+        elapsed = now() - start;
+    } while (elapsed < budget);
+
+    return elapsed * 1000 / *total;
+}
+
+/* MB/s of SSL_write with full records; the peer's decryption isn't counted */
+static double bulk(SSL *server, SSL *client)
+{
+    static unsigned char buf[RECORD_SIZE];
+    double spent = 0, start = now();
+    size_t total = 0;
+
+    do {
+        double t = now();
+
+        if (SSL_write(client, buf, sizeof(buf)) != sizeof(buf))
+            fail("SSL_write");
+
+        spent += now() - t;
+        total += sizeof(buf);
+
+        while (SSL_read(server, buf, sizeof(buf)) > 0)
+            ;
+    } while (now() - start < budget);
+
+    return total / spent / (1024 * 1024);
+}
+
+static void run(EVP_PKEY *key, X509 *cert)
+{
+    int i;
+
+    printf("%-32s %10s %12s %12s\n", "suite", "full ms", "resumed ms", "encrypt MB/s");
+
+    for (i = 0; i < sizeof(suites) / sizeof(suites[0]); i++) {
+        const struct suite *s = &suites[i];
+        SSL_CTX *sctx = new_ctx(s, true, key, cert);
+        SSL_CTX *cctx = new_ctx(s, false, key, cert);
+        double full, resumed, mbps;
+        SSL *server, *client;
+        SSL_SESSION *sess;
+        int total, reused;
+
+        if (!sctx || !cctx) {
+            printf("%-32s not supported\n", s->name);
+            SSL_CTX_free(sctx);
+            SSL_CTX_free(cctx);
+            continue;
+        }
+
+        full = handshakes(sctx, cctx, NULL, &total, &reused);
+
+        connect_pair(sctx, cctx, NULL, &server, &client);
+        exchange_byte(server, client);
+        sess = SSL_get1_session(client);
+        mbps = bulk(server, client);
+        free_pair(server, client);
+
+        resumed = handshakes(sctx, cctx, &sess, &total, &reused);
+        SSL_SESSION_free(sess);
+
+        if (reused < total)
+            printf("%-32s %10.2f %12s %12.1f\n", s->name, full, "no", mbps);
+        else
+            printf("%-32s %10.2f %12.2f %12.1f\n", s->name, full, resumed, mbps);
+
+        SSL_CTX_free(sctx);
+        SSL_CTX_free(cctx);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bool nohw = getenv("RTTY_TLSBENCH_NOHW");
+    EVP_PKEY *key;
+    X509 *cert;
+    pid_t pid;
+
+    if (argc > 1)
+        budget = atof(argv[1]);
+
+    make_cert(&key, &cert);
+
+    printf("%s, %s hardware AES\n", OpenSSL_version(OPENSSL_VERSION), nohw ? "without" : "with");
+    run(key, cert);
+    fflush(stdout);
+
+    if (nohw)
+        return 0;
+
+    /* The capability masks are read when libcrypto is loaded, so run again in a new process */
+    pid = fork();
+    if (pid == 0) {
+        setenv("RTTY_TLSBENCH_NOHW", "1", 1);
+        setenv("OPENSSL_ia32cap", "~0x200000200000000", 1);
+        setenv("OPENSSL_armcap", "0", 1);
+        printf("\n");
+        execv("/proc/self/exe", argv);
+        exit(1);
+    }
+
+    waitpid(pid, NULL, 0);
+
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <uwsc/log.h>
+
+#include "config.h"
+#include "tune.h"
+#include "file.h"
+#include "sha256.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define PROBE_BUF_SIZE      (256 * 1024)
+#define PROBE_BUDGET        0.03    /* second per measurement */
+
+struct rtty_tuning tuning = {
+    .blk_size = RF_BLK_SIZE,
+    .pty_read_size = 4096,
+    .compress_level = 6
+};
+
+static struct rtty_probe probe;
+
+/* Run fn until the budget is used up and return MB/s */
+static double measure(void (*fn)(uint8_t *buf, size_t len), uint8_t *buf, size_t len)
+{
+    ev_tstamp start = ev_time(), elapsed;
+    size_t total = 0;
+
+    do {
+        fn(buf, len);
+        total += len;
+        elapsed = ev_time() - start;
+    } while (elapsed < PROBE_BUDGET);
+
+    return total / elapsed / (1024 * 1024);
+}
+
+static void run_memcpy(uint8_t *buf, size_t len)
+{
+    memcpy(buf + len / 2, buf, len / 2);
+    memcpy(buf, buf + len / 2, len / 2);
+}
+
+static void run_sha256(uint8_t *buf, size_t len)
+{
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    struct sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, buf, len);
+    sha256_final(&ctx, digest);
+    buf[0] ^= digest[0];
+}
+
+#ifdef HAVE_ZLIB
+static void run_crc32(uint8_t *buf, size_t len)
+{
+    buf[0] ^= crc32(0, buf, len);
+}
+
+static void run_deflate(uint8_t *buf, size_t len)
+{
+    static uint8_t out[PROBE_BUF_SIZE + 1024];
+    uLongf olen = sizeof(out);
+
+    compress2(out, &olen, buf, len, 1);
+}
+#endif
+
+/* Cost of one byte written to a pty master and read back from the slave */
+static double measure_pty()
+{
+    struct termios tio = {};
+    int master, slave, i, n = 0;
+    ev_tstamp start;
+    char c = 'x';
+
+    cfmakeraw(&tio);
+    if (openpty(&master, &slave, NULL, &tio, NULL) < 0)
+        return 0;
+
+    start = ev_time();
+    for (i = 0; i < 200 && ev_time() - start < PROBE_BUDGET; i++) {
+        if (write(master, &c, 1) != 1 || read(slave, &c, 1) != 1)
+            break;
+        n++;
+    }
+
+    close(master);
+    close(slave);
+
+    return n ? (ev_time() - start) * 1000000 / n : 0;
+}
+
+static void tune_save()
+{
+    FILE *fp = fopen(RTTY_TUNE_FILE, "w");
+
+    if (!fp)
+        return;
+
+    fprintf(fp, "blk_size=%d\npty_read_size=%d\ncompress_level=%d\n",
+        tuning.blk_size, tuning.pty_read_size, tuning.compress_level);
+    fclose(fp);
+}
+
+void tune_probe()
+{
+    uint8_t *buf = malloc(PROBE_BUF_SIZE);
+
+    if (!buf)
+        return;
+
+    memset(buf, 0x5a, PROBE_BUF_SIZE);
+
+    probe.memcpy_mbps = measure(run_memcpy, buf, PROBE_BUF_SIZE);
+    probe.sha256_mbps = measure(run_sha256, buf, PROBE_BUF_SIZE);
+#ifdef HAVE_ZLIB
+    probe.crc32_mbps = measure(run_crc32, buf, PROBE_BUF_SIZE);
+    probe.deflate_mbps = measure(run_deflate, buf, PROBE_BUF_SIZE);
+#endif
+    probe.pty_write_us = measure_pty();
+    probe.valid = true;
+
+    free(buf);
+
+    /*
+     * Large blocks and reads only pay off when copying is cheap and each
+     * syscall is expensive relative to it; small CPUs keep the defaults.
+     */
+    if (probe.memcpy_mbps > 1000) {
+        tuning.blk_size = RF_MAX_BLK_SIZE;
+        tuning.pty_read_size = RTTY_PTY_MAX_READ;
+    } else if (probe.memcpy_mbps > 300) {
+        tuning.blk_size = RF_MAX_BLK_SIZE / 2;
+        tuning.pty_read_size = 8192;
+    }
+
+    /* Keep recording compression well above the rate a terminal produces */
+    if (probe.deflate_mbps && probe.deflate_mbps < 10)
+        tuning.compress_level = 1;
+    else if (probe.deflate_mbps && probe.deflate_mbps < 40)
+        tuning.compress_level = 3;
+
+    uwsc_log_info("Probe: memcpy %.0f MB/s, sha256 %.1f MB/s, crc32 %.1f MB/s, deflate %.1f MB/s, pty %.1f us\n",
+        probe.memcpy_mbps, probe.sha256_mbps, probe.crc32_mbps, probe.deflate_mbps, probe.pty_write_us);
+
+    tune_save();
+}
+
+void tune_load()
+{
+    FILE *fp = fopen(RTTY_TUNE_FILE, "r");
+    char line[128];
+    int val;
+
+    if (!fp)
+        return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "blk_size=%d", &val) == 1 && val > 0 && val <= RF_MAX_BLK_SIZE)
+            tuning.blk_size = val;
+        else if (sscanf(line, "pty_read_size=%d", &val) == 1 && val > 0 && val <= RTTY_PTY_MAX_READ)
+            tuning.pty_read_size = val;
+        else if (sscanf(line, "compress_level=%d", &val) == 1 && val >= 0 && val <= 9)
+            tuning.compress_level = val;
+    }
+
+    fclose(fp);
+}
+
+void tune_report(struct uwsc_client *cl)
+{
+    char str[512] = "";
+
+    if (!probe.valid)
+        return;
+
+    snprintf(str, sizeof(str) - 1, "{\"type\":\"probe\",\"results\":{\"memcpy\":%.1f,\"sha256\":%.1f,"
+        "\"crc32\":%.1f,\"deflate\":%.1f,\"pty_write_us\":%.2f},\"tuning\":{\"blk_size\":%d,"
+        "\"pty_read_size\":%d,\"compress_level\":%d}}",
+        probe.memcpy_mbps, probe.sha256_mbps, probe.crc32_mbps, probe.deflate_mbps, probe.pty_write_us,
+        tuning.blk_size, tuning.pty_read_size, tuning.compress_level);
+    cl->send(cl, str, strlen(str), UWSC_OP_TEXT);
+}
@@ -0,0 +1,63 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _TUNE_H
+#define _TUNE_H
+
+#include <uwsc/uwsc.h>
+
+#define RTTY_TUNE_FILE      "/var/run/rtty.tune"
+#define RTTY_PTY_MAX_READ   16384   /* Upper bound of tuning.pty_read_size, the size of the read buffer */
+
+/* Parameters that used to be compile-time constants */
+struct rtty_tuning {
+    int blk_size;           /* Data block of a file transfer */
+    int pty_read_size;      /* Bytes read from a pty at once */
+    int compress_level;     /* zlib level of recordings */
+};
+
+struct rtty_probe {
+    bool valid;
+    double memcpy_mbps;
+    double sha256_mbps;
+    double crc32_mbps;      /* 0 without zlib */
+    double deflate_mbps;    /* 0 without zlib */
+    double pty_write_us;    /* Round trip of a one-byte write through a pty */
+};
+
+extern struct rtty_tuning tuning;
+
+/*
+ * Run a short self benchmark(well under a second), derive the tuning from
+ * it and save it to RTTY_TUNE_FILE so "rtty -S/-R" use it as well.
+ */
+void tune_probe();
+
+/* Load the tuning saved by the daemon, keeping defaults for what's missing */
+void tune_load();
+
+/* Report the probe results and tuning to the server */
+void tune_report(struct uwsc_client *cl);
+
+#endif
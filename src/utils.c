@@ -24,6 +24,7 @@
 
 #include "utils.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
@@ -75,6 +76,159 @@ int find_login(char *buf, int len)
     return -1;
 }
 
+static char *ssl_saved_conf;
+static bool ssl_pinned;
+
+static char *conf_trim(char *s)
+{
+    char *end;
+
+    while (isspace(*s))
+        s++;
+
+    end = s + strlen(s);
+    while (end > s && isspace(end[-1]))
+        *--end = 0;
+
+    return s;
+}
+
+/* Look up name in section of an OpenSSL config, the last one wins like in OpenSSL */
+static bool conf_get(FILE *fp, const char *section, const char *name, char *val, int len)
+{
+    char line[512], cur[128] = "default";
+    bool found = false;
+    char *p, *eq;
+
+    if (!fp)
+        return false;
+
+    rewind(fp);
+
+    while (fgets(line, sizeof(line), fp)) {
+        p = strchr(line, '#');
+        if (p)
+            *p = 0;
+
+        p = conf_trim(line);
+
+        if (*p == '[') {
+            eq = strchr(p, ']');
+            if (eq) {
+                *eq = 0;
+                snprintf(cur, sizeof(cur), "%s", conf_trim(p + 1));
+            }
+            continue;
+        }
+
+        eq = strchr(p, '=');
+        if (!eq || strcmp(cur, section))
+            continue;
+
+        *eq = 0;
+        if (strcmp(conf_trim(p), name))
+            continue;
+
+        snprintf(val, len, "%s", conf_trim(eq + 1));
+        found = true;
+    }
+
+    return found;
+}
+
+int ssl_pin_ciphers(const char *ciphers)
+{
+    char *list = strdup(ciphers), *tok, *save;
+    struct buffer tls13 = {}, tls12 = {};
+    char init[128], ssl[128], def[128];
+    const char *sys = getenv("OPENSSL_CONF");
+    FILE *fp, *sfp;
+
+    if (!list)
+        return -1;
+
+    for (tok = strtok_r(list, ":", &save); tok; tok = strtok_r(NULL, ":", &save)) {
+        struct buffer *b = strncmp(tok, "TLS_", 4) ? &tls12 : &tls13;
+
+        buffer_put_printf(b, "%s%s", buffer_length(b) ? ":" : "", tok);
+    }
+
+    free(list);
+
+    if (sys) {
+        ssl_saved_conf = strdup(sys);
+        if (!ssl_saved_conf) {
+            buffer_free(&tls12);
+            buffer_free(&tls13);
+            return -1;
+        }
+    } else {
+        sys = RTTY_SSL_SYSTEM_CONF;
+    }
+
+    fp = fopen(RTTY_SSL_CONF, "w");
+    if (!fp) {
+        buffer_free(&tls12);
+        buffer_free(&tls13);
+        return -1;
+    }
+
+    /*
+     * Keep everything the system config sets up and only add the suites to
+     * its system_default section, adding whichever of the sections leading
+     * there it doesn't have. Sections opened again are extended, and a key
+     * set again replaces the earlier value.
+     */
+    sfp = fopen(sys, "r");
+    if (sfp)
+        fprintf(fp, ".include %s\n\n", sys);
+
+    if (!conf_get(sfp, "default", "openssl_conf", init, sizeof(init)))
+        strcpy(init, "rtty_conf");
+    if (!conf_get(sfp, init, "ssl_conf", ssl, sizeof(ssl)))
+        strcpy(ssl, "rtty_ssl");
+    if (!conf_get(sfp, ssl, "system_default", def, sizeof(def)))
+        strcpy(def, "rtty_default");
+
+    if (sfp)
+        fclose(sfp);
+
+    fprintf(fp, "[default]\nopenssl_conf = %s\n\n[%s]\nssl_conf = %s\n\n"
+        "[%s]\nsystem_default = %s\n\n[%s]\n", init, init, ssl, ssl, def, def);
+
+    if (buffer_length(&tls12))
+        fprintf(fp, "CipherString = %.*s\n", (int)buffer_length(&tls12), (char *)buffer_data(&tls12));
+
+    if (buffer_length(&tls13))
+        fprintf(fp, "Ciphersuites = %.*s\n", (int)buffer_length(&tls13), (char *)buffer_data(&tls13));
+
+    fclose(fp);
+
+    buffer_free(&tls12);
+    buffer_free(&tls13);
+
+    if (setenv("OPENSSL_CONF", RTTY_SSL_CONF, 1) < 0)
+        return -1;
+
+    ssl_pinned = true;
+    return 0;
+}
+
+void ssl_pin_restore()
+{
+    if (!ssl_pinned)
+        return;
+
+    if (ssl_saved_conf)
+        setenv("OPENSSL_CONF", ssl_saved_conf, 1);
+    else
+        unsetenv("OPENSSL_CONF");
+
+    free(ssl_saved_conf);
+    ssl_saved_conf = NULL;
+    ssl_pinned = false;
+}
+
 bool valid_id(const char *id)
 {
     while (*id) {
@@ -86,3 +240,28 @@ bool valid_id(const char *id)
     return true;
 }
 
+
+void buffer_put_json_string(struct buffer *b, const char *s, int len)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i, start = 0;
+
+    buffer_put_u8(b, '"');
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = s[i];
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        buffer_put_data(b, s + start, i - start);
+        start = i + 1;
+
+        buffer_put_data(b, "\\u00", 4);
+        buffer_put_u8(b, hex[c >> 4]);
+        buffer_put_u8(b, hex[c & 0xf]);
+    }
+
+    buffer_put_data(b, s + start, len - start);
+    buffer_put_u8(b, '"');
+}
@@ -27,6 +27,7 @@
 
 #include <stdbool.h>
 #include <sys/types.h>
+#include <uwsc/buffer.h>
 
 int urlencode(char *buf, int blen, const char *src, int slen);
 
@@ -34,4 +35,25 @@ int find_login(char *buf, int len);
 
 bool valid_id(const char *id);
 
+#define RTTY_SSL_CONF           "/var/run/rtty-openssl.cnf"
+#define RTTY_SSL_SYSTEM_CONF    "/etc/ssl/openssl.cnf"  /* Used when OPENSSL_CONF isn't set */
+
+/*
+ * Make OpenSSL prefer the given colon separated suites(TLS 1.3 names
+ * start with TLS_) by pointing OPENSSL_CONF to a generated config that
+ * includes the system one and adds them to its system_default section.
+ * It must run before the first connection and has no effect when libuwsc
+ * uses mbedTLS or wolfSSL.
+ */
+int ssl_pin_ciphers(const char *ciphers);
+
+/*
+ * OpenSSL reads its config once, when the first TLS connection is set up.
+ * Put OPENSSL_CONF back after that so programs rtty starts don't see it.
+ */
+void ssl_pin_restore();
+
+/* Append s as a quoted JSON string */
+void buffer_put_json_string(struct buffer *b, const char *s, int len);
+
 #endif
@@ -0,0 +1,297 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
+#include <uwsc/log.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "wsframe.h"
+
+#define WS_MASK_POOL    256
+#define WS_MAX_CORKED   4       /* The primary and the bulk connection */
+
+struct ws_stats ws_stats;
+
+struct ws_conn {
+    struct uwsc_client cl;
+    int refs;
+    bool closed;
+};
+
+static struct uwsc_client *corked[WS_MAX_CORKED];
+static int ncorked;
+static struct ev_prepare flush_watcher;
+
+void ws_mask_scalar(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t key[4])
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        dst[i] = src[i] ^ key[i % 4];
+}
+
+void ws_mask(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t key[4])
+{
+    uint32_t k32;
+    uint64_t k64;
+    size_t i = 0;
+
+    memcpy(&k32, key, 4);
+    k64 = ((uint64_t)k32 << 32) | k32;
+
+    /* Every block is a multiple of 4 bytes, so the key phase never shifts */
+#if defined(__SSE2__)
+    __m128i k128 = _mm_set1_epi32(k32);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(v, k128));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t k128 = vreinterpretq_u8_u32(vdupq_n_u32(k32));
+
+    for (; i + 16 <= len; i += 16)
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), k128));
+#endif
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+
+        memcpy(&v, src + i, 8);
+        v ^= k64;
+        memcpy(dst + i, &v, 8);
+    }
+
+    for (; i < len; i++)
+        dst[i] = src[i] ^ key[i % 4];
+}
+
+/* Fill buf from the kernel's CSPRNG, /dev/urandom where getrandom() is missing */
+static int fill_random(uint8_t *buf, int len)
+{
+    int n, fd, got = 0;
+
+    while (got < len) {
+        n = getrandom(buf + got, len - got, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != ENOSYS)
+                return -1;
+
+            fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return -1;
+
+            n = read(fd, buf + got, len - got);
+            close(fd);
+
+            if (n <= 0)
+                return -1;
+        }
+
+        got += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Masking keys come from a pool refilled from the kernel. Predictable keys
+ * are what masking exists to prevent, so without randomness there is no key.
+ */
+static int get_mask_key(uint8_t key[4])
+{
+    static uint8_t pool[WS_MASK_POOL];
+    static int pos = WS_MASK_POOL;
+
+    if (pos == WS_MASK_POOL) {
+        if (fill_random(pool, sizeof(pool)) < 0)
+            return -1;
+        pos = 0;
+    }
+
+    memcpy(key, pool + pos, 4);
+    pos += 4;
+
+    return 0;
+}
+
+static void flush_cb(struct ev_loop *loop, struct ev_prepare *w, int revents)
+{
+    int i;
+
+    for (i = 0; i < ncorked; i++) {
+        ev_io_start(loop, &corked[i]->iow);
+        ws_stats.flushes++;
+    }
+
+    ncorked = 0;
+    ev_prepare_stop(loop, w);
+}
+
+static void cork(struct uwsc_client *cl)
+{
+    int i;
+
+    for (i = 0; i < ncorked; i++) {
+        if (corked[i] == cl)
+            return;
+    }
+
+    if (ncorked == WS_MAX_CORKED) {
+        ev_io_start(cl->loop, &cl->iow);
+        ws_stats.flushes++;
+        return;
+    }
+
+    if (!ncorked) {
+        ev_prepare_init(&flush_watcher, flush_cb);
+        ev_prepare_start(cl->loop, &flush_watcher);
+    }
+
+    corked[ncorked++] = cl;
+}
+
+void ws_detach(struct uwsc_client *cl)
+{
+    int i;
+
+    for (i = 0; i < ncorked; i++) {
+        if (corked[i] == cl) {
+            corked[i] = corked[--ncorked];
+            break;
+        }
+    }
+}
+
+struct uwsc_client *ws_new(struct ev_loop *loop, const char *url, int ping_interval,
+    const char *extra_header)
+{
+    struct ws_conn *c = calloc(1, sizeof(struct ws_conn));
+
+    if (!c)
+        return NULL;
+
+    if (uwsc_init(&c->cl, loop, url, ping_interval, extra_header) < 0) {
+        free(c);
+        return NULL;
+    }
+
+    return &c->cl;
+}
+
+void ws_hold(struct uwsc_client *cl)
+{
+    container_of(cl, struct ws_conn, cl)->refs++;
+}
+
+void ws_put(struct uwsc_client *cl)
+{
+    struct ws_conn *c = container_of(cl, struct ws_conn, cl);
+
+    if (--c->refs == 0 && c->closed)
+        free(c);
+}
+
+void ws_free(struct uwsc_client *cl)
+{
+    struct ws_conn *c = container_of(cl, struct ws_conn, cl);
+
+    ws_detach(cl);
+
+    c->closed = true;
+    if (!c->refs)
+        free(c);
+}
+
+void ws_stats_put(struct buffer *b)
+{
+    buffer_put_printf(b, "\"ws\":{\"frames\":%llu,\"flushes\":%llu,\"bytes\":%llu,\"saved\":%llu}",
+        (unsigned long long)ws_stats.frames, (unsigned long long)ws_stats.flushes,
+        (unsigned long long)ws_stats.bytes, (unsigned long long)(ws_stats.frames - ws_stats.flushes));
+}
+
+int ws_send(struct uwsc_client *cl, const void *data, size_t len, int op)
+{
+    uint8_t key[4];
+    uint8_t *p;
+    int hdrlen = 2;
+
+    if (get_mask_key(key) < 0) {
+        uwsc_log_err("No random masking key: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (len > 65535)
+        hdrlen += 8;
+    else if (len > 125)
+        hdrlen += 2;
+
+    p = buffer_put(&cl->wb, hdrlen + 4 + len);
+    if (!p)
+        return -1;
+
+    *p++ = 0x80 | op;
+
+    if (len > 65535) {
+        uint32_t hi = htonl((uint64_t)len >> 32), lo = htonl(len & 0xffffffff);
+
+        *p++ = 0x80 | 127;
+        memcpy(p, &hi, 4);
+        memcpy(p + 4, &lo, 4);
+        p += 8;
+    } else if (len > 125) {
+        uint16_t l = htons(len);
+
+        *p++ = 0x80 | 126;
+        memcpy(p, &l, 2);
+        p += 2;
+    } else {
+        *p++ = 0x80 | len;
+    }
+
+    memcpy(p, key, 4);
+    p += 4;
+
+    ws_mask(p, data, len, key);
+
+    ws_stats.frames++;
+    ws_stats.bytes += hdrlen + 4 + len;
+
+    cork(cl);
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019 Jianhui Zhao <zhaojh329@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _WSFRAME_H
+#define _WSFRAME_H
+
+#include <uwsc/uwsc.h>
+
+/*
+ * Client framing that replaces cl->send of libuwsc: the header and the
+ * masked payload are written straight into cl->wb in one pass, masking
+ * 16 bytes at a time with SSE2/NEON or 8 bytes at a time otherwise.
+ */
+int ws_send(struct uwsc_client *cl, const void *data, size_t len, int op);
+
+/*
+ * Frames are only appended to cl->wb; the write watchers of all clients
+ * sent to are started once per loop iteration, right before the loop
+ * blocks, so libuwsc writes everything queued in that iteration with one
+ * write(or SSL_write, which fills records up to their maximum size).
+ * Must be called before a client is freed.
+ */
+void ws_detach(struct uwsc_client *cl);
+
+/*
+ * Connections that jobs reply over are allocated with ws_new(). A job
+ * holds its connection from when it's queued until it's freed, and a
+ * closed connection released with ws_free() is only freed once the last
+ * job holding it is done, so its send must not use the socket any more.
+ * Loop thread only.
+ */
+struct uwsc_client *ws_new(struct ev_loop *loop, const char *url, int ping_interval,
+    const char *extra_header);
+void ws_hold(struct uwsc_client *cl);
+void ws_put(struct uwsc_client *cl);
+void ws_free(struct uwsc_client *cl);
+
+struct ws_stats {
+    uint64_t frames;
+    uint64_t flushes;       /* One write watcher started per client and iteration */
+    uint64_t bytes;
+};
+
+extern struct ws_stats ws_stats;
+
+/* Append "ws":{...} to a stats reply */
+void ws_stats_put(struct buffer *b);
+
+/* dst = src ^ key, key repeated from its first byte. dst may equal src */
+void ws_mask(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t key[4]);
+
+/* The byte at a time loop, kept for the benchmark */
+void ws_mask_scalar(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t key[4]);
+
+#endif